@@ -30,6 +30,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <math.h>
 #include <string.h>
 #include <pthread.h>
@@ -52,10 +53,21 @@
 #include "graph.h"
 #include "mx.h"
 #include "serial.h"
+#include "transport.h"
+#include "loop.h"
+#include "param.h"
 #include "attitude.h"
 
 #define MAX_ANALOGDATA_ENTRY 10
 
+/*
+ * one sample of sensors data, left in the packet it came with
+ */
+typedef struct _analog_sample_struct {
+	packet_t *p; /* referenced, NULL if empty */
+	guint index; /* sample of ANALOG_DATA_BATCH */
+} analog_sample_t;
+
 /*
  * static variables
  */
@@ -73,44 +85,118 @@ static graph_t acc_graph;
 static graph_t gyro_graph;
 /* communication */
 static mx_t mx;
-static serial_t serial;
+static transport_t transport;
+static loop_t loop; /* one worker reads link and runs mx */
+static loop_link_t loop_link;
+static gboolean link_served = FALSE;
+static param_table_t params;
 /* acc & gyro data*/
 static guint accdata_process_index = 0;
-static guint accdata_present_index = 0;
 static guint gyrodata_process_index = 0;
-static guint gyrodata_present_index = 0;
-static analog_data_t acc_data[MAX_ANALOGDATA_ENTRY];
-static analog_data_t gyro_data[MAX_ANALOGDATA_ENTRY];
+static guint analog_present_index = 0;
+static analog_sample_t analog_data[MAX_ANALOGDATA_ENTRY]; /* shared by graphs */
 /* mutex */
 static pthread_mutex_t copter_render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t analog_data_mutex = PTHREAD_MUTEX_INITIALIZER; /* analog_data, analog_present_index */
 /* attitude */
 static float yaw_patch = 0;
 static attitude_t attitude;
 
+static guint analog_channel_number(const analog_sample_t *s)
+{
+	if (s->p == NULL)
+		return 0;
+	if (s->p->type == ANALOG_DATA_BATCH)
+		return s->p->raw.analog_batch.channel_number;
+	return s->p->raw.analog_data.channel_number;
+}
+
+static gshort analog_value(const analog_sample_t *s, guint channel)
+{
+	guint n = analog_channel_number(s);
+
+	if (channel >= n)
+		return 0;
+	if (s->p->type == ANALOG_DATA_BATCH)
+		return s->p->raw.analog_batch.value[s->index * n + channel];
+	return s->p->raw.analog_data.value[channel];
+}
+
+/*
+ * copy of analog_data[index] holding its own packet reference, so rx
+ * thread may replace the slot meanwhile, give it back by analog_sample_put()
+ */
+static void analog_sample_get(guint index, analog_sample_t *s)
+{
+	pthread_mutex_lock(&analog_data_mutex);
+	*s = analog_data[index];
+	if (s->p)
+		mx_packet_ref(s->p);
+	pthread_mutex_unlock(&analog_data_mutex);
+}
+
+static void analog_sample_put(analog_sample_t *s)
+{
+	if (s->p)
+		mx_packet_unref(s->p);
+	s->p = NULL;
+}
+
+static gboolean analog_sample_pending(guint process_index)
+{
+	gboolean pending;
+
+	pthread_mutex_lock(&analog_data_mutex);
+	pending = (analog_present_index != process_index);
+	pthread_mutex_unlock(&analog_data_mutex);
+
+	return pending;
+}
+
+/*
+ * one sample of sensors data, packet is referenced instead of copied
+ */
+static void parse_analog_sample(packet_t *p, guint index)
+{
+	analog_sample_t *s;
+	analog_sample_t sample;
+	packet_t *old;
+
+	// update analog data buffer
+	pthread_mutex_lock(&analog_data_mutex);
+	s = &analog_data[analog_present_index];
+	old = s->p;
+	s->p = mx_packet_ref(p);
+	s->index = index;
+	ADD_ONE_WITH_WRAP_AROUND(analog_present_index, MAX_ANALOGDATA_ENTRY);
+	pthread_mutex_unlock(&analog_data_mutex);
+	if (old)
+		mx_packet_unref(old);
+	// attitude, 'p' is held by dispatcher until we return
+	sample.p = p;
+	sample.index = index;
+	attitude.acc_crt_x = analog_value(&sample, ACCX_CHANNEL);
+	attitude.acc_crt_y = analog_value(&sample, ACCY_CHANNEL);
+	attitude.acc_crt_z = analog_value(&sample, ACCZ_CHANNEL);
+	attitude_by_acc(&attitude);
+}
+
 /*
  * parse input packet and update pertinent variables
  */
 gint parse_packet(packet_t *p, void *arg)
 {
-	int i;
-	float adc, vol;
-	float accx, accy, accz;
+	guint i;
 
 	if (p->type == ANALOG_NAME_RESPONSE) {
 		// to be continued. @_@
 	} else if (p->type == ANALOG_DATA_RESPONSE) {
-		// update analog data buffer
-		memcpy(&acc_data[accdata_present_index], 
-			    &p->raw.analog_data, sizeof(analog_data_t));
-		ADD_ONE_WITH_WRAP_AROUND(accdata_present_index, MAX_ANALOGDATA_ENTRY);
-		memcpy(&gyro_data[gyrodata_present_index], 
-			    &p->raw.analog_data, sizeof(analog_data_t));
-		ADD_ONE_WITH_WRAP_AROUND(gyrodata_present_index, MAX_ANALOGDATA_ENTRY);
-		// attitude
-		attitude.acc_crt_x = p->raw.analog_data.value[ACCX_CHANNEL];
-		attitude.acc_crt_y = p->raw.analog_data.value[ACCY_CHANNEL];
-		attitude.acc_crt_z = p->raw.analog_data.value[ACCZ_CHANNEL];
-		attitude_by_acc(&attitude);
+		parse_analog_sample(p, 0);
+	} else if (p->type == ANALOG_DATA_BATCH) {
+		// every sample of a batch refers the same packet
+		for (i = 0; i < p->raw.analog_batch.sample_number; i++) {
+			parse_analog_sample(p, i);
+		}
 	}
 
 	return 0;
@@ -120,11 +206,13 @@ gint acc_graph_callback(graph_t *g, guint channel, gfloat *data)
 {
 	gfloat f;
 	gchar buffer[20];
+	analog_sample_t s;
 
-	if (channel > acc_data[accdata_process_index].channel_number) {
+	analog_sample_get(accdata_process_index, &s);
+	if (channel > analog_channel_number(&s)) {
 		*data = EMPTY_DATA;
 	} else {
-		f = (float)acc_data[accdata_process_index].value[channel -1];
+		f = (float)analog_value(&s, channel -1);
 		*data = (f * 3300) / 4096.0;
 		switch (channel) {
 		case 1:
@@ -139,6 +227,7 @@ gint acc_graph_callback(graph_t *g, guint channel, gfloat *data)
 		}
 		graph_set_channel_name(&acc_graph, channel, buffer);
 	}
+	analog_sample_put(&s);
 
 	return 0;
 }
@@ -147,11 +236,13 @@ gint gyro_graph_callback(graph_t *g, guint channel, gfloat *data)
 {
 	gfloat f;
 	gchar buffer[20];
+	analog_sample_t s;
 
-	if (channel > gyro_data[gyrodata_process_index].channel_number) {
+	analog_sample_get(gyrodata_process_index, &s);
+	if (channel > analog_channel_number(&s)) {
 		*data = EMPTY_DATA;
 	} else {
-		f = (float)gyro_data[gyrodata_process_index].value[channel + 3 -1]; // 3, 4, 5 for gyros
+		f = (float)analog_value(&s, channel + 3 -1); // 3, 4, 5 for gyros
 		*data = (f * 3300) / 4096.0;
 		switch (channel) {
 		case 1:
@@ -166,16 +257,81 @@ gint gyro_graph_callback(graph_t *g, guint channel, gfloat *data)
 		}
 		graph_set_channel_name(&gyro_graph, channel, buffer);
 	}
+	analog_sample_put(&s);
 
 	return 0;
 }
 
+/*
+ * mx rx thread: parameters uploaded by -P
+ */
+static void params_uploaded(param_table_t *t, gint result, void *arg)
+{
+	if (result < 0)
+		g_warning("device parameters not all written\n");
+	else
+		g_print("device parameters written and saved\n");
+}
+
+/*
+ * mx rx thread: parameter table read, upload what -P changed
+ */
+static void params_fetched(param_table_t *t, gint result, void *arg)
+{
+	guint i;
+	gint value;
+
+	if (result < 0)
+		g_warning("device parameters not all read\n");
+	for (i = 0; i < t->number; i++) {
+		if (param_get(t, i, &value) == 0)
+			g_print("param %u = %d\n", i, value);
+	}
+	if (param_dirty(t) > 0)
+		param_upload(t, TRUE, params_uploaded, NULL);
+}
+
+/*
+ * mx rx thread: framing negotiated, requests sent while device switched
+ * framing would have been lost, so the parameter table is read now
+ */
+static void params_negotiated(packet_t *request, packet_t *response, void *arg)
+{
+	param_fetch(&params, params_fetched, NULL);
+}
+
+/*
+ * main loop: tell the user, link lost is reported on its reader
+ */
+static gboolean link_lost_idle(gpointer data)
+{
+	g_warning("device link lost\n");
+	gtk_window_set_title(GTK_WINDOW(data), "amcc - link lost");
+	return FALSE;
+}
+
+/*
+ * link loop worker: transport can't read the link anymore
+ */
+static void link_lost(void *arg)
+{
+	g_idle_add(link_lost_idle, arg);
+}
+
 static void usage ()
 {
 	fprintf(stderr, "Usage: amcc [option]\n");
-	fprintf(stderr, "\t -d      serial device (eg: /dev/ttyS0)\n");
+	fprintf(stderr, "\t -d      serial device or link (eg: /dev/ttyS0, tcp://host:port,\n");
+	fprintf(stderr, "\t         tcp-listen://:port, udp://host:port, udp-listen://:port,\n");
+	fprintf(stderr, "\t         unix:///path, unix-listen:///path)\n");
 	fprintf(stderr, "\t -f      serial speed (eg: 57600)\n");
 	fprintf(stderr, "\t -m      3D model filename (eg: ./copter.3ds)\n");
+	fprintf(stderr, "\t -p      read and print n device parameters (eg: 16)\n");
+	fprintf(stderr, "\t -P      write index=value to device and save it, with -p\n");
+	fprintf(stderr, "\t -b, --rx-batch\n");
+	fprintf(stderr, "\t         fewer wakeups on fast links, adds some ms latency\n");
+	fprintf(stderr, "\t -i, --stats-interval\n");
+	fprintf(stderr, "\t         print link statistics every n seconds (eg: 10)\n");
 	fprintf(stderr, "\t -h      this usage info\n");
 }
 
@@ -202,18 +358,27 @@ void set_scale (GtkButton *button, gpointer data)
 void on_start_activate (GtkWidget* widget, gpointer data)
 {
 	const gchar *label;
+	analog_sample_t s;
+	guint i;
 	
 	label = gtk_menu_item_get_label ((GtkMenuItem*) widget);
 	if (label[2] == 'o') {  
 		mx_rx_unregister(&mx, ANALOG_DATA_RESPONSE, parse_packet);
+		mx_rx_unregister(&mx, ANALOG_DATA_BATCH, parse_packet);
 		gtk_menu_item_set_label ((GtkMenuItem*) widget, "Start");
 		// sensors caliberation
-		attitude.acc_nml_x = acc_data[accdata_present_index].value[ACCX_CHANNEL];
-		attitude.acc_nml_y = acc_data[accdata_present_index].value[ACCY_CHANNEL];
-		attitude.acc_nml_z = acc_data[accdata_present_index].value[ACCZ_CHANNEL];
+		pthread_mutex_lock(&analog_data_mutex);
+		i = analog_present_index;
+		pthread_mutex_unlock(&analog_data_mutex);
+		analog_sample_get(i, &s);
+		attitude.acc_nml_x = analog_value(&s, ACCX_CHANNEL);
+		attitude.acc_nml_y = analog_value(&s, ACCY_CHANNEL);
+		attitude.acc_nml_z = analog_value(&s, ACCZ_CHANNEL);
+		analog_sample_put(&s);
 
 	} else {
 		mx_rx_register(&mx, ANALOG_DATA_RESPONSE, parse_packet, NULL);
+		mx_rx_register(&mx, ANALOG_DATA_BATCH, parse_packet, NULL);
 		gtk_menu_item_set_label ((GtkMenuItem*) widget, "Stop");
 	}
 }
@@ -523,7 +688,7 @@ static gboolean update_accs_graph(gpointer data)
 {
 	graph_t *g = (graph_t*)data;
 
-	if (accdata_present_index != accdata_process_index) {
+	if (analog_sample_pending(accdata_process_index)) {
 		graph_force_update(g);
 		ADD_ONE_WITH_WRAP_AROUND(accdata_process_index, MAX_ANALOGDATA_ENTRY);
 	}
@@ -534,21 +699,34 @@ static gboolean update_gyros_graph(gpointer data)
 {
 	graph_t *g = (graph_t*)data;
 
-	if (gyrodata_present_index != gyrodata_process_index) {
+	if (analog_sample_pending(gyrodata_process_index)) {
 		graph_force_update(g);
 		ADD_ONE_WITH_WRAP_AROUND(gyrodata_process_index, MAX_ANALOGDATA_ENTRY);
 	}
 	return TRUE;
 }
 
+static gboolean stats_timer_event(gpointer data)
+{
+	mx_stats_t s;
+
+	mx_stats((mx_t*)data, &s);
+	mx_stats_dump(&s);
+	return TRUE;
+}
+
 /*
  * destroy (program quits)
  */
 void destroy (GtkWidget *widget, gpointer data)
 {
 	gtk_main_quit ();
-	serial_close(&serial);
+	if (link_served)
+		loop_remove(&loop, &loop_link);
+	transport_close(&transport);
 	mx_destroy(&mx);
+	loop_destroy(&loop);
+	param_destroy(&params);
 	if (copter_normals)
 		free((void*)copter_normals);
 	if (copter_vertices)
@@ -572,15 +750,28 @@ int main (int argc, char *argv[])
 	extern int opterr;
 	extern int optreset;
 
-	char *optstr="d:m:s:h";
+	char *optstr="d:m:s:p:P:bi:h";
+	static const struct option longopt[] = {
+		{ "rx-batch", no_argument, NULL, 'b' },
+		{ "stats-interval", required_argument, NULL, 'i' },
+		{ NULL, 0, NULL, 0 }
+	};
 	char *sdev = NULL;
 	int sspeed = -1;
+	int stats_interval = 0;
+	int param_number = 0;
+	GSList *param_sets = NULL, *l;
+	guint param_index;
+	gint param_value;
+	int rx_mode = SERIAL_RX_LOW_LATENCY;
+	transport_config_t transport_config;
+	mx_config_t mx_config;
 	int opt = 0;
 
 	/*
 	 * Init argument control
 	 */
-	opt = getopt( argc, argv, optstr);
+	opt = getopt_long(argc, argv, optstr, longopt, NULL);
 	while( opt != -1 ) {
 		switch( opt ) {
 		case 'd':
@@ -591,13 +782,25 @@ int main (int argc, char *argv[])
 		case 's':
 			sspeed = atoi(optarg);
 			break;
+		case 'p':
+			param_number = atoi(optarg);
+			break;
+		case 'P':
+			param_sets = g_slist_append(param_sets, optarg);
+			break;
+		case 'b':
+			rx_mode = SERIAL_RX_BATCH;
+			break;
+		case 'i':
+			stats_interval = atoi(optarg);
+			break;
 		case 'h':
 			usage();
 			return 0;
 		default:
 			break;
 		}
-		opt = getopt(argc, argv, optstr);
+		opt = getopt_long(argc, argv, optstr, longopt, NULL);
 	}
 
 	if (!g_thread_supported ()) { 
@@ -689,13 +892,45 @@ int main (int argc, char *argv[])
 			    graph_get_widget(&gyro_graph),
 			    TRUE, TRUE, 0);	graph_set_data(&gyro_graph, 0, 3300);
 
-	mx_init(&mx, serial_tx_data, (void*)&serial);
-	serial_init(&serial, mx_rx_data, &mx);
+	if (loop_init(&loop, 1) < 0) {
+		g_critical ("Failed to start link loop.\n");
+		return -1;
+	}
+	mx_config_default(&mx_config);
+	mx_config.thread = FALSE;
+	if (mx_init(&mx, transport_tx_data, (void*)&transport, &mx_config) < 0) {
+		g_critical ("Failed to allocate mx buffers.\n");
+		return -1;
+	}
+	transport_config_default(&transport_config);
 	if (!sdev)
 		sdev = DEFAULT_SERIAL_DEV; 
-	if (sspeed == -1)
-		sspeed = 57600;
-	serial_open(&serial, sdev, sspeed);
+	if (sspeed != -1)
+		transport_config.baudrate = sspeed;
+	transport_config.rx_mode = rx_mode;
+	transport_config.thread = FALSE;
+	mx_link_notify(&mx, link_lost, mainWindow);
+	if (transport_open(&transport, sdev, &mx, &transport_config) < 0) {
+		g_critical ("Failed to open %s.\n", sdev);
+		return -1;
+	}
+	if (transport.serial.baudrate &&
+			transport.serial.baudrate != transport_config.baudrate)
+		g_print("%s runs at %u baud (%u asked)\n", sdev, transport.serial.baudrate,
+			transport_config.baudrate);
+	link_served = loop_add(&loop, &loop_link, &transport) == 0;
+	if (!link_served) {
+		g_critical ("Failed to serve %s.\n", sdev);
+		return -1;
+	}
+	param_init(&params, &mx, param_number);
+	for (l = param_sets; l; l = l->next) {
+		if (sscanf((gchar*)l->data, "%u=%d", &param_index, &param_value) != 2 ||
+				param_set(&params, param_index, param_value) < 0)
+			g_warning("bad -P %s\n", (gchar*)l->data);
+	}
+	g_slist_free(param_sets);
+	mx_negotiate(&mx, param_number > 0 ? params_negotiated : NULL, NULL);
 
 	/*
 	 * Show main window.
@@ -707,6 +942,8 @@ int main (int argc, char *argv[])
 	g_timeout_add (1000 / 10, render_timer_event, copterDrawingArea);
 	g_timeout_add (1000 / 10, update_accs_graph, &acc_graph);
 	g_timeout_add (1000 / 10, update_gyros_graph, &gyro_graph);
+	if (stats_interval > 0)
+		g_timeout_add_seconds(stats_interval, stats_timer_event, &mx);
 
 	// Run the window manager loop.
 	gtk_main ();
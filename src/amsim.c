@@ -0,0 +1,736 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * amsim: copter simulator for testing AMCC without hardware.
+ * it plays the MCU side of the protocol on a pseudo terminal, frames
+ * are made by packet.c like real firmware does.
+ */
+
+#define _GNU_SOURCE /* ppoll() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+#include "amcc.h"
+#include "packet.h"
+
+/*
+ * macro
+ */
+
+#define SIM_CHANNEL 6 /* ACCX_CHANNEL ... GYROZ_CHANNEL */
+#define SIM_MAX_BATCH (MAX_BATCH_VALUE / SIM_CHANNEL)
+#define SIM_BOARD 0x53 /* 'S' */
+#define SIM_FIRMWARE 1
+#define SIM_CAPABILITY (PACKET_MODE_COBS | PACKET_MODE_CRC16 | PACKET_MODE_CRC32 | \
+				PACKET_MODE_SEQ)
+#define SIM_PARAM 16
+
+#define SIM_READ_LENGTH 4096
+#define SIM_OUT_BUFFER 65536
+#define SIM_OUT_LIMIT 4096 /* UART buffer of MCU, samples are dropped above it */
+#define SIM_SATURATE 256 /* rate 0: keep this much queued for the line */
+#define SIM_LINE_FIFO 64 /* bytes the emulated UART sends back to back */
+#define SIM_GARBAGE 16 /* longest run of line noise */
+
+/* sensors, see attitude.c */
+#define SIM_ACC_0G 1650 /* mV */
+#define SIM_ACC_1G 800 /* mV per g */
+#define SIM_GYRO_0DPS 1800 /* mV */
+#define SIM_GYRO_DPS 6.7 /* mV per degree/s */
+#define SIM_ADC_MAX 3300 /* mV */
+
+/* motion: roll / pitch swing, yaw turns back and forth */
+#define SIM_ROLL 30.0 /* degree */
+#define SIM_ROLL_HZ 0.5
+#define SIM_PITCH 20.0 /* degree */
+#define SIM_PITCH_HZ 0.3
+#define SIM_YAW_RATE 45.0 /* degree/s */
+#define SIM_YAW_HZ 0.1
+
+#define NSEC 1000000000LL
+
+/*
+ * data structure
+ */
+
+typedef struct _sim_config_struct {
+	unsigned int rate; /* samples/s, 0: as many as the line takes */
+	unsigned int baudrate; /* emulated line, 0: pty speed */
+	unsigned int batch; /* samples per frame, 1: ANALOG_DATA_RESPONSE */
+	unsigned int burst; /* frames written together */
+	unsigned int noise; /* mV */
+	double corrupt; /* frames with a flipped bit */
+	double garbage; /* frames following line noise */
+	unsigned int capability;
+	unsigned int param_number;
+	unsigned int seed;
+	unsigned int time; /* s, 0: until killed */
+	unsigned int stats_interval; /* s */
+	const char *link;
+} sim_config_t;
+
+typedef struct _sim_stats_struct {
+	unsigned long long samples;
+	unsigned long long dropped; /* samples not fitting UART buffer */
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long corrupted;
+	unsigned long long garbage; /* bytes */
+	unsigned long long requests;
+	unsigned long long bad; /* frames from host failing decode */
+} sim_stats_t;
+
+typedef struct _sim_struct {
+	sim_config_t config;
+	int master;
+	int slave; /* kept open, so master never sees hangup */
+	char name[64];
+
+	/* protocol */
+	unsigned int mode;
+	packet_framer_t framer;
+	unsigned int overflow;
+	packet_t rx;
+	packet_framer_t hello; /* ASCII DEVICE_INFO_REQUEST of restarted host */
+	packet_t hello_rx;
+	unsigned char sequence[PACKET_TYPE_NUMBER];
+	int param[SIM_PARAM];
+	packet_t frame; /* samples collected for next frame */
+	unsigned int frame_samples;
+	unsigned int burst_frames;
+
+	/* out[tail, ready) may be written, [ready, head) waits for burst */
+	unsigned char out[SIM_OUT_BUFFER];
+	unsigned int head;
+	unsigned int ready;
+	unsigned int tail;
+
+	long long start;
+	long long next_sample;
+	long long line_time;
+	double line_credit; /* bytes */
+	unsigned int random;
+
+	sim_stats_t stats;
+	sim_stats_t last; /* at last report */
+	long long last_time;
+} sim_t;
+
+/*
+ * static variables
+ */
+
+static volatile sig_atomic_t sim_quit;
+static sim_t sim;
+
+static const char *sim_channel_name[SIM_CHANNEL] = {
+	"acc_x", "acc_y", "acc_z", "gyro_x", "gyro_y", "gyro_z"
+};
+
+/*
+ * functions
+ */
+
+static long long sim_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * NSEC + t.tv_nsec;
+}
+
+/* xorshift, repeatable with --seed */
+static unsigned int sim_random(sim_t *s)
+{
+	s->random ^= s->random << 13;
+	s->random ^= s->random >> 17;
+	s->random ^= s->random << 5;
+	return s->random;
+}
+
+/* [0, 1) */
+static double sim_uniform(sim_t *s)
+{
+	return (sim_random(s) >> 8) / 16777216.0;
+}
+
+static short sim_adc(double mv)
+{
+	if (mv < 0)
+		return 0;
+	if (mv > SIM_ADC_MAX)
+		return SIM_ADC_MAX;
+	return (short)lrint(mv);
+}
+
+/*
+ * sensors at 't' seconds: gravity seen by the rotated accelerometer
+ * and turn rates of the same motion, plus triangular noise
+ */
+static void sim_sensors(sim_t *s, double t, short *value)
+{
+	double roll, pitch, w[3], a[3], n;
+	unsigned int i;
+
+	roll = SIM_ROLL * sin(2 * M_PI * SIM_ROLL_HZ * t);
+	pitch = SIM_PITCH * sin(2 * M_PI * SIM_PITCH_HZ * t);
+	w[0] = SIM_ROLL * 2 * M_PI * SIM_ROLL_HZ * cos(2 * M_PI * SIM_ROLL_HZ * t);
+	w[1] = SIM_PITCH * 2 * M_PI * SIM_PITCH_HZ * cos(2 * M_PI * SIM_PITCH_HZ * t);
+	w[2] = SIM_YAW_RATE * sin(2 * M_PI * SIM_YAW_HZ * t);
+	roll *= M_PI / 180;
+	pitch *= M_PI / 180;
+	a[0] = -sin(pitch);
+	a[1] = sin(roll) * cos(pitch);
+	a[2] = cos(roll) * cos(pitch);
+
+	for (i = 0; i < 3; i++) {
+		n = s->config.noise * (sim_uniform(s) + sim_uniform(s) - 1);
+		value[ACCX_CHANNEL + i] = sim_adc(SIM_ACC_0G + SIM_ACC_1G * a[i] + n);
+		n = s->config.noise * (sim_uniform(s) + sim_uniform(s) - 1);
+		value[GYROX_CHANNEL + i] = sim_adc(SIM_GYRO_0DPS + SIM_GYRO_DPS * w[i] + n);
+	}
+}
+
+static unsigned int sim_queued(const sim_t *s)
+{
+	return s->head - s->tail;
+}
+
+/*
+ * encode 'p' in current mode and append it to out buffer, line noise
+ * and bit errors are added here. return -1 if it doesn't fit.
+ */
+static int sim_queue(sim_t *s, packet_t *p)
+{
+	unsigned int index, i, n;
+
+	index = (unsigned int)p->type - PACKET_TYPE_FIRST;
+	p->sequence = s->sequence[index];
+	if (packet_encode_mode(p, s->mode) != PACKET_SUCCESS)
+		return -1;
+	if (s->head + SIM_GARBAGE + p->data_length > SIM_OUT_BUFFER) {
+		memmove(s->out, s->out + s->tail, s->head - s->tail);
+		s->head -= s->tail;
+		s->ready -= s->tail;
+		s->tail = 0;
+		if (s->head + SIM_GARBAGE + p->data_length > SIM_OUT_BUFFER)
+			return -1;
+	}
+	if (s->mode & PACKET_MODE_SEQ)
+		s->sequence[index]++;
+
+	if (s->config.garbage > 0 && sim_uniform(s) < s->config.garbage) {
+		n = 1 + sim_random(s) % SIM_GARBAGE;
+		for (i = 0; i < n; i++) {
+			s->out[s->head++] = sim_random(s);
+		}
+		s->stats.garbage += n;
+	}
+	if (s->config.corrupt > 0 && sim_uniform(s) < s->config.corrupt) {
+		p->data[sim_random(s) % p->data_length] ^= 1 << (sim_random(s) % 8);
+		s->stats.corrupted++;
+	}
+	memcpy(s->out + s->head, p->data, p->data_length);
+	s->head += p->data_length;
+	s->stats.frames++;
+
+	return 0;
+}
+
+/*
+ * answers go out at once, they take frames of unfinished burst along
+ */
+static void sim_answer(sim_t *s, packet_t *p)
+{
+	sim_queue(s, p);
+	s->ready = s->head;
+	s->burst_frames = 0;
+}
+
+/*
+ * sample taken at 'when', frame is queued when batch is full, or
+ * dropped with its samples when UART buffer is full
+ */
+static void sim_sample(sim_t *s, long long when)
+{
+	packet_t *p = &s->frame;
+	short value[SIM_CHANNEL];
+	unsigned int n = s->frame_samples;
+
+	sim_sensors(s, (when - s->start) / (double)NSEC, value);
+	s->stats.samples++;
+	if (s->config.batch == 1) {
+		p->type = ANALOG_DATA_RESPONSE;
+		p->raw.analog_data.channel_number = SIM_CHANNEL;
+		memcpy(p->raw.analog_data.value, value, sizeof(value));
+	} else {
+		if (n == 0) {
+			p->type = ANALOG_DATA_BATCH;
+			p->raw.analog_batch.channel_number = SIM_CHANNEL;
+			/* device clock is CLOCK_MONOTONIC, comparable on same host */
+			p->raw.analog_batch.timestamp = (unsigned int)(when / 1000);
+			p->raw.analog_batch.period = s->config.rate ?
+					1000000 / s->config.rate : 0;
+		}
+		memcpy(&p->raw.analog_batch.value[n * SIM_CHANNEL], value, sizeof(value));
+	}
+	if (++s->frame_samples < s->config.batch)
+		return;
+	if (s->config.batch > 1)
+		p->raw.analog_batch.sample_number = s->frame_samples;
+
+	if (sim_queued(s) > SIM_OUT_LIMIT || sim_queue(s, p) < 0) {
+		s->stats.dropped += s->frame_samples;
+	} else if (++s->burst_frames >= s->config.burst) {
+		s->ready = s->head;
+		s->burst_frames = 0;
+	}
+	s->frame_samples = 0;
+}
+
+/*
+ * answer a request from host, like firmware in README does
+ */
+static void sim_request(sim_t *s, packet_t *q)
+{
+	packet_t p;
+	unsigned int i;
+
+	s->stats.requests++;
+	switch (q->type) {
+	case ANALOG_NAME_REQUEST:
+		i = q->raw.analog_name.channel;
+		if (i >= SIM_CHANNEL)
+			break;
+		p.type = ANALOG_NAME_RESPONSE;
+		p.raw.analog_name.channel = i;
+		strcpy(p.raw.analog_name.name, sim_channel_name[i]);
+		sim_answer(s, &p);
+		break;
+	case ANALOG_DATA_REQUEST:
+		p.type = ANALOG_DATA_RESPONSE;
+		p.raw.analog_data.channel_number = SIM_CHANNEL;
+		sim_sensors(s, (sim_now() - s->start) / (double)NSEC, p.raw.analog_data.value);
+		sim_answer(s, &p);
+		break;
+	case DEVICE_INFO_REQUEST:
+		p.type = DEVICE_INFO_RESPONSE;
+		p.raw.device_info.board = SIM_BOARD;
+		p.raw.device_info.firmware = SIM_FIRMWARE;
+		p.raw.device_info.capability = s->config.capability;
+		/* answer in old mode, following frames in common one */
+		sim_answer(s, &p);
+		s->mode = q->raw.device_info.capability & s->config.capability;
+		packet_framer_mode(&s->framer, s->mode);
+		s->overflow = s->framer.overflow;
+		memset(s->sequence, 0, sizeof(s->sequence));
+		break;
+	case DEVICE_PARAM_SET: /* answered with stored value */
+		i = q->raw.device_param.index;
+		if (i >= s->config.param_number)
+			break;
+		s->param[i] = q->raw.device_param.value;
+		/* fall through */
+	case DEVICE_PARAM_REQUEST:
+		i = q->raw.device_param.index;
+		if (i >= s->config.param_number)
+			break;
+		p.type = DEVICE_PARAM_RESPONSE;
+		p.raw.device_param.index = i;
+		p.raw.device_param.value = s->param[i];
+		sim_answer(s, &p);
+		break;
+	default:
+		/* DEVICE_PARAM_SAVE, DEVICE_MOTOR_CONTROL: nothing to answer */
+		break;
+	}
+}
+
+static void sim_read(sim_t *s)
+{
+	unsigned char buffer[SIM_READ_LENGTH];
+	unsigned int used, offset;
+	ssize_t n;
+
+	n = read(s->master, buffer, sizeof(buffer));
+	if (n <= 0)
+		return;
+	/*
+	 * host restarted and negotiates in ASCII, binary framer may never
+	 * see it since ASCII frames have no delimiter
+	 */
+	for (offset = 0; s->mode != PACKET_MODE_ASCII && offset < (unsigned int)n;
+			offset += used) {
+		if (packet_framer_feed(&s->hello, &s->hello_rx, buffer + offset,
+					n - offset, &used) != PACKET_SUCCESS)
+			continue;
+		if (packet_decode(&s->hello_rx) == PACKET_SUCCESS &&
+				s->hello_rx.type == DEVICE_INFO_REQUEST) {
+			s->mode = PACKET_MODE_ASCII;
+			packet_framer_init(&s->framer);
+			sim_request(s, &s->hello_rx);
+			return;
+		}
+	}
+	for (offset = 0; offset < (unsigned int)n; offset += used) {
+		if (packet_framer_feed(&s->framer, &s->rx, buffer + offset,
+					n - offset, &used) != PACKET_SUCCESS)
+			continue;
+		if (packet_decode_mode(&s->rx, s->mode) == PACKET_SUCCESS) {
+			sim_request(s, &s->rx);
+		} else {
+			s->stats.bad++;
+		}
+	}
+	if (s->framer.overflow != s->overflow) {
+		/* host restarted, it talks ASCII until it negotiates again */
+		s->mode = PACKET_MODE_ASCII;
+		packet_framer_mode(&s->framer, s->mode);
+		s->overflow = s->framer.overflow;
+	}
+}
+
+/*
+ * write what line takes now, with --baudrate a byte costs 10 bit times
+ */
+static void sim_write(sim_t *s, long long now)
+{
+	unsigned int length;
+	ssize_t n;
+
+	if (s->config.baudrate) {
+		s->line_credit += (now - s->line_time) * (s->config.baudrate / 10.0) / NSEC;
+		if (s->line_credit > SIM_LINE_FIFO)
+			s->line_credit = SIM_LINE_FIFO;
+		s->line_time = now;
+	}
+	length = s->ready - s->tail;
+	if (s->config.baudrate && length > s->line_credit)
+		length = (unsigned int)s->line_credit;
+	if (length == 0)
+		return;
+
+	n = write(s->master, s->out + s->tail, length);
+	if (n <= 0)
+		return;
+	s->tail += n;
+	s->stats.bytes += n;
+	if (s->config.baudrate)
+		s->line_credit -= n;
+	if (s->tail == s->head)
+		s->head = s->ready = s->tail = 0;
+}
+
+static void sim_report(sim_t *s, long long now)
+{
+	sim_stats_t *a = &s->stats, *b = &s->last;
+	double t = (now - s->last_time) / (double)NSEC;
+
+	if (t <= 0)
+		return;
+	printf("samples %llu (%.0f/s) dropped %llu frames %llu bytes %llu (%.0f B/s) "
+			"corrupted %llu garbage %llu requests %llu bad %llu\n",
+			a->samples, (a->samples - b->samples) / t,
+			a->dropped, a->frames, a->bytes, (a->bytes - b->bytes) / t,
+			a->corrupted, a->garbage, a->requests, a->bad);
+	fflush(stdout);
+	memcpy(b, a, sizeof(sim_stats_t));
+	s->last_time = now;
+}
+
+static int sim_open(sim_t *s)
+{
+	struct termios t;
+	struct stat st;
+
+	s->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (s->master < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if (grantpt(s->master) < 0 || unlockpt(s->master) < 0 ||
+			ptsname_r(s->master, s->name, sizeof(s->name)) != 0) {
+		perror("pty");
+		close(s->master);
+		return -1;
+	}
+	s->slave = open(s->name, O_RDWR | O_NOCTTY);
+	if (s->slave < 0) {
+		perror(s->name);
+		close(s->master);
+		return -1;
+	}
+	/* raw until AMCC opens it and sets its own */
+	if (tcgetattr(s->slave, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(s->slave, TCSANOW, &t);
+	}
+	if (s->config.link) {
+		/* only replace a link left by earlier run */
+		if (lstat(s->config.link, &st) == 0 && S_ISLNK(st.st_mode))
+			unlink(s->config.link);
+		if (symlink(s->name, s->config.link) < 0) {
+			perror(s->config.link);
+			s->config.link = NULL;
+		}
+	}
+
+	return 0;
+}
+
+static void sim_close(sim_t *s)
+{
+	if (s->config.link)
+		unlink(s->config.link);
+	close(s->slave);
+	close(s->master);
+}
+
+static void sim_run(sim_t *s)
+{
+	struct pollfd fd;
+	struct timespec timeout;
+	long long now, wake, end, period, next_stats, need;
+
+	now = sim_now();
+	s->start = s->next_sample = s->line_time = s->last_time = now;
+	end = s->config.time ? now + s->config.time * NSEC : 0;
+	next_stats = s->config.stats_interval ? now + s->config.stats_interval * NSEC : 0;
+	period = s->config.rate ? NSEC / s->config.rate : 0;
+
+	while (!sim_quit) {
+		now = sim_now();
+		if (end && now >= end)
+			break;
+		if (next_stats && now >= next_stats) {
+			sim_report(s, now);
+			next_stats += s->config.stats_interval * NSEC;
+		}
+
+		/* sampling */
+		if (period) {
+			if (now - s->next_sample > NSEC) {
+				/* stalled over a second, don't catch up */
+				s->stats.dropped += (now - s->next_sample) / period;
+				s->next_sample = now;
+			}
+			while (s->next_sample <= now) {
+				sim_sample(s, s->next_sample);
+				s->next_sample += period;
+			}
+		} else {
+			while (sim_queued(s) < SIM_SATURATE) {
+				sim_sample(s, now);
+			}
+		}
+		sim_write(s, now);
+
+		/* sleep until next sample, line credit, report or end */
+		wake = period ? s->next_sample : -1;
+		fd.fd = s->master;
+		fd.events = POLLIN;
+		if (s->ready != s->tail || !period) {
+			/* rate 0 samples again when line takes more */
+			if (!s->config.baudrate || s->line_credit >= 1) {
+				fd.events |= POLLOUT;
+			} else {
+				need = now + (long long)((1 - s->line_credit) * 10 * NSEC /
+							s->config.baudrate) + 1;
+				if (wake < 0 || need < wake)
+					wake = need;
+			}
+		}
+		if (next_stats && (wake < 0 || next_stats < wake))
+			wake = next_stats;
+		if (end && (wake < 0 || end < wake))
+			wake = end;
+		if (wake >= 0) {
+			wake = wake > now ? wake - now : 0;
+			timeout.tv_sec = wake / NSEC;
+			timeout.tv_nsec = wake % NSEC;
+		}
+		if (ppoll(&fd, 1, wake >= 0 ? &timeout : NULL, NULL) > 0 &&
+				(fd.revents & POLLIN)) {
+			sim_read(s);
+		}
+	}
+	sim_report(s, sim_now());
+}
+
+static void sim_signal(int signum)
+{
+	sim_quit = 1;
+}
+
+static void usage(void)
+{
+	printf("amsim [options]\n"
+		"\t-r, --rate HZ\t\tsamples per second, 0: saturate the line (100)\n"
+		"\t-s, --baudrate BAUD\temulated line speed, 0: pty speed (0)\n"
+		"\t-b, --batch N\t\tsamples per ANALOG_DATA_BATCH, 1: ANALOG_DATA_RESPONSE (1)\n"
+		"\t-B, --burst N\t\tframes written together (1)\n"
+		"\t-n, --noise MV\t\tsensor noise amplitude (0)\n"
+		"\t-c, --corrupt P\t\tfraction of frames with a flipped bit (0)\n"
+		"\t-g, --garbage P\t\tfraction of frames following line noise (0)\n"
+		"\t-m, --capability BITS\tframing modes offered in DEVICE_INFO_RESPONSE (%d)\n"
+		"\t-p, --params N\t\tdevice parameters (%d)\n"
+		"\t-l, --link PATH\t\tsymlink PATH to the pty\n"
+		"\t-t, --time S\t\tquit after S seconds\n"
+		"\t-i, --stats-interval S\tprint counters every S seconds\n"
+		"\t-S, --seed N\t\trandom seed\n",
+		SIM_CAPABILITY, SIM_PARAM);
+}
+
+/*
+ * main
+ */
+int main(int argc, char *argv[])
+{
+	static const struct option longopt[] = {
+		{ "rate", required_argument, NULL, 'r' },
+		{ "baudrate", required_argument, NULL, 's' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "burst", required_argument, NULL, 'B' },
+		{ "noise", required_argument, NULL, 'n' },
+		{ "corrupt", required_argument, NULL, 'c' },
+		{ "garbage", required_argument, NULL, 'g' },
+		{ "capability", required_argument, NULL, 'm' },
+		{ "params", required_argument, NULL, 'p' },
+		{ "link", required_argument, NULL, 'l' },
+		{ "time", required_argument, NULL, 't' },
+		{ "stats-interval", required_argument, NULL, 'i' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	sim_config_t *c = &sim.config;
+	struct sigaction sa;
+	unsigned int i;
+	int opt;
+
+	c->rate = 100;
+	c->batch = 1;
+	c->burst = 1;
+	c->capability = SIM_CAPABILITY;
+	c->param_number = SIM_PARAM;
+	c->seed = 1;
+
+	while ((opt = getopt_long(argc, argv, "r:s:b:B:n:c:g:m:p:l:t:i:S:h",
+					longopt, NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			c->rate = atoi(optarg);
+			break;
+		case 's':
+			c->baudrate = atoi(optarg);
+			break;
+		case 'b':
+			c->batch = atoi(optarg);
+			break;
+		case 'B':
+			c->burst = atoi(optarg);
+			break;
+		case 'n':
+			c->noise = atoi(optarg);
+			break;
+		case 'c':
+			c->corrupt = atof(optarg);
+			break;
+		case 'g':
+			c->garbage = atof(optarg);
+			break;
+		case 'm':
+			c->capability = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			c->param_number = atoi(optarg);
+			break;
+		case 'l':
+			c->link = optarg;
+			break;
+		case 't':
+			c->time = atoi(optarg);
+			break;
+		case 'i':
+			c->stats_interval = atoi(optarg);
+			break;
+		case 'S':
+			c->seed = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (c->batch < 1 || c->batch > SIM_MAX_BATCH) {
+		fprintf(stderr, "batch is 1 ... %d\n", SIM_MAX_BATCH);
+		return 1;
+	}
+	if (c->burst < 1)
+		c->burst = 1;
+	if (c->param_number > SIM_PARAM)
+		c->param_number = SIM_PARAM;
+	sim.random = c->seed ? c->seed : 1;
+	for (i = 0; i < SIM_PARAM; i++) {
+		sim.param[i] = i * 10;
+	}
+	sim.mode = PACKET_MODE_ASCII;
+	packet_framer_init(&sim.framer);
+	packet_framer_init(&sim.hello);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sim_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (sim_open(&sim) < 0)
+		return 1;
+	printf("%s\n", c->link ? c->link : sim.name);
+	fflush(stdout);
+	sim_run(&sim);
+	sim_close(&sim);
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+
+#ifdef __linux__
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+
+/* <sys/ioctl.h> would bring glibc termios along */
+extern int ioctl(int fd, unsigned long request, ...);
+#endif
+
+#include "baud.h"
+
+/*
+ * set input and output rate to 'rate' (BOTHER), driver picks nearest
+ * divisor it has, see baud_get()
+ */
+int baud_set(int fd, unsigned int rate)
+{
+#if defined(__linux__) && defined(BOTHER)
+	struct termios2 t;
+
+	if (ioctl(fd, TCGETS2, &t) < 0)
+		return -1;
+	t.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	t.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	t.c_ispeed = rate;
+	t.c_ospeed = rate;
+	if (ioctl(fd, TCSETS2, &t) < 0)
+		return -1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * output rate in effect, as driver reports it back, 0 if unknown
+ */
+unsigned int baud_get(int fd)
+{
+#if defined(__linux__) && defined(BOTHER)
+	struct termios2 t;
+
+	if (ioctl(fd, TCGETS2, &t) < 0)
+		return 0;
+	return t.c_ospeed;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,182 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_delta: compression ratio of ANALOG_DATA_DELTA against
+ * ANALOG_DATA_BATCH on a synthetic IMU trace, for several channel
+ * counts and noise levels. delta packets are decoded again, some of
+ * them lost on the way, and must give back the batch they were made of.
+ *
+ * bench_delta [packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "amcc.h"
+#include "packet.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_PACKETS 2000 /* default */
+#define BENCH_LOSS 37 /* every Nth delta packet is lost */
+#define BENCH_SAMPLE 10 /* samples per batch at most */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_result_struct {
+	unsigned int fallback; /* didn't fit, sent as ANALOG_DATA_BATCH */
+	unsigned int restored; /* decoded back to the original batch */
+	unsigned int skipped; /* waiting for keyframe after a loss */
+	unsigned int wrong; /* failed or decoded to something else */
+	unsigned int raw_bytes; /* payload, from coder state */
+	unsigned int coded_bytes;
+	unsigned int batch_frame; /* ASCII frame bytes as ANALOG_DATA_BATCH */
+	unsigned int sent_frame; /* ASCII frame bytes as sent */
+} bench_result_t;
+
+/*
+ * functions
+ */
+
+/*
+ * slow sine per channel plus 'noise' LSB of pseudo random noise
+ */
+static void bench_trace(analog_batch_t *b, unsigned int k, unsigned int channel,
+			unsigned int noise)
+{
+	unsigned int i, c, t;
+	int v;
+
+	b->channel_number = channel;
+	b->sample_number = MAX_BATCH_VALUE / channel;
+	if (b->sample_number > BENCH_SAMPLE)
+		b->sample_number = BENCH_SAMPLE;
+	b->period = 1000;
+	b->timestamp = k * b->sample_number * b->period;
+	for (i = 0; i < b->sample_number; i++) {
+		t = k * b->sample_number + i;
+		for (c = 0; c < channel; c++) {
+			v = 2000 + 300 * sin(t * 0.01 * (1 + c % 6)) + c * 10;
+			if (noise)
+				v += (int)(rand() % (2 * noise + 1)) - (int)noise;
+			b->value[i * channel + c] = v;
+		}
+	}
+}
+
+static void bench_run(bench_result_t *r, unsigned int packets, unsigned int channel,
+			unsigned int noise)
+{
+	packet_delta_t encoder, decoder;
+	analog_batch_t b;
+	packet_t p;
+	unsigned int k, n, batch_length;
+
+	memset(r, 0, sizeof(bench_result_t));
+	packet_delta_init(&encoder, DEFAULT_KEYFRAME_INTERVAL);
+	packet_delta_init(&decoder, DEFAULT_KEYFRAME_INTERVAL);
+	srand(channel * 1000 + noise);
+	for (k = 0; k < packets; k++) {
+		bench_trace(&b, k, channel, noise);
+		n = b.channel_number * b.sample_number;
+		p.type = ANALOG_DATA_BATCH;
+		p.raw.analog_batch = b;
+		if (packet_encode(&p) != PACKET_SUCCESS) {
+			r->wrong++;
+			continue;
+		}
+		batch_length = p.data_length;
+		r->batch_frame += batch_length;
+		if (packet_delta_encode(&encoder, &b, &p) != PACKET_SUCCESS) {
+			/* plain batch goes out instead */
+			r->fallback++;
+			r->sent_frame += batch_length;
+			continue;
+		}
+		if (packet_encode(&p) != PACKET_SUCCESS) {
+			r->wrong++;
+			continue;
+		}
+		r->sent_frame += p.data_length;
+		if (k % BENCH_LOSS == BENCH_LOSS - 1)
+			continue;
+		if (packet_decode(&p) != PACKET_SUCCESS) {
+			r->wrong++;
+			continue;
+		}
+		if (packet_delta_decode(&decoder, &p) != PACKET_SUCCESS) {
+			r->skipped++;
+			continue;
+		}
+		if (p.raw.analog_batch.timestamp != b.timestamp ||
+				memcmp(p.raw.analog_batch.value, b.value, n * sizeof(short))) {
+			r->wrong++;
+			continue;
+		}
+		r->restored++;
+	}
+	r->raw_bytes = encoder.raw_bytes;
+	r->coded_bytes = encoder.coded_bytes;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int channel[] = { 3, 6, 9 };
+	static const unsigned int noise[] = { 0, 64, 256, 1024 };
+	bench_result_t r;
+	unsigned int packets = BENCH_PACKETS;
+	unsigned int i, j;
+	int failed = 0;
+
+	if (argc > 1)
+		packets = atoi(argv[1]);
+	printf("channel noise  payload   frame fallback restored skipped wrong\n");
+	for (i = 0; i < sizeof(channel) / sizeof(channel[0]); i++) {
+		for (j = 0; j < sizeof(noise) / sizeof(noise[0]); j++) {
+			bench_run(&r, packets, channel[i], noise[j]);
+			printf("%7u %5u %7.2fx %6.2fx %8u %8u %7u %5u\n",
+				channel[i], noise[j],
+				r.coded_bytes ? (double)r.raw_bytes / r.coded_bytes : 0.0,
+				r.sent_frame ? (double)r.batch_frame / r.sent_frame : 0.0,
+				r.fallback, r.restored, r.skipped, r.wrong);
+			if (r.wrong)
+				failed = 1;
+		}
+	}
+
+	return failed;
+}
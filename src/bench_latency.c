@@ -0,0 +1,172 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_latency: time from mx_rx_data() to the subscriber callback,
+ * one ANALOG_DATA_RESPONSE every 200 us like a copter streaming at
+ * 5 kHz, and CPU used by mx while the link is idle (rx/tx threads must
+ * sleep, not spin).
+ *
+ * bench_latency [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "mx.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_FRAMES 2000 /* default */
+#define BENCH_GAP 200 /* us between frames */
+#define BENCH_IDLE 500000 /* us idle CPU is measured over */
+#define BENCH_IDLE_LIMIT 20 /* % CPU when idle, above it mx is spinning */
+#define BENCH_TIMEOUT 1000000 /* us a frame may take */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_struct {
+	guint64 sent; /* ns, set before mx_rx_data() */
+	guint64 *latency; /* ns */
+	guint count; /* callbacks, with atomics */
+} bench_t;
+
+/*
+ * functions
+ */
+
+static guint64 bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double bench_cpu(void)
+{
+	struct rusage r;
+
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_utime.tv_sec + r.ru_utime.tv_usec / 1e6 +
+		r.ru_stime.tv_sec + r.ru_stime.tv_usec / 1e6;
+}
+
+static gint bench_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	return 0;
+}
+
+static gint bench_callback(packet_t *p, void *arg)
+{
+	bench_t *b = (bench_t*)arg;
+	guint n = __atomic_load_n(&b->count, __ATOMIC_RELAXED);
+
+	b->latency[n] = bench_now() - __atomic_load_n(&b->sent, __ATOMIC_RELAXED);
+	__atomic_store_n(&b->count, n + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	guint64 x = *(const guint64*)a, y = *(const guint64*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	static mx_t mx;
+	bench_t b;
+	packet_t p;
+	guint frames = BENCH_FRAMES;
+	guint i, n, waited;
+	double cpu, idle;
+	int failed = 0;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (frames == 0)
+		frames = 1;
+	memset(&b, 0, sizeof(b));
+	b.latency = g_new0(guint64, frames);
+	if (mx_init(&mx, bench_tx_data, NULL, NULL) < 0)
+		return 1;
+	mx_rx_register(&mx, ANALOG_DATA_RESPONSE, bench_callback, &b);
+
+	cpu = bench_cpu();
+	usleep(BENCH_IDLE);
+	idle = (bench_cpu() - cpu) * 1e6 / BENCH_IDLE * 100;
+	printf("idle cpu %.1f%%\n", idle);
+	if (idle > BENCH_IDLE_LIMIT)
+		failed = 1;
+
+	memset(&p, 0, sizeof(p));
+	p.type = ANALOG_DATA_RESPONSE;
+	p.raw.analog_data.channel_number = 6;
+	for (i = 0; i < frames; i++) {
+		p.raw.analog_data.value[0] = i;
+		packet_encode(&p);
+		__atomic_store_n(&b.sent, bench_now(), __ATOMIC_RELAXED);
+		mx_rx_data(&mx, (gchar*)p.data, p.data_length);
+		for (waited = 0; __atomic_load_n(&b.count, __ATOMIC_ACQUIRE) == i; waited += 50) {
+			if (waited > BENCH_TIMEOUT)
+				break;
+			usleep(50);
+		}
+		if (__atomic_load_n(&b.count, __ATOMIC_ACQUIRE) == i) {
+			printf("frame %u not delivered\n", i);
+			failed = 1;
+			break;
+		}
+		usleep(BENCH_GAP);
+	}
+	mx_destroy(&mx);
+
+	n = b.count;
+	if (n) {
+		qsort(b.latency, n, sizeof(guint64), bench_compare);
+		printf("frames %u latency p50 %.1f us p99 %.1f us max %.1f us\n", n,
+			b.latency[n / 2] / 1e3, b.latency[n * 99 / 100] / 1e3,
+			b.latency[n - 1] / 1e3);
+	}
+	g_free(b.latency);
+
+	return failed;
+}
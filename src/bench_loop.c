@@ -0,0 +1,356 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_loop: links served by a loop of 2 workers, half of them
+ * unix-listen the device connects to, half udp-listen the device sends
+ * datagrams to. The device sends one ANALOG_DATA_RESPONSE per link
+ * every 2 ms and answers DEVICE_PARAM_REQUEST, the host keeps one
+ * mx_request() per link going. Checks thread count doesn't grow with
+ * links, every frame and answer gets through, and workers sleep when
+ * links are idle.
+ *
+ * bench_loop [links]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "loop.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_LINKS 32 /* default */
+#define MAX_BENCH_LINKS 256
+#define BENCH_WORKERS 2
+#define BENCH_PERIOD 2000 /* us between frames of a link */
+#define BENCH_ROUNDS 20 /* requests per link */
+#define BENCH_ROUND 50000 /* us between requests */
+#define BENCH_IDLE 500000 /* us idle CPU is measured over */
+#define BENCH_IDLE_LIMIT 20 /* % CPU when idle, above it workers spin */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_link_struct {
+	transport_t transport;
+	mx_t mx;
+	loop_link_t link;
+	gint device; /* device end, non-blocking */
+	packet_framer_t framer;
+	packet_t rx;
+	guint frames; /* with atomics */
+	guint answered; /* on worker */
+	guint timeout;
+} bench_link_t;
+
+typedef struct _bench_struct {
+	bench_link_t link[MAX_BENCH_LINKS];
+	guint link_number;
+	guint sent; /* frames per link, with atomics */
+	gboolean run; /* with atomics */
+	gchar dir[64];
+} bench_t;
+
+static bench_t bench;
+
+/*
+ * functions
+ */
+
+static guint bench_threads(void)
+{
+	gchar line[256];
+	guint n = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "Threads:", 8) == 0)
+			n = atoi(line + 8);
+	}
+	fclose(f);
+
+	return n;
+}
+
+static double bench_cpu(void)
+{
+	struct rusage r;
+
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_utime.tv_sec + r.ru_utime.tv_usec / 1e6 +
+		r.ru_stime.tv_sec + r.ru_stime.tv_usec / 1e6;
+}
+
+static gint bench_frame(packet_t *p, void *arg)
+{
+	bench_link_t *b = (bench_link_t*)arg;
+
+	__atomic_store_n(&b->frames, b->frames + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void bench_answer(packet_t *request, packet_t *response, void *arg)
+{
+	bench_link_t *b = (bench_link_t*)arg;
+
+	if (response && response->raw.device_param.value == request->raw.device_param.index + 1)
+		b->answered++;
+	else
+		b->timeout++;
+}
+
+/*
+ * device end of a link: answer parameter requests
+ */
+static void bench_device_read(bench_link_t *b)
+{
+	guchar buffer[512];
+	guint offset, used;
+	packet_t p;
+	gssize n;
+
+	while ((n = read(b->device, buffer, sizeof(buffer))) > 0) {
+		for (offset = 0; offset < (guint)n; offset += used) {
+			if (packet_framer_feed(&b->framer, &b->rx, buffer + offset,
+						n - offset, &used) != PACKET_SUCCESS)
+				continue;
+			if (packet_decode(&b->rx) != PACKET_SUCCESS ||
+					b->rx.type != DEVICE_PARAM_REQUEST)
+				continue;
+			p.type = DEVICE_PARAM_RESPONSE;
+			p.raw.device_param.index = b->rx.raw.device_param.index;
+			p.raw.device_param.value = b->rx.raw.device_param.index + 1;
+			packet_encode(&p);
+			if (write(b->device, p.data, p.data_length) < 0)
+				break;
+		}
+	}
+}
+
+static void* bench_device(void *arg)
+{
+	bench_link_t *b;
+	packet_t p;
+	guint i, k;
+
+	memset(&p, 0, sizeof(p));
+	p.type = ANALOG_DATA_RESPONSE;
+	p.raw.analog_data.channel_number = 6;
+	for (k = 0; __atomic_load_n(&bench.run, __ATOMIC_RELAXED); k++) {
+		p.raw.analog_data.value[0] = k;
+		packet_encode(&p);
+		for (i = 0; i < bench.link_number; i++) {
+			b = &bench.link[i];
+			if (write(b->device, p.data, p.data_length) < 0)
+				continue;
+			bench_device_read(b);
+		}
+		__atomic_store_n(&bench.sent, k + 1, __ATOMIC_RELAXED);
+		usleep(BENCH_PERIOD);
+	}
+
+	return NULL;
+}
+
+/*
+ * unix-listen link the device connects to, or udp-listen link it sends
+ * to, -1 on failure
+ */
+static gint bench_open(bench_link_t *b, guint index, loop_t *loop)
+{
+	transport_config_t tc;
+	mx_config_t mc;
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	socklen_t length = sizeof(in);
+	gchar uri[128];
+
+	mx_config_default(&mc);
+	mc.thread = FALSE;
+	if (mx_init(&b->mx, transport_tx_data, &b->transport, &mc) < 0)
+		return -1;
+	mx_rx_register(&b->mx, ANALOG_DATA_RESPONSE, bench_frame, b);
+	transport_config_default(&tc);
+	tc.thread = FALSE;
+	packet_framer_init(&b->framer);
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	snprintf(un.sun_path, sizeof(un.sun_path), "%s/link%u", bench.dir, index);
+	if (index % 2 == 0)
+		snprintf(uri, sizeof(uri), "unix-listen://%s", un.sun_path);
+	else
+		snprintf(uri, sizeof(uri), "udp-listen://127.0.0.1:0");
+	if (transport_open(&b->transport, uri, &b->mx, &tc) < 0) {
+		mx_destroy(&b->mx);
+		return -1;
+	}
+	if (index % 2 == 0) {
+		b->device = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (b->device >= 0 && connect(b->device, (struct sockaddr*)&un, sizeof(un)) < 0) {
+			close(b->device);
+			b->device = -1;
+		}
+	} else {
+		getsockname(transport_fd(&b->transport), (struct sockaddr*)&in, &length);
+		b->device = socket(AF_INET, SOCK_DGRAM, 0);
+		if (b->device >= 0 && connect(b->device, (struct sockaddr*)&in, length) < 0) {
+			close(b->device);
+			b->device = -1;
+		}
+	}
+	if (b->device < 0 || loop_add(loop, &b->link, &b->transport) < 0) {
+		if (b->device >= 0)
+			close(b->device);
+		transport_close(&b->transport);
+		mx_destroy(&b->mx);
+		return -1;
+	}
+	fcntl(b->device, F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+static void bench_close(bench_link_t *b, loop_t *loop)
+{
+	loop_remove(loop, &b->link);
+	transport_close(&b->transport);
+	mx_destroy(&b->mx);
+	close(b->device);
+}
+
+int main(int argc, char *argv[])
+{
+	static loop_t loop;
+	pthread_t device;
+	bench_link_t *b;
+	packet_t p;
+	guint links = BENCH_LINKS;
+	guint i, k, before, after, frames, least, answered = 0, timeout = 0;
+	double cpu, busy, idle;
+	int failed = 0;
+
+	if (argc > 1)
+		links = atoi(argv[1]);
+	if (links == 0)
+		links = 1;
+	if (links > MAX_BENCH_LINKS)
+		links = MAX_BENCH_LINKS;
+	strcpy(bench.dir, "/tmp/bench_loop.XXXXXX");
+	if (mkdtemp(bench.dir) == NULL || loop_init(&loop, BENCH_WORKERS) < 0)
+		return 1;
+	before = bench_threads();
+	for (i = 0; i < links; i++) {
+		if (bench_open(&bench.link[i], i, &loop) < 0) {
+			printf("link %u didn't open\n", i);
+			failed = 1;
+			break;
+		}
+		bench.link_number++;
+	}
+	after = bench_threads();
+	printf("links %u workers %u threads %u (%u before links)\n", bench.link_number,
+		BENCH_WORKERS, after, before);
+	if (after != before)
+		failed = 1;
+
+	bench.run = TRUE;
+	pthread_create(&device, NULL, bench_device, NULL);
+	/* udp-listen answers whoever sent last, let device be heard first */
+	usleep(BENCH_ROUND);
+	cpu = bench_cpu();
+	memset(&p, 0, sizeof(p));
+	p.type = DEVICE_PARAM_REQUEST;
+	for (k = 0; k < BENCH_ROUNDS; k++) {
+		p.raw.device_param.index = k;
+		for (i = 0; i < bench.link_number; i++)
+			mx_request(&bench.link[i].mx, &p, 100, 1, bench_answer, &bench.link[i]);
+		usleep(BENCH_ROUND);
+	}
+	busy = (bench_cpu() - cpu) * 1e6 / (BENCH_ROUNDS * BENCH_ROUND) * 100;
+	__atomic_store_n(&bench.run, FALSE, __ATOMIC_RELAXED);
+	pthread_join(device, NULL);
+	/* outstanding frames and answers */
+	usleep(4 * BENCH_ROUND);
+
+	cpu = bench_cpu();
+	usleep(BENCH_IDLE);
+	idle = (bench_cpu() - cpu) * 1e6 / BENCH_IDLE * 100;
+
+	frames = 0;
+	least = ~0U;
+	for (i = 0; i < bench.link_number; i++) {
+		b = &bench.link[i];
+		bench_close(b, &loop);
+		frames += b->frames;
+		if (b->frames < least)
+			least = b->frames;
+		answered += b->answered;
+		timeout += b->timeout;
+	}
+	loop_destroy(&loop);
+	/* unix-listen removed its socket file */
+	rmdir(bench.dir);
+
+	printf("frames %u of %u per link, least %u\n",
+		bench.link_number ? frames / bench.link_number : 0, bench.sent, least);
+	printf("requests answered %u of %u, timeout %u\n", answered,
+		bench.link_number * BENCH_ROUNDS, timeout);
+	printf("cpu %.1f%% with traffic, %.1f%% idle\n", busy, idle);
+	if (least == 0 || least < bench.sent / 2) {
+		printf("frames lost\n");
+		failed = 1;
+	}
+	if (answered != bench.link_number * BENCH_ROUNDS) {
+		printf("requests not answered\n");
+		failed = 1;
+	}
+	if (idle > BENCH_IDLE_LIMIT) {
+		printf("workers spin while links are idle\n");
+		failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,265 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_packet: ANALOG_DATA_RESPONSE codec throughput (MB/s and frames/s
+ * of wire bytes) for several channel counts in each framing mode:
+ * packet_encode_mode(), packet_framer_feed() + packet_decode_mode() on a
+ * stream read in pieces, and packet_decode_batch() for ASCII frames.
+ * every frame must come back with the values it was made of.
+ *
+ * bench_packet [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "amcc.h"
+#include "packet.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_FRAMES 100000 /* default */
+#define BENCH_STREAM_FRAMES 256 /* frames in the stream decoded over and over */
+#define BENCH_READ 64 /* bytes handed to framer at once, like a serial read() */
+#define BENCH_BATCH 16 /* packets taken by one packet_decode_batch() */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_rate_struct {
+	double bytes;
+	double frames;
+	double second;
+} bench_rate_t;
+
+/*
+ * functions
+ */
+
+static unsigned char stream[BENCH_STREAM_FRAMES * MAX_PACKET_FRAME_LENGTH];
+static unsigned int stream_length;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_fill(packet_t *p, unsigned int channel, unsigned int k)
+{
+	unsigned int i;
+
+	p->type = ANALOG_DATA_RESPONSE;
+	p->sequence = k;
+	p->raw.analog_data.channel_number = channel;
+	for (i = 0; i < channel; i++)
+		p->raw.analog_data.value[i] = (short)(k * 31 + i * 1000);
+}
+
+static int bench_check(const packet_t *p, unsigned int channel, unsigned int k)
+{
+	unsigned int i;
+
+	if (p->type != ANALOG_DATA_RESPONSE || p->raw.analog_data.channel_number != channel)
+		return -1;
+	for (i = 0; i < channel; i++) {
+		if (p->raw.analog_data.value[i] != (short)(k * 31 + i * 1000))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int bench_encode(bench_rate_t *r, unsigned int channel, unsigned int mode,
+			unsigned int frames)
+{
+	packet_t p;
+	unsigned int k;
+	double start;
+
+	/* stream used by decoders */
+	stream_length = 0;
+	for (k = 0; k < BENCH_STREAM_FRAMES; k++) {
+		bench_fill(&p, channel, k);
+		if (packet_encode_mode(&p, mode) != PACKET_SUCCESS)
+			return -1;
+		memcpy(&stream[stream_length], p.data, p.data_length);
+		stream_length += p.data_length;
+	}
+
+	r->bytes = 0;
+	start = bench_now();
+	for (k = 0; k < frames; k++) {
+		bench_fill(&p, channel, k);
+		packet_encode_mode(&p, mode);
+		r->bytes += p.data_length;
+	}
+	r->second = bench_now() - start;
+	r->frames = frames;
+
+	return 0;
+}
+
+static int bench_framer(bench_rate_t *r, unsigned int channel, unsigned int mode,
+			unsigned int frames)
+{
+	packet_framer_t f;
+	packet_t p;
+	unsigned int offset, length, used, k, n;
+	double start;
+
+	packet_framer_init(&f);
+	packet_framer_mode(&f, mode);
+	r->bytes = 0;
+	r->frames = 0;
+	start = bench_now();
+	for (n = 0; n < frames; n += BENCH_STREAM_FRAMES) {
+		k = 0;
+		for (offset = 0; offset < stream_length; offset += length) {
+			length = stream_length - offset;
+			if (length > BENCH_READ)
+				length = BENCH_READ;
+			/* framer may stop at end of a frame, call it until piece is gone */
+			while (length) {
+				if (packet_framer_feed(&f, &p, &stream[offset], length,
+							&used) == PACKET_SUCCESS) {
+					if (packet_decode_mode(&p, mode) != PACKET_SUCCESS ||
+							bench_check(&p, channel, k++))
+						return -1;
+				}
+				offset += used;
+				length -= used;
+			}
+		}
+		if (k != BENCH_STREAM_FRAMES)
+			return -1;
+		r->bytes += stream_length;
+		r->frames += k;
+	}
+	r->second = bench_now() - start;
+
+	return 0;
+}
+
+static int bench_batch(bench_rate_t *r, unsigned int channel, unsigned int mode,
+			unsigned int frames)
+{
+	static packet_t p[BENCH_BATCH];
+	unsigned int offset, used, i, k, n, count;
+	double start;
+
+	r->bytes = 0;
+	r->frames = 0;
+	start = bench_now();
+	for (n = 0; n < frames; n += BENCH_STREAM_FRAMES) {
+		k = 0;
+		for (offset = 0; offset < stream_length; offset += used) {
+			count = packet_decode_batch(&stream[offset], stream_length - offset,
+						p, BENCH_BATCH, &used, mode);
+			for (i = 0; i < count; i++) {
+				if (bench_check(&p[i], channel, k++))
+					return -1;
+			}
+			if (used == 0)
+				break;
+		}
+		if (k != BENCH_STREAM_FRAMES)
+			return -1;
+		r->bytes += stream_length;
+		r->frames += k;
+	}
+	r->second = bench_now() - start;
+
+	return 0;
+}
+
+static void bench_print(const bench_rate_t *r)
+{
+	printf(" %8.1f %9.0f", r->bytes / r->second / 1e6, r->frames / r->second);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int channel[] = { 1, 6, 12, MAX_CHANNEL };
+	static const unsigned int mode[] = {
+		PACKET_MODE_ASCII,
+		PACKET_MODE_CRC16,
+		PACKET_MODE_CRC32,
+		PACKET_MODE_CRC32 | PACKET_MODE_SEQ,
+		PACKET_MODE_COBS,
+		PACKET_MODE_COBS | PACKET_MODE_CRC32,
+		PACKET_MODE_COBS | PACKET_MODE_CRC32 | PACKET_MODE_SEQ
+	};
+	bench_rate_t r;
+	unsigned int frames = BENCH_FRAMES;
+	unsigned int i, j;
+	int failed = 0;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	printf("                  encode             framer              batch\n");
+	printf("ch mode     MB/s  frames/s     MB/s  frames/s     MB/s  frames/s\n");
+	for (i = 0; i < sizeof(channel) / sizeof(channel[0]); i++) {
+		for (j = 0; j < sizeof(mode) / sizeof(mode[0]); j++) {
+			printf("%2u %4x", channel[i], mode[j]);
+			if (bench_encode(&r, channel[i], mode[j], frames)) {
+				printf(" encode failed\n");
+				failed = 1;
+				continue;
+			}
+			bench_print(&r);
+			if (bench_framer(&r, channel[i], mode[j], frames)) {
+				printf(" framer decode failed\n");
+				failed = 1;
+				continue;
+			}
+			bench_print(&r);
+			if (!(mode[j] & PACKET_MODE_COBS)) {
+				if (bench_batch(&r, channel[i], mode[j], frames)) {
+					printf(" batch decode failed\n");
+					failed = 1;
+					continue;
+				}
+				bench_print(&r);
+			}
+			printf("\n");
+		}
+	}
+
+	return failed;
+}
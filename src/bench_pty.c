@@ -0,0 +1,259 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_pty: serial input on a pty, each SERIAL_RX_* mode in turn, read
+ * once by the transport rx thread and once by a loop worker. Frames are
+ * written to the master side at a fixed rate, transport opens the slave
+ * side like a serial port. Reports read() and epoll_wait() calls per second
+ * and time from write() on the master to the subscriber callback. Every
+ * frame must arrive, and batch mode must take fewer read() calls than
+ * low latency mode.
+ *
+ * bench_pty [frames/s] [seconds]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "mx.h"
+#include "hist.h"
+#include "transport.h"
+#include "loop.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_RATE 5000 /* frames/s, default */
+#define BENCH_SECONDS 1 /* default, per mode */
+#define BENCH_STAMPS 1024 /* frames in flight at most */
+#define BENCH_TIMEOUT 1000 /* ms for the last frames */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_struct {
+	gint read_fd; /* calls on these are counted */
+	gint epoll_fd;
+	guint reads; /* with atomics */
+	guint waits;
+	guint64 stamp[BENCH_STAMPS]; /* ns, write() of frame */
+	guint received; /* reader only, read after it stopped */
+	hist_t latency; /* us */
+} bench_t;
+
+static bench_t bench;
+
+/*
+ * functions
+ */
+
+static guint64 bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * count reader's calls, this program's definitions are taken before
+ * the ones of libc
+ */
+ssize_t read(int fd, void *buffer, size_t length)
+{
+	if (fd == __atomic_load_n(&bench.read_fd, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&bench.reads, 1, __ATOMIC_RELAXED);
+	return syscall(SYS_read, fd, buffer, length);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	if (epfd == __atomic_load_n(&bench.epoll_fd, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&bench.waits, 1, __ATOMIC_RELAXED);
+	return syscall(SYS_epoll_pwait, epfd, events, maxevents, timeout, NULL, 8);
+}
+
+static gint bench_callback(packet_t *p, void *arg)
+{
+	guint64 sent;
+
+	sent = __atomic_load_n(&bench.stamp[p->raw.analog_data.value[0]],
+		__ATOMIC_RELAXED);
+	hist_add(&bench.latency, (bench_now() - sent) / 1000);
+	bench.received++;
+
+	return 0;
+}
+
+static gint bench_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	return 0;
+}
+
+/*
+ * write 'rate' frames a second for 'seconds' to 'master', read by
+ * 'name' in 'mode' by transport rx thread, or by a loop worker when
+ * 'looped', return read() calls per second, -1 on failure
+ */
+static gint bench_run(gint master, gchar *name, guint mode, gboolean looped,
+			guint rate, guint seconds)
+{
+	static const gchar *mode_name[] = { "low latency", "batch" };
+	static mx_t mx;
+	static loop_t loop;
+	static loop_link_t link;
+	mx_config_t c;
+	transport_config_t tc;
+	transport_t t;
+	struct timespec next;
+	packet_t p;
+	guint frames = rate * seconds;
+	guint i, reads, waits;
+	gint failed = 0;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.read_fd = -1;
+	bench.epoll_fd = -1;
+	hist_init(&bench.latency);
+	mx_config_default(&c);
+	c.thread = !looped;
+	if (mx_init(&mx, bench_tx_data, NULL, &c) < 0)
+		return -1;
+	mx_rx_register(&mx, ANALOG_DATA_RESPONSE, bench_callback, NULL);
+	transport_config_default(&tc);
+	tc.rx_mode = mode;
+	tc.thread = !looped;
+	if (transport_open(&t, name, &mx, &tc) < 0) {
+		mx_destroy(&mx);
+		return -1;
+	}
+	if (looped) {
+		if (loop_init(&loop, 1) < 0 || loop_add(&loop, &link, &t) < 0) {
+			loop_destroy(&loop);
+			transport_close(&t);
+			mx_destroy(&mx);
+			return -1;
+		}
+		__atomic_store_n(&bench.epoll_fd, loop.worker[0].epfd, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&bench.epoll_fd, t.epoll_fd, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&bench.read_fd, t.fd, __ATOMIC_RELAXED);
+
+	memset(&p, 0, sizeof(p));
+	p.type = ANALOG_DATA_RESPONSE;
+	p.raw.analog_data.channel_number = 1;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < frames; i++) {
+		next.tv_nsec += 1000000000 / rate;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		p.raw.analog_data.value[0] = i % BENCH_STAMPS;
+		packet_encode(&p);
+		__atomic_store_n(&bench.stamp[i % BENCH_STAMPS], bench_now(),
+			__ATOMIC_RELAXED);
+		if (write(master, p.data, p.data_length) != p.data_length) {
+			failed = -1;
+			break;
+		}
+	}
+	/* rx ring and callbacks drain */
+	usleep(BENCH_TIMEOUT * 1000);
+	reads = __atomic_load_n(&bench.reads, __ATOMIC_RELAXED);
+	waits = __atomic_load_n(&bench.waits, __ATOMIC_RELAXED);
+	if (looped)
+		loop_destroy(&loop);
+	transport_close(&t);
+	mx_destroy(&mx);
+
+	printf("%-11s %-6s: %u of %u frames, read() %u/s epoll_wait() %u/s\n",
+		mode_name[mode], looped ? "loop" : "thread", bench.received, frames,
+		reads / seconds, waits / seconds);
+	printf("%-18s  latency us: mean %u p50 %u p99 %u max %u\n", "",
+		hist_mean(&bench.latency), hist_percentile(&bench.latency, 50),
+		hist_percentile(&bench.latency, 99), bench.latency.max);
+	if (bench.received != frames) {
+		printf("frames lost\n");
+		failed = -1;
+	}
+
+	return failed ? -1 : (gint)(reads / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+	gchar name[64];
+	guint rate = BENCH_RATE, seconds = BENCH_SECONDS;
+	gint master, low, batch, failed = 0;
+	gboolean looped;
+
+	if (argc > 1)
+		rate = atoi(argv[1]);
+	if (argc > 2)
+		seconds = atoi(argv[2]);
+	if (rate < 1)
+		rate = 1;
+	if (seconds < 1)
+		seconds = 1;
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1 ||
+			ptsname_r(master, name, sizeof(name)) != 0) {
+		printf("no pty\n");
+		return 1;
+	}
+	printf("%s, %u frames/s for %u s\n", name, rate, seconds);
+	for (looped = FALSE; looped <= TRUE; looped++) {
+		low = bench_run(master, name, SERIAL_RX_LOW_LATENCY, looped, rate, seconds);
+		batch = bench_run(master, name, SERIAL_RX_BATCH, looped, rate, seconds);
+		if (low < 0 || batch < 0) {
+			failed = 1;
+		} else if (batch >= low) {
+			printf("batch mode didn't save read() calls\n");
+			failed = 1;
+		}
+	}
+	close(master);
+
+	return failed;
+}
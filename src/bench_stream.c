@@ -0,0 +1,209 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_stream: frame size and encode time of packet_encode_mode() (in
+ * place) and packet_encode_stream() (callback, as on an MCU UART) for
+ * each packet type and framing mode. both must give the same bytes, the
+ * frame must decode again, and a full ANALOG_DATA_DELTA must fit in
+ * every mode.
+ *
+ * bench_stream [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "amcc.h"
+#include "packet.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_ITERATION 20000 /* default */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_output_struct {
+	unsigned char data[2 * MAX_PACKET_FRAME_LENGTH];
+	unsigned int length;
+} bench_output_t;
+
+/*
+ * functions
+ */
+
+static int bench_write(void *arg, const unsigned char *buffer, unsigned int length)
+{
+	bench_output_t *o = (bench_output_t*)arg;
+
+	if (o->length + length > sizeof(o->data))
+		return PACKET_FAIL;
+	memcpy(&o->data[o->length], buffer, length);
+	o->length += length;
+
+	return PACKET_SUCCESS;
+}
+
+/*
+ * largest packet of 'type', random values
+ */
+static void bench_fill(packet_t *p, PACKET_TYPE type)
+{
+	unsigned int i;
+
+	memset(p, 0, sizeof(packet_t));
+	p->type = type;
+	p->sequence = 200;
+	switch (type) {
+	case ANALOG_DATA_RESPONSE:
+		p->raw.analog_data.channel_number = 6;
+		for (i = 0; i < 6; i++)
+			p->raw.analog_data.value[i] = rand();
+		break;
+	case ANALOG_DATA_BATCH:
+		p->raw.analog_batch.channel_number = 6;
+		p->raw.analog_batch.sample_number = MAX_BATCH_VALUE / 6;
+		p->raw.analog_batch.timestamp = rand();
+		p->raw.analog_batch.period = 1000;
+		for (i = 0; i < MAX_BATCH_VALUE / 6 * 6; i++)
+			p->raw.analog_batch.value[i] = rand();
+		break;
+	case ANALOG_DATA_DELTA:
+		p->raw.analog_delta.channel_number = 6;
+		p->raw.analog_delta.sample_number = 10;
+		p->raw.analog_delta.timestamp = rand();
+		p->raw.analog_delta.period = 1000;
+		p->raw.analog_delta.length = MAX_DELTA_DATA;
+		for (i = 0; i < MAX_DELTA_DATA; i++)
+			p->raw.analog_delta.data[i] = rand();
+		break;
+	case DEVICE_PARAM_RESPONSE:
+		p->raw.device_param.index = 3;
+		p->raw.device_param.value = -123456;
+		break;
+	default:
+		break;
+	}
+}
+
+static double bench_ns(const struct timespec *from, const struct timespec *to,
+			unsigned int count)
+{
+	return ((to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec)) / count;
+}
+
+/*
+ * return 0 if both encoders agree and frame decodes again
+ */
+static int bench_case(PACKET_TYPE type, unsigned int mode, unsigned int iteration)
+{
+	static packet_t p, q;
+	static bench_output_t o;
+	struct timespec t0, t1, t2;
+	unsigned int i;
+
+	bench_fill(&p, type);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iteration; i++) {
+		if (packet_encode_mode(&p, mode) != PACKET_SUCCESS) {
+			printf("%c mode %02x: packet_encode_mode failed\n", type, mode);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < iteration; i++) {
+		o.length = 0;
+		if (packet_encode_stream(&p, mode, bench_write, &o) != PACKET_SUCCESS) {
+			printf("%c mode %02x: packet_encode_stream failed\n", type, mode);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	/* stream encoder left its payload in p->data, encode once more */
+	packet_encode_mode(&p, mode);
+	printf("%4c %4x %5u %10.1f %10.1f\n", type, mode, p.data_length,
+		bench_ns(&t0, &t1, iteration), bench_ns(&t1, &t2, iteration));
+	if (o.length != p.data_length || memcmp(o.data, p.data, o.length)) {
+		printf("%c mode %02x: stream output differs\n", type, mode);
+		return -1;
+	}
+
+	memcpy(q.data, p.data, p.data_length);
+	q.data_length = p.data_length;
+	if (mode & PACKET_MODE_COBS)
+		q.data_length--; /* framer drops delimiter */
+	if (packet_decode_mode(&q, mode) != PACKET_SUCCESS || q.type != type ||
+			q.sequence != ((mode & PACKET_MODE_SEQ) ? p.sequence : 0)) {
+		printf("%c mode %02x: frame doesn't decode\n", type, mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const PACKET_TYPE type[] = {
+		ANALOG_DATA_RESPONSE, ANALOG_DATA_BATCH,
+		ANALOG_DATA_DELTA, DEVICE_PARAM_RESPONSE
+	};
+	static const unsigned int mode[] = {
+		PACKET_MODE_ASCII,
+		PACKET_MODE_CRC16,
+		PACKET_MODE_CRC32,
+		PACKET_MODE_CRC32 | PACKET_MODE_SEQ,
+		PACKET_MODE_COBS,
+		PACKET_MODE_COBS | PACKET_MODE_CRC32,
+		PACKET_MODE_COBS | PACKET_MODE_CRC32 | PACKET_MODE_SEQ
+	};
+	unsigned int iteration = BENCH_ITERATION;
+	unsigned int i, j;
+	int failed = 0;
+
+	if (argc > 1)
+		iteration = atoi(argv[1]);
+	if (iteration == 0)
+		iteration = 1;
+	printf("type mode bytes  inplace ns  stream ns\n");
+	for (i = 0; i < sizeof(type) / sizeof(type[0]); i++) {
+		for (j = 0; j < sizeof(mode) / sizeof(mode[0]); j++) {
+			if (bench_case(type[i], mode[j], iteration))
+				failed = 1;
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,182 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * bench_tx: DEVICE_PARAM_SET bulk transfer with a DEVICE_MOTOR_CONTROL
+ * every 16 frames, over a wire taking 10 us a byte. Reports frames
+ * coalesced per tx_data() call and queue-to-wire latency per tx class,
+ * checks every frame arrives in order, batches keep to
+ * MX_TX_BATCH_BYTES and control overtakes bulk.
+ *
+ * bench_tx [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mx.h"
+
+/*
+ * macro
+ */
+
+#define BENCH_FRAMES 1000 /* default, bulk */
+#define BENCH_CONTROL_EVERY 16 /* bulk frames per control */
+#define BENCH_BYTE_US 10 /* wire time */
+#define BENCH_TIMEOUT 10000 /* ms to drain */
+
+/*
+ * data structure
+ */
+
+typedef struct _bench_struct {
+	guint writes;
+	guint frames;
+	guint batch_bytes; /* largest write of more than one frame */
+	guint bulk; /* next DEVICE_PARAM_SET index expected */
+	guint control; /* next DEVICE_MOTOR_CONTROL value expected */
+	guint error; /* frames broken or out of order */
+} bench_t;
+
+static bench_t bench;
+
+/*
+ * functions
+ */
+
+static gint bench_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	packet_t p;
+	guint i;
+	gint length = 0;
+
+	for (i = 0; i < count; i++) {
+		memcpy(p.data, iov[i].iov_base, iov[i].iov_len);
+		p.data_length = iov[i].iov_len;
+		length += iov[i].iov_len;
+		if (packet_decode(&p) != PACKET_SUCCESS)
+			bench.error++;
+		else if (p.type == DEVICE_PARAM_SET)
+			bench.error += p.raw.device_param.value != (gint)bench.bulk++;
+		else if (p.type == DEVICE_MOTOR_CONTROL)
+			bench.error += p.raw.motor_control.value[0] != bench.control++;
+		else
+			bench.error++;
+	}
+	bench.writes++;
+	if (count > 1 && (guint)length > bench.batch_bytes)
+		bench.batch_bytes = length;
+	bench.frames += count;
+	usleep(length * BENCH_BYTE_US);
+
+	return length;
+}
+
+static void bench_show(mx_t *m, const gchar *name, guint tx_class, mx_tx_stats_t *s)
+{
+	mx_tx_stats(m, tx_class, s);
+	printf("  %-7s sent %5u error %u latency avg %6llu us max %6u us\n", name,
+		s->sent, s->error, s->sent ? (unsigned long long)(s->latency_total / s->sent) : 0ULL,
+		s->latency_max);
+}
+
+int main(int argc, char *argv[])
+{
+	static mx_t mx;
+	mx_config_t c;
+	mx_tx_stats_t control, bulk;
+	packet_t p;
+	guint frames = BENCH_FRAMES;
+	guint i, total, controls = 0, waited;
+	int failed = 0;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (frames == 0)
+		frames = 1;
+	mx_config_default(&c);
+	c.tx.length = 64;
+	c.tx.policy = MX_BLOCK;
+	c.tx.timeout = BENCH_TIMEOUT;
+	memset(&bench, 0, sizeof(bench));
+	if (mx_init(&mx, bench_tx_data, NULL, &c) < 0)
+		return 1;
+
+	memset(&p, 0, sizeof(p));
+	for (i = 0; i < frames; i++) {
+		p.type = DEVICE_PARAM_SET;
+		p.raw.device_param.index = i;
+		p.raw.device_param.value = i;
+		if (mx_tx_packet(&mx, &p) < 0)
+			break;
+		if (i % BENCH_CONTROL_EVERY != BENCH_CONTROL_EVERY - 1)
+			continue;
+		p.type = DEVICE_MOTOR_CONTROL;
+		p.raw.motor_control.motor_number = 4;
+		p.raw.motor_control.value[0] = controls;
+		if (mx_tx_packet(&mx, &p) < 0)
+			break;
+		controls++;
+	}
+	total = frames + controls;
+	/* stats are updated after tx_data() returned */
+	for (waited = 0; waited < BENCH_TIMEOUT; waited++) {
+		mx_tx_stats(&mx, MX_TX_CONTROL, &control);
+		mx_tx_stats(&mx, MX_TX_BULK, &bulk);
+		if (control.sent + control.error + bulk.sent + bulk.error >= total)
+			break;
+		usleep(1000);
+	}
+
+	printf("frames %u writes %u frames/write %.1f largest batch %u bytes\n",
+		bench.frames, bench.writes,
+		bench.writes ? (double)bench.frames / bench.writes : 0.0, bench.batch_bytes);
+	bench_show(&mx, "control", MX_TX_CONTROL, &control);
+	bench_show(&mx, "bulk", MX_TX_BULK, &bulk);
+	mx_destroy(&mx);
+
+	if (bench.frames != total || bench.error || control.sent != controls ||
+			bulk.sent != frames) {
+		printf("frames lost or out of order\n");
+		failed = 1;
+	}
+	if (bench.writes >= bench.frames || bench.batch_bytes > MX_TX_BATCH_BYTES) {
+		printf("frames not coalesced within %u bytes\n", MX_TX_BATCH_BYTES);
+		failed = 1;
+	}
+	if (controls && control.latency_max >= bulk.latency_max) {
+		printf("control waited as long as bulk\n");
+		failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,209 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <string.h>
+
+#include "checksum.h"
+
+/*
+ * CHECKSUM_SMALL build (small MCU) computes CRC bit by bit,
+ * otherwise slicing-by-8 tables (12KB) are built by checksum_init().
+ */
+
+#define CRC16_POLY 0x1021
+#define CRC32_POLY 0x82f63b78 /* reflected Castagnoli */
+
+static const checksum_t checksum_engine[] = {
+	{ "sum", 0, 12, checksum_sum },
+	{ "crc16", 0xffff, 16, checksum_crc16 },
+	{ "crc32", 0, 32, checksum_crc32 },
+};
+
+#ifndef CHECKSUM_SMALL
+static unsigned short crc16_table[8][256];
+static unsigned int crc32_table[8][256];
+
+static void checksum_table_init(void)
+{
+	unsigned int i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i << 8;
+		for (j = 0; j < 8; j++) {
+			c = (c & 0x8000) ? (c << 1) ^ CRC16_POLY : c << 1;
+		}
+		crc16_table[0][i] = c;
+		c = i;
+		for (j = 0; j < 8; j++) {
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		}
+		crc32_table[0][i] = c;
+	}
+	/* table[j][i] is crc of byte i followed by j zero bytes */
+	for (j = 1; j < 8; j++) {
+		for (i = 0; i < 256; i++) {
+			c = crc16_table[j - 1][i];
+			crc16_table[j][i] = (c << 8) ^ crc16_table[0][c >> 8];
+			c = crc32_table[j - 1][i];
+			crc32_table[j][i] = (c >> 8) ^ crc32_table[0][c & 0xff];
+		}
+	}
+}
+#endif
+
+unsigned int checksum_sum(unsigned int crc, const unsigned char *d, unsigned int length)
+{
+	while (length--) {
+		crc += *d++;
+	}
+	return crc % 4096;
+}
+
+unsigned int checksum_crc16(unsigned int crc, const unsigned char *d, unsigned int length)
+{
+#ifdef CHECKSUM_SMALL
+	unsigned int i;
+
+	while (length--) {
+		crc ^= *d++ << 8;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY : crc << 1;
+		}
+	}
+	return crc & 0xffff;
+#else
+	crc &= 0xffff;
+	while (length >= 8) {
+		crc ^= (d[0] << 8) | d[1];
+		crc = crc16_table[7][crc >> 8] ^ crc16_table[6][crc & 0xff] ^
+			crc16_table[5][d[2]] ^ crc16_table[4][d[3]] ^
+			crc16_table[3][d[4]] ^ crc16_table[2][d[5]] ^
+			crc16_table[1][d[6]] ^ crc16_table[0][d[7]];
+		d += 8;
+		length -= 8;
+	}
+	while (length--) {
+		crc = ((crc << 8) & 0xffff) ^ crc16_table[0][(crc >> 8) ^ *d++];
+	}
+	return crc;
+#endif
+}
+
+static unsigned int checksum_crc32_soft(unsigned int crc, const unsigned char *d, unsigned int length)
+{
+#ifdef CHECKSUM_SMALL
+	unsigned int i;
+
+	crc = ~crc;
+	while (length--) {
+		crc ^= *d++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		}
+	}
+	return ~crc;
+#else
+	unsigned int lo, hi;
+
+	crc = ~crc;
+	while (length >= 8) {
+		lo = crc ^ (d[0] | (d[1] << 8) | (d[2] << 16) | ((unsigned int)d[3] << 24));
+		hi = d[4] | (d[5] << 8) | (d[6] << 16) | ((unsigned int)d[7] << 24);
+		crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+			crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+			crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+			crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+		d += 8;
+		length -= 8;
+	}
+	while (length--) {
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *d++) & 0xff];
+	}
+	return ~crc;
+#endif
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/*
+ * SSE4.2 crc32 instruction computes CRC-32C
+ */
+__attribute__((target("sse4.2")))
+static unsigned int checksum_crc32_sse42(unsigned int crc, const unsigned char *d, unsigned int length)
+{
+	unsigned long long c, v;
+
+	c = ~crc & 0xffffffff;
+	while (length >= 8) {
+		memcpy(&v, d, 8);
+		c = __builtin_ia32_crc32di(c, v);
+		d += 8;
+		length -= 8;
+	}
+	while (length--) {
+		c = __builtin_ia32_crc32qi(c, *d++);
+	}
+	return ~c;
+}
+#endif
+
+/* fastest implementation for this CPU, picked by checksum_init() */
+static CHECKSUM_UPDATE checksum_crc32_impl = checksum_crc32_soft;
+
+/*
+ * build tables and pick CRC-32C implementation, it must run once before
+ * any CRC is computed and before other threads start, GCC builds run it
+ * before main(), others call it at start up
+ */
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+void checksum_init(void)
+{
+#ifndef CHECKSUM_SMALL
+	checksum_table_init();
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		checksum_crc32_impl = checksum_crc32_sse42;
+#endif
+}
+
+unsigned int checksum_crc32(unsigned int crc, const unsigned char *d, unsigned int length)
+{
+	return checksum_crc32_impl(crc, d, length);
+}
+
+const checksum_t* checksum_get(unsigned int type)
+{
+	if (type >= sizeof(checksum_engine) / sizeof(checksum_engine[0]))
+		return NULL;
+	return &checksum_engine[type];
+}
@@ -0,0 +1,68 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+/*
+ * macro 
+ */
+
+#define CHECKSUM_SUM 0 /* byte sum modulo 4096, legacy ASCII frame */
+#define CHECKSUM_CRC16 1 /* CRC-16/CCITT-FALSE */
+#define CHECKSUM_CRC32 2 /* CRC-32C (Castagnoli) */
+
+/*
+ * data structure 
+ */
+
+struct checksum_struct;
+typedef struct checksum_struct checksum_t;
+/* 'crc' is the value returned by previous call or 'init' */
+typedef unsigned int (*CHECKSUM_UPDATE)(unsigned int crc, const unsigned char *d, unsigned int length);
+
+struct checksum_struct {
+	const char *name;
+	unsigned int init;
+	unsigned int width; /* bits */
+	CHECKSUM_UPDATE update;
+};
+
+/*
+ * functions
+ */
+
+extern void checksum_init(void);
+extern const checksum_t* checksum_get(unsigned int type);
+extern unsigned int checksum_sum(unsigned int crc, const unsigned char *d, unsigned int length);
+extern unsigned int checksum_crc16(unsigned int crc, const unsigned char *d, unsigned int length);
+extern unsigned int checksum_crc32(unsigned int crc, const unsigned char *d, unsigned int length);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * fuzz_packet: feed random, corrupted and truncated frames of every type
+ * and framing mode to packet_decode_mode(), packet_framer_feed() and
+ * packet_decode_batch(), and decoded packets on to packet_delta_decode()
+ * and packet_batch_sample(). run it under valgrind or built with
+ * -fsanitize=address,undefined, it fails by itself only when a decoder
+ * claims more bytes than it was given, loses an intact frame or takes
+ * an ANALOG_DATA_DELTA whose tail is longer than MAX_DELTA_DATA.
+ *
+ * fuzz_packet [iterations [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amcc.h"
+#include "packet.h"
+#include "checksum.h"
+
+/*
+ * macro
+ */
+
+#define FUZZ_ITERATION 200000 /* default */
+#define FUZZ_BATCH 8
+#define FUZZ_BUFFER (3 * MAX_PACKET_FRAME_LENGTH)
+
+/*
+ * functions
+ */
+
+static unsigned long long fuzz_state = 88172645463325252ULL;
+
+/* xorshift64, same sequence on every platform */
+static unsigned int fuzz_random(void)
+{
+	fuzz_state ^= fuzz_state << 13;
+	fuzz_state ^= fuzz_state >> 7;
+	fuzz_state ^= fuzz_state << 17;
+	return (unsigned int)fuzz_state;
+}
+
+/*
+ * frame of random type and contents, encoded in 'mode', -1 if the
+ * random contents don't make a valid packet
+ */
+static int fuzz_frame(packet_t *p, unsigned int mode)
+{
+	unsigned char *raw = (unsigned char*)&p->raw;
+	unsigned int i;
+
+	memset(&p->raw, 0, sizeof(p->raw));
+	p->type = PACKET_TYPE_FIRST + fuzz_random() % PACKET_TYPE_NUMBER;
+	p->sequence = fuzz_random();
+	for (i = 0; i < sizeof(p->raw); i++) {
+		if (fuzz_random() % 4 == 0)
+			raw[i] = fuzz_random();
+	}
+
+	return packet_encode_mode(p, mode) == PACKET_SUCCESS ? 0 : -1;
+}
+
+/*
+ * flip bytes, cut the frame short and/or append line noise, return new length
+ */
+static unsigned int fuzz_damage(unsigned char *buffer, unsigned int length)
+{
+	unsigned int i, n;
+
+	n = fuzz_random() % 6;
+	for (i = 0; i < n && length; i++)
+		buffer[fuzz_random() % length] = fuzz_random();
+	if (fuzz_random() % 3 == 0 && length)
+		length = fuzz_random() % length;
+	if (fuzz_random() % 5 == 0) {
+		n = fuzz_random() % (FUZZ_BUFFER / 2);
+		for (i = 0; i < n && length < FUZZ_BUFFER; i++)
+			buffer[length++] = fuzz_random();
+	}
+
+	return length;
+}
+
+/*
+ * use what a subscriber would of a decoded packet
+ */
+static void fuzz_use(packet_t *p, packet_delta_t *delta)
+{
+	analog_data_t a;
+	unsigned int i;
+
+	if (p->type == ANALOG_DATA_DELTA)
+		packet_delta_decode(delta, p);
+	if (p->type == ANALOG_DATA_BATCH) {
+		for (i = 0; i <= MAX_BATCH_VALUE; i++)
+			packet_batch_sample(p, i, &a);
+	}
+}
+
+static int fuzz_decode(packet_t *p, const unsigned char *buffer, unsigned int length,
+			unsigned int mode, packet_delta_t *delta)
+{
+	if (length > MAX_PACKET_DATA_LENGTH)
+		length = MAX_PACKET_DATA_LENGTH;
+	memcpy(p->data, buffer, length);
+	p->data_length = length;
+	/* framer doesn't hand the delimiter over */
+	if ((mode & PACKET_MODE_COBS) && length && buffer[length - 1] == 0)
+		p->data_length--;
+	if (packet_decode_mode(p, mode) != PACKET_SUCCESS)
+		return 0;
+	fuzz_use(p, delta);
+
+	return 1;
+}
+
+/*
+ * return decoded frames, -1 if framer used more than it was given
+ */
+static int fuzz_framer(packet_t *p, const unsigned char *buffer, unsigned int length,
+			unsigned int mode, packet_delta_t *delta)
+{
+	packet_framer_t f;
+	unsigned int offset, piece, used;
+	int n = 0;
+
+	packet_framer_init(&f);
+	packet_framer_mode(&f, mode);
+	for (offset = 0; offset < length; offset += used) {
+		/* random read sizes */
+		piece = 1 + fuzz_random() % (length - offset);
+		if (packet_framer_feed(&f, p, &buffer[offset], piece, &used) == PACKET_SUCCESS &&
+				packet_decode_mode(p, mode) == PACKET_SUCCESS) {
+			fuzz_use(p, delta);
+			n++;
+		}
+		if (used > piece)
+			return -1;
+		if (used == 0 && piece == length - offset)
+			break;
+	}
+
+	return n;
+}
+
+static int fuzz_batch(const unsigned char *buffer, unsigned int length, unsigned int mode)
+{
+	static packet_t p[FUZZ_BATCH];
+	unsigned int count, used;
+
+	count = packet_decode_batch(buffer, length, p, FUZZ_BATCH, &used, mode);
+	if (count > FUZZ_BATCH || used > length)
+		return -1;
+
+	return count;
+}
+
+/*
+ * COBS + CRC-16 ANALOG_DATA_DELTA frame with a 'tail' bytes long tail,
+ * stuffed by hand as the encoder refuses a tail over MAX_DELTA_DATA,
+ * return decoder result
+ */
+static int fuzz_tail(packet_t *p, unsigned int tail)
+{
+	const checksum_t *ck = checksum_get(CHECKSUM_CRC16);
+	unsigned int i, end, code, crc;
+
+	/* code + TYPE + DATA + CRC, as packet_encode_cobs() lays it out */
+	end = 1;
+	p->data[end++] = ANALOG_DATA_DELTA;
+	p->data[end++] = 3; /* channel_number */
+	p->data[end++] = 1; /* sample_number */
+	p->data[end++] = 0; /* sequence */
+	p->data[end++] = DELTA_KEYFRAME;
+	for (i = 0; i < 6; i++) /* timestamp, period */
+		p->data[end++] = 0;
+	for (i = 0; i < tail; i++)
+		p->data[end++] = i;
+	crc = ck->update(ck->init, &p->data[1], end - 1);
+	p->data[end++] = crc;
+	p->data[end++] = crc >> 8;
+
+	code = 0;
+	for (i = 1; i < end; i++) {
+		if (p->data[i] == 0) {
+			p->data[code] = i - code;
+			code = i;
+		}
+	}
+	p->data[code] = end - code;
+	p->data_length = end; /* framer drops the delimiter */
+
+	return packet_decode_mode(p, PACKET_MODE_COBS);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int mode[] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d
+	};
+	static unsigned char buffer[FUZZ_BUFFER];
+	static packet_t p;
+	packet_delta_t delta;
+	unsigned long iteration = FUZZ_ITERATION, i;
+	unsigned long decoded = 0, intact = 0, failed = 0;
+	unsigned int m, length;
+	int n;
+
+	if (argc > 1)
+		iteration = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		fuzz_state = strtoull(argv[2], NULL, 0) | 1;
+	packet_delta_init(&delta, DEFAULT_KEYFRAME_INTERVAL);
+
+	for (i = 0; i < iteration; i++) {
+		m = mode[fuzz_random() % (sizeof(mode) / sizeof(mode[0]))];
+		if (fuzz_frame(&p, m))
+			continue;
+		length = p.data_length;
+		memcpy(buffer, p.data, length);
+
+		/* every 8th frame goes through untouched and must survive */
+		if (i % 8 == 0) {
+			n = fuzz_framer(&p, buffer, length, m, &delta);
+			if (n != 1) {
+				printf("intact frame lost, mode %02x iteration %lu\n", m, i);
+				failed++;
+			}
+			intact++;
+			continue;
+		}
+
+		length = fuzz_damage(buffer, length);
+		switch (fuzz_random() % 3) {
+		case 0:
+			n = fuzz_decode(&p, buffer, length, m, &delta);
+			break;
+		case 1:
+			n = fuzz_framer(&p, buffer, length, m, &delta);
+			break;
+		default:
+			n = (m & PACKET_MODE_COBS) ? 0 : fuzz_batch(buffer, length, m);
+			break;
+		}
+		if (n < 0) {
+			printf("decoder used more bytes than given, mode %02x iteration %lu\n", m, i);
+			failed++;
+			continue;
+		}
+		decoded += n;
+	}
+	/* longest tail decodes, one byte more is refused, not cut short */
+	if (fuzz_tail(&p, MAX_DELTA_DATA) != PACKET_SUCCESS ||
+			p.raw.analog_delta.length != MAX_DELTA_DATA) {
+		printf("ANALOG_DATA_DELTA with %u byte tail lost\n", MAX_DELTA_DATA);
+		failed++;
+	}
+	if (fuzz_tail(&p, MAX_DELTA_DATA + 1) != PACKET_FAIL) {
+		printf("ANALOG_DATA_DELTA with %u byte tail taken\n", MAX_DELTA_DATA + 1);
+		failed++;
+	}
+	printf("iterations %lu intact %lu damaged decoded %lu failed %lu\n",
+		iteration, intact, decoded, failed);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+
+#include <string.h>
+
+#include "hist.h"
+
+static unsigned int hist_index(unsigned int value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB)
+		return value;
+	if (value >> HIST_MAGNITUDE)
+		value = (1u << HIST_MAGNITUDE) - 1;
+	shift = 31 - __builtin_clz(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+/*
+ * largest value counted in bucket 'index'
+ */
+static unsigned int hist_upper(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB)
+		return index;
+	shift = index / HIST_SUB - 1;
+	return ((index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_init(hist_t *h)
+{
+	memset(h, 0, sizeof(hist_t));
+}
+
+/*
+ * any thread may add to 'h' while others add or hist_read() it, each
+ * counter is added atomically on its own
+ */
+void hist_add(hist_t *h, unsigned int value)
+{
+	unsigned int max;
+
+	__atomic_add_fetch(&h->count[hist_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	__atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * copy 'h' while it may be added to, total is counted from the copied
+ * buckets so percentiles of the copy add up
+ */
+void hist_read(const hist_t *h, hist_t *copy)
+{
+	unsigned int i;
+
+	copy->total = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		copy->count[i] = __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+		copy->total += copy->count[i];
+	}
+	copy->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+/*
+ * value 'percent' (0 - 100) of values are at or below, rounded up to
+ * bucket bound. works on a copy (hist_read())
+ */
+unsigned int hist_percentile(const hist_t *h, double percent)
+{
+	unsigned long long target, n;
+	unsigned int i, upper;
+
+	if (h->total == 0)
+		return 0;
+	target = (unsigned long long)(percent * h->total / 100 + 0.999999);
+	if (target == 0)
+		target = 1;
+	n = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += h->count[i];
+		if (n >= target) {
+			upper = hist_upper(i);
+			return (upper < h->max) ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+unsigned int hist_mean(const hist_t *h)
+{
+	if (h->total == 0)
+		return 0;
+	return h->sum / h->total;
+}
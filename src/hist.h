@@ -0,0 +1,70 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef HIST_H_
+#define HIST_H_
+
+/*
+ * macro 
+ */
+
+/* 2^HIST_SUB_BITS buckets per power of two, values are kept within 1/8 */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAGNITUDE 28 /* larger values go to last bucket */
+#define HIST_BUCKETS ((HIST_MAGNITUDE - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * data structure 
+ */
+
+/*
+ * log linear histogram (HDR style): values below HIST_SUB have a bucket
+ * each, above it every power of two is split in HIST_SUB buckets.
+ * any thread may add, or read a copy while others add.
+ */
+typedef struct _hist_struct {
+	unsigned int count[HIST_BUCKETS];
+	unsigned int total; /* values added */
+	unsigned int max;
+	unsigned long long sum;
+} hist_t;
+
+/*
+ * functions
+ */
+
+extern void hist_init(hist_t *h);
+extern void hist_add(hist_t *h, unsigned int value);
+extern void hist_read(const hist_t *h, hist_t *copy);
+extern unsigned int hist_percentile(const hist_t *h, double percent);
+extern unsigned int hist_mean(const hist_t *h);
+
+#endif
@@ -0,0 +1,502 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "loop.h"
+
+static gboolean loop_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * timer heap of worker, links by deadline, all with w->mutex
+ */
+static void loop_heap_swap(loop_worker_t *w, guint i, guint j)
+{
+	loop_link_t *link = w->heap[i];
+
+	w->heap[i] = w->heap[j];
+	w->heap[j] = link;
+	w->heap[i]->heap_index = i;
+	w->heap[j]->heap_index = j;
+}
+
+static void loop_heap_up(loop_worker_t *w, guint i)
+{
+	while (i > 0 && loop_before(&w->heap[i]->deadline, &w->heap[(i - 1) / 2]->deadline)) {
+		loop_heap_swap(w, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void loop_heap_down(loop_worker_t *w, guint i)
+{
+	guint child;
+
+	while ((child = 2 * i + 1) < w->heap_number) {
+		if (child + 1 < w->heap_number &&
+				loop_before(&w->heap[child + 1]->deadline, &w->heap[child]->deadline))
+			child++;
+		if (!loop_before(&w->heap[child]->deadline, &w->heap[i]->deadline))
+			break;
+		loop_heap_swap(w, i, child);
+		i = child;
+	}
+}
+
+static void loop_heap_remove(loop_worker_t *w, loop_link_t *link)
+{
+	guint i;
+
+	if (link->heap_index < 0)
+		return;
+	i = link->heap_index;
+	link->heap_index = -1;
+	w->heap_number--;
+	if (i == w->heap_number)
+		return;
+	w->heap[i] = w->heap[w->heap_number];
+	w->heap[i]->heap_index = i;
+	loop_heap_down(w, i);
+	loop_heap_up(w, i);
+}
+
+/*
+ * due 'ms' from now, never when 'ms' < 0
+ */
+static void loop_heap_schedule(loop_worker_t *w, loop_link_t *link, gint ms)
+{
+	if (ms < 0) {
+		loop_heap_remove(w, link);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &link->deadline);
+	link->deadline.tv_sec += ms / 1000;
+	link->deadline.tv_nsec += (ms % 1000) * 1000000;
+	if (link->deadline.tv_nsec >= 1000000000) {
+		link->deadline.tv_sec++;
+		link->deadline.tv_nsec -= 1000000000;
+	}
+	if (link->heap_index < 0) {
+		link->heap_index = w->heap_number;
+		w->heap[w->heap_number++] = link;
+	} else {
+		loop_heap_down(w, link->heap_index);
+	}
+	loop_heap_up(w, link->heap_index);
+}
+
+/*
+ * with w->mutex: ms until first deadline, rounded up, -1 if none
+ */
+static gint loop_timeout(loop_worker_t *w)
+{
+	const struct timespec *deadline;
+	struct timespec now;
+
+	if (w->heap_number == 0)
+		return -1;
+	deadline = &w->heap[0]->deadline;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!loop_before(&now, deadline))
+		return 0;
+
+	return (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+}
+
+static gint loop_watch(loop_worker_t *w, loop_source_t *source, guint events)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = source;
+
+	return epoll_ctl(w->epfd, EPOLL_CTL_ADD, source->fd, &event);
+}
+
+/*
+ * with w->mutex, only when links were removed since epoll_wait(): is
+ * 'source' of a link still there, events of removed ones are skipped
+ */
+static gboolean loop_linked(loop_worker_t *w, loop_source_t *source)
+{
+	loop_link_t *l;
+
+	for (l = w->link; l; l = l->next) {
+		if (source == &l->rx || source == &l->wake)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * without w->mutex: link stays until loop_remove(), owner learns it by mx
+ */
+static void loop_lost(loop_worker_t *w, loop_link_t *link)
+{
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, link->rx.fd, NULL);
+	link->closed = TRUE;
+	mx_link_lost(link->mx);
+}
+
+/*
+ * without w->mutex: transport takes what it has to mx. its fd changes
+ * when a server gets or loses a client, a closed fd has left the epoll
+ * set by itself
+ */
+static void loop_read(loop_worker_t *w, loop_link_t *link)
+{
+	gint fd;
+
+	if (link->closed)
+		return;
+	if (transport_read(link->transport) == -1) {
+		loop_lost(w, link);
+		return;
+	}
+	fd = transport_fd(link->transport);
+	if (fd == link->rx.fd)
+		return;
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, link->rx.fd, NULL);
+	link->rx.fd = fd;
+	/* a lost client took its pending tx along */
+	link->events = EPOLLIN;
+	loop_watch(w, &link->rx, link->events);
+}
+
+/*
+ * without w->mutex: wait for fd to be writable only while transport
+ * holds tx bytes back, worker never blocks on a slow link
+ */
+static void loop_write(loop_worker_t *w, loop_link_t *link)
+{
+	struct epoll_event event;
+	guint events;
+
+	if (link->closed)
+		return;
+	if (link->output) {
+		link->output = FALSE;
+		if (transport_flush(link->transport) == -1) {
+			loop_lost(w, link);
+			return;
+		}
+	}
+	events = transport_tx_pending(link->transport) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	if (events == link->events)
+		return;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = &link->rx;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, link->rx.fd, &event) == 0)
+		link->events = events;
+}
+
+static void loop_ready(loop_link_t **ready, loop_link_t *link)
+{
+	if (link->ready)
+		return;
+	link->ready = TRUE;
+	link->ready_next = *ready;
+	*ready = link;
+}
+
+/*
+ * only links with input, woken by mx_tx_packet() or with a due deadline
+ * are serviced, however many the worker has. ready ones are picked with
+ * w->mutex, read and serviced without it, then rescheduled with it
+ */
+static void* loop_worker(void *data)
+{
+	loop_worker_t *w = (loop_worker_t*)data;
+	struct epoll_event event[LOOP_EVENT_NUMBER];
+	struct timespec now;
+	loop_source_t *source;
+	loop_link_t *link, *ready;
+	guint64 count;
+	guint removed;
+	gint i, n, timeout, linger;
+	gssize length;
+
+	pthread_mutex_lock(&w->mutex);
+	while (__atomic_load_n(&w->active, __ATOMIC_ACQUIRE)) {
+		timeout = loop_timeout(w);
+		removed = w->removed;
+		pthread_mutex_unlock(&w->mutex);
+		n = epoll_wait(w->epfd, event, LOOP_EVENT_NUMBER, timeout);
+		pthread_mutex_lock(&w->mutex);
+		if (n < 0) {
+			if (errno != EINTR)
+				break;
+			n = 0;
+		}
+		ready = NULL;
+		for (i = 0; i < n; i++) {
+			source = (loop_source_t*)event[i].data.ptr;
+			if (source == &w->stop) {
+				length = read(source->fd, &count, sizeof(count));
+				continue;
+			}
+			if (w->removed != removed && !loop_linked(w, source))
+				continue;
+			link = source->link;
+			if (source == &link->wake) {
+				/* mx_tx_packet(), mx_service() below sends */
+				length = read(source->fd, &count, sizeof(count));
+			} else {
+				if (event[i].events & EPOLLOUT)
+					link->output = TRUE;
+				if (event[i].events & ~EPOLLOUT)
+					link->input = TRUE;
+			}
+			loop_ready(&ready, link);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (w->heap_number > 0 && !loop_before(&now, &w->heap[0]->deadline)) {
+			link = w->heap[0];
+			loop_heap_remove(w, link);
+			if (link->transport->linger >= 0)
+				link->input = TRUE;
+			loop_ready(&ready, link);
+		}
+		if (ready == NULL)
+			continue;
+
+		/* ready links stay until serving ends, see loop_remove() */
+		w->serving = TRUE;
+		pthread_mutex_unlock(&w->mutex);
+		for (link = ready; link; link = link->ready_next) {
+			if (link->input) {
+				link->input = FALSE;
+				loop_read(w, link);
+			}
+			link->service = mx_service(link->mx);
+			loop_write(w, link);
+		}
+		pthread_mutex_lock(&w->mutex);
+		for (link = ready; link; link = link->ready_next) {
+			link->ready = FALSE;
+			linger = link->transport->linger;
+			if (linger >= 0 && (link->service < 0 || link->service > linger))
+				link->service = linger;
+			loop_heap_schedule(w, link, link->service);
+		}
+		w->serving = FALSE;
+		pthread_cond_broadcast(&w->served);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	(void)length;
+
+	return NULL;
+}
+
+static void loop_signal(gint fd)
+{
+	guint64 one = 1;
+	gssize ret;
+
+	ret = write(fd, &one, sizeof(one));
+	(void)ret;
+}
+
+/*
+ * TX_WAKE of mx
+ */
+static void loop_wake(void *arg)
+{
+	loop_signal(((loop_link_t*)arg)->wake.fd);
+}
+
+/*
+ * start 'worker_number' threads (0 for LOOP_WORKER_NUMBER), they stay
+ * the same however many links are added
+ */
+gint loop_init(loop_t *l, guint worker_number)
+{
+	loop_worker_t *w;
+	guint i;
+
+	if (worker_number == 0)
+		worker_number = LOOP_WORKER_NUMBER;
+	if (worker_number > MAX_LOOP_WORKER)
+		worker_number = MAX_LOOP_WORKER;
+	l->worker_number = 0;
+	for (i = 0; i < worker_number; i++) {
+		w = &l->worker[i];
+		w->link = NULL;
+		w->link_number = 0;
+		w->heap = NULL;
+		w->heap_number = 0;
+		w->heap_size = 0;
+		w->removed = 0;
+		w->serving = FALSE;
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		w->stop.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		w->stop.link = NULL;
+		if (w->epfd < 0 || w->stop.fd < 0 || loop_watch(w, &w->stop, EPOLLIN) < 0) {
+			if (w->epfd >= 0)
+				close(w->epfd);
+			if (w->stop.fd >= 0)
+				close(w->stop.fd);
+			loop_destroy(l);
+			return -1;
+		}
+		pthread_mutex_init(&w->mutex, NULL);
+		pthread_cond_init(&w->served, NULL);
+		w->active = TRUE;
+		pthread_create(&w->thread, NULL, loop_worker, (void*)w);
+		l->worker_number++;
+	}
+
+	return 0;
+}
+
+/*
+ * links still added are removed, their mx and transport are left to
+ * owner
+ */
+void loop_destroy(loop_t *l)
+{
+	loop_worker_t *w;
+	guint i;
+
+	for (i = 0; i < l->worker_number; i++) {
+		w = &l->worker[i];
+		__atomic_store_n(&w->active, FALSE, __ATOMIC_RELEASE);
+		loop_signal(w->stop.fd);
+		pthread_join(w->thread, NULL);
+		while (w->link)
+			loop_remove(l, w->link);
+		close(w->stop.fd);
+		close(w->epfd);
+		g_free(w->heap);
+		pthread_cond_destroy(&w->served);
+		pthread_mutex_destroy(&w->mutex);
+	}
+	l->worker_number = 0;
+}
+
+/*
+ * serve transport 't' and its mx (both opened with config.thread FALSE)
+ * by worker with fewest links, -1 if mx has threads or link fd can't be
+ * watched. mx callbacks run on worker, they mustn't add/remove links.
+ */
+gint loop_add(loop_t *l, loop_link_t *link, transport_t *t)
+{
+	loop_worker_t *w;
+	mx_t *mx = t->mx;
+	guint i;
+
+	if (mx->config.thread || t->config.thread || l->worker_number == 0)
+		return -1;
+	w = &l->worker[0];
+	for (i = 1; i < l->worker_number; i++) {
+		if (l->worker[i].link_number < w->link_number)
+			w = &l->worker[i];
+	}
+	link->rx.fd = transport_fd(t);
+	link->rx.link = link;
+	link->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	link->wake.link = link;
+	link->transport = t;
+	link->mx = mx;
+	link->events = EPOLLIN;
+	link->closed = FALSE;
+	link->ready = FALSE;
+	link->input = FALSE;
+	link->output = FALSE;
+	link->heap_index = -1;
+	link->worker = w;
+	if (link->wake.fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->heap_size <= w->link_number) {
+		w->heap_size = w->heap_size ? w->heap_size * 2 : 8;
+		w->heap = g_renew(loop_link_t*, w->heap, w->heap_size);
+	}
+	if (loop_watch(w, &link->rx, link->events) < 0 ||
+			loop_watch(w, &link->wake, EPOLLIN) < 0) {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, link->rx.fd, NULL);
+		pthread_mutex_unlock(&w->mutex);
+		close(link->wake.fd);
+		return -1;
+	}
+	link->next = w->link;
+	w->link = link;
+	w->link_number++;
+	mx->tx_wake = loop_wake;
+	mx->tx_wake_arg = link;
+	pthread_mutex_unlock(&w->mutex);
+	/* packets may be queued already */
+	loop_wake(link);
+
+	return 0;
+}
+
+/*
+ * stop serving 'link', its mx and transport are left to owner, nobody
+ * may call mx_tx_packet() on its mx meanwhile. waits while worker
+ * services its ready links, so it mustn't be called from mx callbacks.
+ */
+void loop_remove(loop_t *l, loop_link_t *link)
+{
+	loop_worker_t *w = link->worker;
+	loop_link_t **p;
+
+	(void)l;
+	pthread_mutex_lock(&w->mutex);
+	while (w->serving)
+		pthread_cond_wait(&w->served, &w->mutex);
+	for (p = &w->link; *p; p = &(*p)->next) {
+		if (*p == link) {
+			*p = link->next;
+			w->link_number--;
+			break;
+		}
+	}
+	loop_heap_remove(w, link);
+	w->removed++;
+	if (!link->closed)
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, link->rx.fd, NULL);
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, link->wake.fd, NULL);
+	link->mx->tx_wake = NULL;
+	pthread_mutex_unlock(&w->mutex);
+	close(link->wake.fd);
+}
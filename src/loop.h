@@ -0,0 +1,123 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef LOOP_H_
+#define LOOP_H_
+
+#include <pthread.h>
+#include <glib.h>
+#include "mx.h"
+#include "transport.h"
+
+/*
+ * macro 
+ */
+
+#define MAX_LOOP_WORKER 8
+#define LOOP_WORKER_NUMBER 2 /* default */
+#define LOOP_EVENT_NUMBER 32 /* events taken by one epoll_wait() */
+
+/*
+ * data structure 
+ */
+
+struct _loop_link_struct;
+struct _loop_worker_struct;
+
+/*
+ * fd watched by a worker, 'link' is NULL for worker's own stop event
+ */
+typedef struct _loop_source_struct {
+	gint fd;
+	struct _loop_link_struct *link;
+} loop_source_t;
+
+/*
+ * transport and mx of it, both opened without threads. worker reads
+ * transport_fd() by transport_read() and runs mx_service() when it was
+ * readable, mx_tx_packet() woke it by 'wake' eventfd or its deadline
+ * (next request timeout, serial linger) is due. tx bytes the link
+ * didn't take go out by transport_flush() once fd is writable
+ */
+typedef struct _loop_link_struct {
+	loop_source_t rx;
+	loop_source_t wake;
+	transport_t *transport;
+	mx_t *mx;
+	guint events; /* of rx in epoll set, EPOLLOUT while tx is pending */
+	gboolean closed; /* link lost */
+	gboolean ready; /* serviced in this round */
+	gboolean input; /* fd readable in this round */
+	gboolean output; /* fd writable in this round */
+	gint service; /* ms mx_service() asked for in this round */
+	struct timespec deadline; /* CLOCK_MONOTONIC, while in timer heap */
+	gint heap_index; /* in timer heap of worker, -1 if not there */
+	struct _loop_worker_struct *worker;
+	struct _loop_link_struct *next; /* links of worker */
+	struct _loop_link_struct *ready_next;
+} loop_link_t;
+
+/*
+ * one thread and epoll set serving a shard of links, a link is always
+ * served by same worker, so mx of it is never entered concurrently.
+ * links are read and serviced without mutex, loop_remove() waits for
+ * 'serving' to end instead
+ */
+typedef struct _loop_worker_struct {
+	pthread_t thread;
+	gint epfd;
+	loop_source_t stop;
+	loop_link_t *link; /* with mutex */
+	guint link_number;
+	loop_link_t **heap; /* links by deadline, with mutex */
+	guint heap_number;
+	guint heap_size;
+	guint removed; /* loop_remove() calls, with mutex */
+	gboolean serving; /* ready links taken out of mutex, with mutex */
+	gboolean active;
+	pthread_mutex_t mutex; /* link list, timer heap */
+	pthread_cond_t served; /* serving ended */
+} loop_worker_t;
+
+typedef struct _loop_struct {
+	loop_worker_t worker[MAX_LOOP_WORKER];
+	guint worker_number;
+} loop_t;
+
+/*
+ * functions
+ */
+
+extern gint loop_init(loop_t *l, guint worker_number);
+extern void loop_destroy(loop_t *l);
+extern gint loop_add(loop_t *l, loop_link_t *link, transport_t *t);
+extern void loop_remove(loop_t *l, loop_link_t *link);
+
+#endif
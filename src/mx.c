@@ -29,105 +29,886 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #include "amcc.h"
 #include "mx.h"
 
+#define MX_TX_SLOTS(m) ((m)->config.tx.length + 1) /* one slot kept open */
+
+/*
+ * absolute time 'ms' from now for pthread_cond_timedwait(), mx condition
+ * variables wait on CLOCK_MONOTONIC so setting the clock moves no deadline
+ */
+static void mx_deadline(struct timespec *ts, guint ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static guint mx_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void mx_high_water(mx_queue_stats_t *q, guint used)
+{
+	if (used > q->high_water)
+		__atomic_store_n(&q->high_water, used, __ATOMIC_RELAXED);
+}
+
+static void mx_subscriber_unref(mx_subscriber_t *s)
+{
+	if (__atomic_sub_fetch(&s->ref, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	/* packets queued but never delivered */
+	for (; s->tail != s->head; s->tail++)
+		mx_packet_unref(s->queue[s->tail % MX_SUBSCRIBER_QUEUE]);
+	g_free(s);
+}
+
+/*
+ * worker: deliver queued packets in order, at most MX_SUBSCRIBER_BATCH
+ * before giving the worker to other subscribers
+ */
+static void mx_subscriber_run(pool_task_t *task)
+{
+	mx_subscriber_t *s = (mx_subscriber_t*)task;
+	mx_subscriber_stats_t *st = &s->stats;
+	struct timespec now;
+	guint i, slot, us;
+	gint idle = 0;
+
+	for (i = 0; i < MX_SUBSCRIBER_BATCH; i++) {
+		if (s->tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE))
+			break;
+		slot = s->tail % MX_SUBSCRIBER_QUEUE;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us = mx_elapsed_us(&s->queued[slot], &now);
+		__atomic_store_n(&st->processed, st->processed + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&st->wait_total, st->wait_total + us, __ATOMIC_RELAXED);
+		if (us > st->wait_max)
+			__atomic_store_n(&st->wait_max, us, __ATOMIC_RELAXED);
+		s->callback(s->queue[slot], s->arg);
+		mx_packet_unref(s->queue[slot]);
+		__atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELEASE);
+	}
+	if (i == MX_SUBSCRIBER_BATCH) {
+		pool_submit(&s->mx->worker_pool, &s->task);
+		return;
+	}
+	/* pairs with mx_subscriber_post(): a packet queued meanwhile is seen */
+	__atomic_store_n(&s->scheduled, 0, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->head, __ATOMIC_SEQ_CST) != s->tail &&
+			__atomic_compare_exchange_n(&s->scheduled, &idle, 1, FALSE,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		pool_submit(&s->mx->worker_pool, &s->task);
+		return;
+	}
+	mx_subscriber_unref(s);
+}
+
+/*
+ * rx thread: queue 'p' for deferred callback, dropped when queue is full
+ */
+static void mx_subscriber_post(mx_t *m, mx_subscriber_t *s, packet_t *p)
+{
+	guint head = s->head, slot;
+	gint idle = 0;
+
+	if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) >= MX_SUBSCRIBER_QUEUE) {
+		__atomic_store_n(&s->stats.dropped, s->stats.dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	slot = head % MX_SUBSCRIBER_QUEUE;
+	s->queue[slot] = mx_packet_ref(p);
+	clock_gettime(CLOCK_MONOTONIC, &s->queued[slot]);
+	__atomic_store_n(&s->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->scheduled, __ATOMIC_SEQ_CST) == 0 &&
+			__atomic_compare_exchange_n(&s->scheduled, &idle, 1, FALSE,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&s->ref, 1, __ATOMIC_RELAXED);
+		pool_submit(&m->worker_pool, &s->task);
+	}
+}
+
+/*
+ * lock free, rx thread is the only reader of handler vectors
+ */
 static void mx_rx_packet_dispatch(mx_t *m, packet_t *p)
 {
-	RxHandler *h;
-	GSList *l;
+	mx_handler_vector_t *v;
+	guint i, index;
 
-	pthread_mutex_lock(&m->rx_dispatch_mutex);
-	for (l = m->rx_callback_list; l != NULL; l = g_slist_next (l)) {
-		h = (RxHandler*)l->data;
-		if (h->type == p->type) {
-			h->callback(p, h->arg);
+	index = (guint)p->type - PACKET_TYPE_FIRST;
+	if (index >= PACKET_TYPE_NUMBER)
+		return;
+	v = __atomic_load_n(&m->rx_handler[index], __ATOMIC_ACQUIRE);
+	if (v == NULL)
+		return;
+	for (i = 0; i < v->number; i++) {
+		if (v->handler[i].subscriber) {
+			mx_subscriber_post(m, v->handler[i].subscriber, p);
+		} else {
+			v->handler[i].callback(p, v->handler[i].arg);
 		}
 	}
-	pthread_mutex_unlock(&m->rx_dispatch_mutex);
 }
- 
-static void* mx_rx_thread(void *data)
+
+static void mx_handler_retire(mx_t *m, mx_handler_vector_t *v)
+{
+	if (v == NULL)
+		return;
+	v->next = __atomic_load_n(&m->rx_retired, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&m->rx_retired, &v->next, v, TRUE,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * free retired handler vectors, rx thread calls it outside of dispatch,
+ * so no vector taken off the list can still be in use
+ */
+static void mx_handler_reclaim(mx_t *m)
 {
+	mx_handler_vector_t *v, *next;
 	guint i;
-	gint ret;
-	mx_t *m = (mx_t*)data;
-	gchar *pointer, *start, *end;
 
-	while (1) {
-		if (m->thread_start == FALSE)
-			return;
-		/* 
-		 * scan rx pool
-		 */
-		pointer = m->rx_pool;
-		start = end = NULL;
-		pthread_mutex_lock(&m->rx_pool_mutex);
-		while (pointer < m->rx_pool + m->rx_pool_index) {
-			if (m->thread_start == FALSE) {
-				pthread_mutex_unlock(&m->rx_pool_mutex);
-				return;
-			}
-			switch (*pointer) {
-			case PACKET_START :
-				start = pointer;
+	v = __atomic_exchange_n(&m->rx_retired, NULL, __ATOMIC_ACQUIRE);
+	for (; v != NULL; v = next) {
+		next = v->next;
+		for (i = 0; i < v->number; i++) {
+			if (v->handler[i].subscriber)
+				mx_subscriber_unref(v->handler[i].subscriber);
+		}
+		free(v);
+	}
+}
+
+static mx_subscriber_t* mx_subscriber_new(mx_t *m, RX_CALLBACK callback, void *arg)
+{
+	mx_subscriber_t *s;
+
+	if (!m->worker_started) {
+		pool_init(&m->worker_pool, m->config.worker);
+		m->worker_started = TRUE;
+	}
+	s = g_new0(mx_subscriber_t, 1);
+	s->task.run = mx_subscriber_run;
+	s->mx = m;
+	s->callback = callback;
+	s->arg = arg;
+	s->ref = 1;
+
+	return s;
+}
+
+/*
+ * publish a copy of handler vector of 'type' without 'callback',
+ * 'callback' is appended again if 'add'
+ */
+static gint mx_rx_update(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback, void *arg,
+			gboolean add, guint flags)
+{
+	mx_handler_vector_t *old, *v;
+	guint index, i, n;
+	void *memory;
+
+	index = (guint)type - PACKET_TYPE_FIRST;
+	if (index >= PACKET_TYPE_NUMBER)
+		return -1;
+
+	pthread_mutex_lock(&m->rx_register_mutex);
+	old = m->rx_handler[index];
+	n = old ? old->number : 0;
+	for (i = 0; i < n && old->handler[i].callback != callback; i++);
+	if (!add && i == n) {
+		/* not registered */
+		pthread_mutex_unlock(&m->rx_register_mutex);
+		return 0;
+	}
+	v = NULL;
+	if (add || n > 1) {
+		if (posix_memalign(&memory, MX_CACHE_LINE, sizeof(mx_handler_vector_t) +
+					(n + 1) * sizeof(mx_handler_t))) {
+			pthread_mutex_unlock(&m->rx_register_mutex);
+			return -1;
+		}
+		v = (mx_handler_vector_t*)memory;
+		v->next = NULL;
+		v->number = 0;
+		for (i = 0; i < n; i++) {
+			if (old->handler[i].callback == callback)
+				continue;
+			v->handler[v->number] = old->handler[i];
+			if (v->handler[v->number].subscriber)
+				__atomic_add_fetch(&v->handler[v->number].subscriber->ref, 1,
+							__ATOMIC_RELAXED);
+			v->number++;
+		}
+		if (add) {
+			v->handler[v->number].callback = callback;
+			v->handler[v->number].arg = arg;
+			v->handler[v->number].subscriber = NULL;
+			if (flags & MX_HANDLER_DEFERRED)
+				v->handler[v->number].subscriber = mx_subscriber_new(m, callback, arg);
+			v->number++;
+		}
+	}
+	__atomic_store_n(&m->rx_handler[index], v, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m->rx_register_mutex);
+	mx_handler_retire(m, old);
+
+	return 0;
+}
+
+/*
+ * take a packet from pool for rx thread, spare one if pool is used up.
+ * only rx thread pops free list, so the head can't be popped and pushed
+ * back behind its back (no ABA).
+ */
+static packet_t* mx_packet_alloc(mx_t *m)
+{
+	mx_packet_t *mp;
+
+	mp = __atomic_load_n(&m->rx_free, __ATOMIC_ACQUIRE);
+	do {
+		if (mp == NULL)
+			return &m->rx_spare;
+	} while (!__atomic_compare_exchange_n(&m->rx_free, &mp, mp->next, TRUE,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	mp->ref = 1;
+	mx_high_water(&m->pool_queue,
+		__atomic_add_fetch(&m->pool_queue.used, 1, __ATOMIC_RELAXED));
+
+	return &mp->packet;
+}
+
+/*
+ * account received packet against sequence of its type. top and window
+ * are rx side state, counters are added atomically for mx_rx_stats()
+ * and mx_stats() to read without a lock per packet.
+ */
+static void mx_rx_sequence(mx_t *m, packet_t *p)
+{
+	mx_seq_stats_t *s = &m->rx_counter.seq[p->type - PACKET_TYPE_FIRST];
+	guint32 window;
+	gint d;
+
+	__atomic_add_fetch(&s->received, 1, __ATOMIC_RELAXED);
+	if (!(m->rx_framer.mode & PACKET_MODE_SEQ))
+		return;
+	if (!s->valid) {
+		__atomic_store_n(&s->top, p->sequence, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->window, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->valid, TRUE, __ATOMIC_RELAXED);
+		return;
+	}
+	d = (signed char)(p->sequence - s->top);
+	if (d > 0) {
+		/* newer, sequences in between are lost until they show up */
+		__atomic_add_fetch(&s->lost, d - 1, __ATOMIC_RELAXED);
+		window = (d < MX_SEQ_WINDOW) ? (s->window << d) | 1 : 1;
+		__atomic_store_n(&s->window, window, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->top, p->sequence, __ATOMIC_RELAXED);
+	} else if (d == 0 || (-d < MX_SEQ_WINDOW && (s->window & (1u << -d)))) {
+		__atomic_add_fetch(&s->duplicate, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&s->reordered, 1, __ATOMIC_RELAXED);
+		if (-d < MX_SEQ_WINDOW) {
+			__atomic_store_n(&s->window, s->window | (1u << -d),
+				__ATOMIC_RELAXED);
+			if (s->lost)
+				__atomic_sub_fetch(&s->lost, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * rx side switches framing mode, mx_tx_collect() reads tx_mode with
+ * tx_buffer_mutex
+ */
+static void mx_tx_mode(mx_t *m, guint mode)
+{
+	pthread_mutex_lock(&m->tx_buffer_mutex);
+	m->tx_mode = mode;
+	pthread_mutex_unlock(&m->tx_buffer_mutex);
+}
+
+/*
+ * device answered DEVICE_INFO_REQUEST, switch both directions to the
+ * common framing mode, the frame following this one uses new mode
+ */
+static void mx_rx_negotiate(mx_t *m, packet_t *p)
+{
+	guint mode, i;
+
+	mode = p->raw.device_info.capability & m->capability;
+	packet_framer_mode(&m->rx_framer, mode);
+	__atomic_store_n(&m->rx_overflow, m->rx_framer.overflow, __ATOMIC_RELAXED);
+	m->rx_overflow_run = 0;
+	mx_tx_mode(m, mode);
+	/* device restarts its sequences, called on rx side like mx_rx_sequence() */
+	for (i = 0; i < PACKET_TYPE_NUMBER; i++) {
+		__atomic_store_n(&m->rx_counter.seq[i].valid, FALSE, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * sleep until mx_rx_data() puts bytes in rx ring or threads stop.
+ * rx_sleeping is set before ring is checked and mx_rx_data() checks
+ * rx_sleeping after writing ring, so one of both sees the other.
+ */
+static void mx_rx_wait(mx_t *m, const struct timespec *deadline)
+{
+	gint ret = 0;
+
+	pthread_mutex_lock(&m->rx_wait_mutex);
+	__atomic_store_n(&m->rx_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (ring_used(&m->rx_ring) == 0 && m->thread_start &&
+			!m->request_wake && ret == 0) {
+		if (deadline) {
+			ret = pthread_cond_timedwait(&m->rx_cond, &m->rx_wait_mutex, deadline);
+		} else {
+			pthread_cond_wait(&m->rx_cond, &m->rx_wait_mutex);
+		}
+	}
+	m->request_wake = 0;
+	__atomic_store_n(&m->rx_sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->rx_wait_mutex);
+}
+
+/*
+ * strict priority, DEVICE_PARAM_* bulk transfer never delays motor control
+ */
+static guint mx_tx_class(PACKET_TYPE type)
+{
+	switch (type) {
+	case DEVICE_MOTOR_CONTROL:
+		return MX_TX_CONTROL;
+	case DEVICE_PARAM_REQUEST:
+	case DEVICE_PARAM_RESPONSE:
+	case DEVICE_PARAM_SAVE:
+	case DEVICE_PARAM_SET:
+		return MX_TX_BULK;
+	default:
+		return MX_TX_COMMAND;
+	}
+}
+
+/*
+ * queue 'p' for sending in its tx class, -1 if the class is full and
+ * 'policy' refuses it
+ */
+static gint mx_tx_queue(mx_t *m, packet_t *p, guint policy)
+{
+	struct timespec ts;
+	mx_tx_class_t *c;
+	gint ret = 0;
+
+	c = &m->tx_class[mx_tx_class(p->type)];
+	pthread_mutex_lock(&m->tx_buffer_mutex);
+	if (c->used == m->config.tx.length) {
+		switch (policy) {
+		case MX_DROP_OLDEST:
+			ADD_ONE_WITH_WRAP_AROUND(c->process_index, MX_TX_SLOTS(m));
+			c->used--;
+			m->tx_queue.used--;
+			m->tx_queue.dropped++;
+			break;
+		case MX_BLOCK:
+			m->tx_queue.blocked++;
+			mx_deadline(&ts, m->config.tx.timeout);
+			while (c->used == m->config.tx.length && m->thread_start && ret == 0)
+				ret = pthread_cond_timedwait(&m->tx_space_cond, &m->tx_buffer_mutex, &ts);
+			if (c->used < m->config.tx.length)
 				break;
-			case PACKET_END :
-				end = pointer;
-				if (start == NULL) {
-					break;
-				}
-				memcpy(m->rx_buffer[m->rx_present_index].data, start, end - start + 1);
-				m->rx_buffer[m->rx_present_index].data_length =  end - start + 1;
-				ret = packet_decode(&m->rx_buffer[m->rx_present_index]);
-				if (ret == PACKET_SUCCESS) {
-					ADD_ONE_WITH_WRAP_AROUND(m->rx_present_index, RX_BUFFER_LENGTH);
-				}
+			if (ret)
+				m->tx_queue.timeout++;
+			/* fall through */
+		default:
+			m->tx_queue.dropped++;
+			pthread_mutex_unlock(&m->tx_buffer_mutex);
+			return -1;
+		}
+	}
+	/* move packet to buffer*/
+	memcpy(&c->entry[c->present_index].packet, p, sizeof(packet_t));
+	clock_gettime(CLOCK_MONOTONIC, &c->entry[c->present_index].queued);
+	ADD_ONE_WITH_WRAP_AROUND(c->present_index, MX_TX_SLOTS(m));
+	c->used++;
+	m->tx_queue.used++;
+	mx_high_water(&m->tx_queue, m->tx_queue.used);
+	pthread_cond_signal(&m->tx_cond);
+	pthread_mutex_unlock(&m->tx_buffer_mutex);
+	if (m->tx_wake)
+		m->tx_wake(m->tx_wake_arg);
+
+	return 0;
+}
+
+/*
+ * response type answering 'request' and key telling responses of that
+ * type apart, -1 if 'request' has no response
+ */
+static gint mx_request_match(const packet_t *request, PACKET_TYPE *response, guint *key)
+{
+	*key = 0;
+	switch (request->type) {
+	case ANALOG_NAME_REQUEST:
+		*response = ANALOG_NAME_RESPONSE;
+		*key = request->raw.analog_name.channel;
+		break;
+	case ANALOG_DATA_REQUEST:
+		*response = ANALOG_DATA_RESPONSE;
+		break;
+	case DEVICE_INFO_REQUEST:
+		*response = DEVICE_INFO_RESPONSE;
+		break;
+	case DEVICE_PARAM_REQUEST:
+	case DEVICE_PARAM_SET: /* device answers with value it stored */
+		*response = DEVICE_PARAM_RESPONSE;
+		*key = request->raw.device_param.index;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static guint mx_response_key(const packet_t *response)
+{
+	switch (response->type) {
+	case ANALOG_NAME_RESPONSE:
+		return response->raw.analog_name.channel;
+	case DEVICE_PARAM_RESPONSE:
+		return response->raw.device_param.index;
+	default:
+		return 0;
+	}
+}
+
+static void mx_request_free(mx_t *m, mx_request_t *r)
+{
+	guint i = r->response - PACKET_TYPE_FIRST;
+
+	r->used = FALSE;
+	__atomic_store_n(&m->request_pending[i], m->request_pending[i] - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->request_used, m->request_used - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * rx thread: complete oldest request answered by 'p'
+ */
+static void mx_request_answer(mx_t *m, packet_t *p)
+{
+	mx_request_t *r, *oldest = NULL;
+	REQUEST_CALLBACK callback = NULL;
+	void *arg = NULL;
+	packet_t request;
+	guint i, key;
+
+	if (__atomic_load_n(&m->request_pending[p->type - PACKET_TYPE_FIRST],
+				__ATOMIC_RELAXED) == 0)
+		return;
+	key = mx_response_key(p);
+	pthread_mutex_lock(&m->request_mutex);
+	for (i = 0; i < MX_REQUEST_NUMBER; i++) {
+		r = &m->request[i];
+		if (r->used && r->response == p->type && r->key == key &&
+				(oldest == NULL || (gint)(r->order - oldest->order) < 0))
+			oldest = r;
+	}
+	if (oldest) {
+		memcpy(&request, &oldest->packet, sizeof(packet_t));
+		callback = oldest->callback;
+		arg = oldest->arg;
+		mx_request_free(m, oldest);
+	}
+	pthread_mutex_unlock(&m->request_mutex);
+	if (callback)
+		callback(&request, p, arg);
+}
+
+static gboolean mx_timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * rx thread: resend requests past their deadline or give them up,
+ * 'next' gets nearest deadline left, FALSE if there is none
+ */
+static gboolean mx_request_expire(mx_t *m, struct timespec *next)
+{
+	struct timespec now;
+	mx_request_t *r, *expired;
+	REQUEST_CALLBACK callback;
+	void *arg;
+	packet_t request;
+	gboolean resend, pending;
+	guint i;
+
+	if (__atomic_load_n(&m->request_used, __ATOMIC_RELAXED) == 0)
+		return FALSE;
+	while (1) {
+		expired = NULL;
+		pending = FALSE;
+		pthread_mutex_lock(&m->request_mutex);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < MX_REQUEST_NUMBER; i++) {
+			r = &m->request[i];
+			if (!r->used)
+				continue;
+			if (!mx_timespec_before(&now, &r->deadline)) {
+				expired = r;
 				break;
 			}
-			if (end != NULL) {
-				/* re-arrange rx pool */
-				memcpy(m->rx_pool, end + 1,
-							m->rx_pool_index - (end + 1 - m->rx_pool));
-				m->rx_pool_index -= end + 1 - m->rx_pool;
-				pointer = m->rx_pool;
-				start = end = NULL;
-			} else {
-				pointer++;
-			}
+			if (!pending || mx_timespec_before(&r->deadline, next))
+				*next = r->deadline;
+			pending = TRUE;
 		}
-		pthread_mutex_unlock(&m->rx_pool_mutex);
-		/* check rx_buffer */
-		while (m->rx_process_index != m->rx_present_index) {
-			/* pass packet up */
-			mx_rx_packet_dispatch(m, &m->rx_buffer[m->rx_process_index]);
-			ADD_ONE_WITH_WRAP_AROUND(m->rx_process_index, RX_BUFFER_LENGTH);
+		if (expired == NULL) {
+			pthread_mutex_unlock(&m->request_mutex);
+			return pending;
+		}
+		memcpy(&request, &expired->packet, sizeof(packet_t));
+		callback = expired->callback;
+		arg = expired->arg;
+		resend = expired->retry > 0;
+		if (resend) {
+			expired->retry--;
+			mx_deadline(&expired->deadline, expired->timeout);
+		} else {
+			mx_request_free(m, expired);
+			m->request_timeout++;
+		}
+		pthread_mutex_unlock(&m->request_mutex);
+		if (resend) {
+			/*
+			 * rx thread can't wait for tx room, a resend not fitting is
+			 * dropped (counted by tx queue), next deadline tries again
+			 */
+			if (mx_tx_queue(m, &request, m->config.tx.policy == MX_BLOCK ?
+						MX_DROP_NEWEST : m->config.tx.policy) == 0) {
+				pthread_mutex_lock(&m->request_mutex);
+				m->request_retried++;
+				pthread_mutex_unlock(&m->request_mutex);
+			}
+		} else if (callback) {
+			callback(&request, NULL, arg);
 		}
 	}
 }
 
-static void* mx_tx_thread(void *data)
+/*
+ * decode frame collected in 'p' and pass it up, 'p' goes back to pool
+ * unless a subscriber keeps it, next frame is collected in a new packet
+ */
+static void mx_rx_frame(mx_t *m, packet_t *p, const struct timespec *arrival)
 {
+	mx_rx_counter_t *c = &m->rx_counter;
+	struct timespec now;
+	guint index;
 	gint ret;
+
+	__atomic_add_fetch(&c->frames, 1, __ATOMIC_RELAXED);
+	ret = packet_decode_mode(p, m->rx_framer.mode);
+	if (ret == PACKET_SUCCESS) {
+		mx_rx_sequence(m, p);
+	} else {
+		__atomic_add_fetch(&m->rx_error, 1, __ATOMIC_RELAXED);
+	}
+	if (ret == PACKET_FAIL_CHECKSUM)
+		__atomic_add_fetch(&c->checksum, 1, __ATOMIC_RELAXED);
+	if (ret == PACKET_SUCCESS && p->type == ANALOG_DATA_DELTA) {
+		/* subscribers get it as ANALOG_DATA_BATCH */
+		ret = packet_delta_decode(&m->rx_delta, p);
+	}
+	if (ret == PACKET_FAIL) {
+		/* type is trusted once checksum is right */
+		index = (guint)p->type - PACKET_TYPE_FIRST;
+		if (index >= PACKET_TYPE_NUMBER)
+			index = PACKET_TYPE_NUMBER;
+		__atomic_add_fetch(&c->decode[index], 1, __ATOMIC_RELAXED);
+	}
+	if (ret == PACKET_SUCCESS) {
+		m->rx_overflow_run = 0;
+		if (p->type == DEVICE_INFO_RESPONSE)
+			mx_rx_negotiate(m, p);
+		if (p == &m->rx_spare) {
+			__atomic_add_fetch(&m->pool_queue.dropped, 1, __ATOMIC_RELAXED);
+		} else {
+			if (arrival) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				hist_add(&c->latency, mx_elapsed_us(arrival, &now));
+			}
+			__atomic_add_fetch(&c->dispatched, 1, __ATOMIC_RELAXED);
+			mx_request_answer(m, p);
+			mx_rx_packet_dispatch(m, p);
+		}
+	}
+	if (p != &m->rx_spare)
+		mx_packet_unref(p);
+	m->rx_packet = mx_packet_alloc(m);
+}
+
+/*
+ * arrival of frame ending before rx ring position 'end', NULL when
+ * its write wasn't stamped (yet). stamps of older writes are dropped.
+ */
+static const struct timespec* mx_rx_arrival(mx_t *m, guint end)
+{
+	mx_rx_counter_t *c = &m->rx_counter;
+	mx_stamp_t *s;
+	guint head, tail;
+
+	head = __atomic_load_n(&m->rx_stamp_head, __ATOMIC_ACQUIRE);
+	for (tail = c->stamp_tail; tail != head; tail++) {
+		s = &m->rx_stamp[tail % MX_STAMP_NUMBER];
+		if ((gint)(s->position - end) >= 0)
+			break;
+	}
+	/* slots before it go back to mx_rx_data() */
+	__atomic_store_n(&c->stamp_tail, tail, __ATOMIC_RELEASE);
+	if (tail == head)
+		return NULL;
+
+	return &m->rx_stamp[tail % MX_STAMP_NUMBER].time;
+}
+
+/*
+ * MX_DROP_OLDEST: keep rx thread on fresh bytes, backlog over half of
+ * ring is skipped and framer hunts for next frame
+ */
+static void mx_rx_skip(mx_t *m)
+{
+	guint n;
+
+	n = ring_discard(&m->rx_ring, m->rx_ring.size / 2);
+	if (n == 0)
+		return;
+	packet_framer_mode(&m->rx_framer, m->rx_framer.mode);
+	__atomic_store_n(&m->rx_queue.dropped, m->rx_queue.dropped + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * wake mx_rx_data() blocked for room, pairs with mx_rx_space_wait()
+ */
+static void mx_rx_space_signal(mx_t *m)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&m->rx_space_waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&m->rx_wait_mutex);
+		pthread_cond_signal(&m->rx_space_cond);
+		pthread_mutex_unlock(&m->rx_wait_mutex);
+	}
+}
+
+/*
+ * scan rx ring, framer keeps partial frame between calls and has copied
+ * every byte it used, so bytes are released as soon as they are scanned
+ */
+static void mx_rx_process(mx_t *m)
+{
+	guint length, used;
+	const guchar *pointer;
+	const struct timespec *arrival;
+
+	while (1) {
+		if (m->config.rx.policy == MX_DROP_OLDEST)
+			mx_rx_skip(m);
+		length = ring_peek(&m->rx_ring, &pointer);
+		if (length == 0)
+			break;
+		if (packet_framer_feed(&m->rx_framer, m->rx_packet, pointer,
+					length, &used) == PACKET_SUCCESS) {
+			arrival = mx_rx_arrival(m, m->rx_ring.tail + used);
+			mx_rx_frame(m, m->rx_packet, arrival);
+		}
+		ring_consume(&m->rx_ring, used);
+		mx_rx_space_signal(m);
+	}
+	if (m->rx_framer.overflow != m->rx_overflow) {
+		/* 
+		 * device isn't talking binary frame (eg: rebooted), fall
+		 * back to ASCII until next negotiation, one overflow may
+		 * just be line noise eating a delimiter
+		 */
+		m->rx_overflow_run += m->rx_framer.overflow - m->rx_overflow;
+		if (m->rx_framer.mode != PACKET_MODE_ASCII &&
+				m->rx_overflow_run >= MX_OVERFLOW_FALLBACK) {
+			packet_framer_mode(&m->rx_framer, PACKET_MODE_ASCII);
+			mx_tx_mode(m, PACKET_MODE_ASCII);
+			m->rx_overflow_run = 0;
+		}
+		__atomic_store_n(&m->rx_overflow, m->rx_framer.overflow, __ATOMIC_RELAXED);
+	}
+	mx_handler_reclaim(m);
+}
+
+static void* mx_rx_thread(void *data)
+{
+	struct timespec next;
 	mx_t *m = (mx_t*)data;
 
-	/* check tx buffer */
-	while(1) {
+	while (1) {
 		if (m->thread_start == FALSE)
-			return;
-		if (m->tx_process_index != m->tx_present_index) {
-			pthread_mutex_lock(&m->tx_buffer_mutex);
-			ret = packet_encode(&m->tx_buffer[m->tx_process_index]);
-			if (ret == PACKET_SUCCESS) {
-				/* send packet */
-				m->tx_data(m->tx_interface, m->tx_buffer[m->tx_process_index].data,
-							m->tx_buffer[m->tx_process_index].data_length);
-			}
-			ADD_ONE_WITH_WRAP_AROUND(m->tx_process_index, TX_BUFFER_LENGTH);
+			return NULL;
+		mx_rx_process(m);
+		if (mx_request_expire(m, &next)) {
+			mx_rx_wait(m, &next);
+		} else {
+			mx_rx_wait(m, NULL);
+		}
+	}
+}
+
+/*
+ * with tx_buffer_mutex: move highest priority packets into 'batch',
+ * until MX_TX_BATCH frames or MX_TX_BATCH_BYTES, return number of
+ * frames and framing mode in 'mode'. frames aren't encoded yet, bytes
+ * are estimated by last frame of the same type
+ */
+static guint mx_tx_collect(mx_t *m, mx_tx_entry_t *batch, guint *batch_class, guint *mode)
+{
+	mx_tx_class_t *c;
+	guint i, n, bytes, index, length;
+
+	n = 0;
+	bytes = 0;
+	for (i = 0; i < MX_TX_CLASS_NUMBER && n < MX_TX_BATCH; ) {
+		c = &m->tx_class[i];
+		if (c->used == 0) {
+			i++;
+			continue;
+		}
+		index = (guint)c->entry[c->process_index].packet.type - PACKET_TYPE_FIRST;
+		length = index < PACKET_TYPE_NUMBER ? m->tx_length[index] : 0;
+		/* frame stays queued for next batch */
+		if (n > 0 && bytes + length > MX_TX_BATCH_BYTES)
+			break;
+		memcpy(&batch[n], &c->entry[c->process_index], sizeof(mx_tx_entry_t));
+		bytes += length;
+		batch_class[n++] = i;
+		ADD_ONE_WITH_WRAP_AROUND(c->process_index, MX_TX_SLOTS(m));
+		c->used--;
+		m->tx_queue.used--;
+	}
+	*mode = m->tx_mode;
+
+	return n;
+}
+
+/*
+ * without tx_buffer_mutex: number and encode collected batch, frame
+ * failed to encode is left with data_length 0
+ */
+static void mx_tx_encode(mx_t *m, mx_tx_entry_t *batch, guint n, guint mode)
+{
+	packet_t *p;
+	guint i, index;
+
+	for (i = 0; i < n; i++) {
+		p = &batch[i].packet;
+		index = (guint)p->type - PACKET_TYPE_FIRST;
+		if ((mode & PACKET_MODE_SEQ) && index < PACKET_TYPE_NUMBER)
+			p->sequence = m->tx_sequence[index];
+		if (packet_encode_mode(p, mode) != PACKET_SUCCESS) {
+			p->data_length = 0;
+			continue;
+		}
+		if (index < PACKET_TYPE_NUMBER) {
+			if (mode & PACKET_MODE_SEQ)
+				m->tx_sequence[index]++;
+			m->tx_length[index] = p->data_length;
+		}
+	}
+}
+
+/*
+ * send collected batch, one write for all of it
+ */
+static void mx_tx_send(mx_t *m, mx_tx_entry_t *batch, guint *batch_class, guint n)
+{
+	gint ret;
+	guint i, us;
+	struct iovec iov[MX_TX_BATCH];
+	struct timespec now;
+	mx_tx_stats_t *s;
+	guint count = 0;
+	mx_tx_counter_t *c = &m->tx_counter;
+
+	for (i = 0; i < n; i++) {
+		if (batch[i].packet.data_length == 0)
+			continue;
+		iov[count].iov_base = batch[i].packet.data;
+		iov[count].iov_len = batch[i].packet.data_length;
+		count++;
+	}
+	ret = count > 0 ? m->tx_data(m->tx_interface, iov, count) : 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (ret < 0) {
+		__atomic_add_fetch(&c->error, count, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&c->bytes, ret, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&c->frames, count, __ATOMIC_RELAXED);
+		for (i = 0; i < n; i++)
+			if (batch[i].packet.data_length > 0)
+				hist_add(&c->latency, mx_elapsed_us(&batch[i].queued, &now));
+	}
+	pthread_mutex_lock(&m->tx_buffer_mutex);
+	for (i = 0; i < n; i++) {
+		s = &m->tx_class[batch_class[i]].stats;
+		if (ret < 0 || batch[i].packet.data_length == 0) {
+			s->error++;
+			continue;
+		}
+		us = mx_elapsed_us(&batch[i].queued, &now);
+		s->sent++;
+		s->latency_total += us;
+		if (us > s->latency_max)
+			s->latency_max = us;
+	}
+	pthread_mutex_unlock(&m->tx_buffer_mutex);
+}
+
+static void* mx_tx_thread(void *data)
+{
+	guint n, mode;
+	mx_t *m = (mx_t*)data;
+	mx_tx_entry_t batch[MX_TX_BATCH];
+	guint batch_class[MX_TX_BATCH];
+
+	while (1) {
+		/* wait for tx buffer */
+		pthread_mutex_lock(&m->tx_buffer_mutex);
+		while (m->tx_queue.used == 0 && m->thread_start)
+			pthread_cond_wait(&m->tx_cond, &m->tx_buffer_mutex);
+		if (m->thread_start == FALSE) {
 			pthread_mutex_unlock(&m->tx_buffer_mutex);
+			return NULL;
+		}
+		/* take packets out, so mx_tx_packet() isn't blocked by
+		 * encoding and sending */
+		n = mx_tx_collect(m, batch, batch_class, &mode);
+		pthread_cond_broadcast(&m->tx_space_cond);
+		pthread_mutex_unlock(&m->tx_buffer_mutex);
+		if (n > 0) {
+			mx_tx_encode(m, batch, n, mode);
+			mx_tx_send(m, batch, batch_class, n);
 		}
 	}
 }
@@ -135,6 +916,8 @@ static void* mx_tx_thread(void *data)
 static void mx_start_threads(mx_t *m)
 {
 	m->thread_start = TRUE;
+	if (!m->config.thread)
+		return;
 	/* start rx/tx thread */
 	pthread_create( &m->thread_rx, NULL, mx_rx_thread, (void*)m);
 	pthread_create( &m->thread_tx, NULL, mx_tx_thread, (void*)m);
@@ -142,107 +925,679 @@ static void mx_start_threads(mx_t *m)
 
 static void mx_stop_threads(mx_t *m)
 {
+	pthread_mutex_lock(&m->rx_wait_mutex);
+	pthread_mutex_lock(&m->tx_buffer_mutex);
 	m->thread_start = FALSE;
+	pthread_cond_signal(&m->rx_cond);
+	pthread_cond_broadcast(&m->rx_space_cond);
+	pthread_cond_signal(&m->tx_cond);
+	pthread_cond_broadcast(&m->tx_space_cond);
+	pthread_mutex_unlock(&m->tx_buffer_mutex);
+	pthread_mutex_unlock(&m->rx_wait_mutex);
+	if (!m->config.thread)
+		return;
+	pthread_join(m->thread_rx, NULL);
+	pthread_join(m->thread_tx, NULL);
+}
+
+/*
+ * config.thread FALSE: do what rx/tx threads would, by event loop owning
+ * 'm' (see loop_add()), after mx_rx_data() and when woken by tx_wake.
+ * return ms until next request deadline, -1 if there is none
+ */
+gint mx_service(mx_t *m)
+{
+	mx_tx_entry_t batch[MX_TX_BATCH];
+	guint batch_class[MX_TX_BATCH];
+	struct timespec next, now;
+	guint n, mode;
+
+	mx_rx_process(m);
+	do {
+		pthread_mutex_lock(&m->tx_buffer_mutex);
+		n = mx_tx_collect(m, batch, batch_class, &mode);
+		pthread_cond_broadcast(&m->tx_space_cond);
+		pthread_mutex_unlock(&m->tx_buffer_mutex);
+		if (n > 0) {
+			mx_tx_encode(m, batch, n, mode);
+			mx_tx_send(m, batch, batch_class, n);
+		}
+	} while (n > 0);
+	if (!mx_request_expire(m, &next))
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!mx_timespec_before(&now, &next))
+		return 0;
+
+	/* round up, never wake before deadline */
+	return (next.tv_sec - now.tv_sec) * 1000 +
+		(next.tv_nsec - now.tv_nsec + 999999) / 1000000;
 }
  
+/*
+ * MX_BLOCK: wait until rx ring has room for 'length' bytes
+ */
+static void mx_rx_space_wait(mx_t *m, guint length)
+{
+	struct timespec ts;
+	gint ret = 0;
+
+	if (length > m->rx_ring.size)
+		length = m->rx_ring.size;
+	if (ring_space(&m->rx_ring) >= length)
+		return;
+	__atomic_store_n(&m->rx_queue.blocked, m->rx_queue.blocked + 1, __ATOMIC_RELAXED);
+	mx_deadline(&ts, m->config.rx.timeout);
+	pthread_mutex_lock(&m->rx_wait_mutex);
+	__atomic_store_n(&m->rx_space_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (ring_space(&m->rx_ring) < length && m->thread_start && ret == 0)
+		ret = pthread_cond_timedwait(&m->rx_space_cond, &m->rx_wait_mutex, &ts);
+	__atomic_store_n(&m->rx_space_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->rx_wait_mutex);
+	if (ret)
+		__atomic_store_n(&m->rx_queue.timeout, m->rx_queue.timeout + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * count 'n' bytes just written to rx ring, stamp their arrival for
+ * mx_rx_arrival() unless all stamps are taken
+ */
+static void mx_rx_stamp(mx_t *m, guint n, const struct timespec *now)
+{
+	mx_stamp_t *s;
+	guint head = m->rx_stamp_head;
+
+	__atomic_add_fetch(&m->rx_bytes, n, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&m->rx_counter.stamp_tail, __ATOMIC_ACQUIRE) >=
+				MX_STAMP_NUMBER)
+		return;
+	s = &m->rx_stamp[head % MX_STAMP_NUMBER];
+	s->position = m->rx_ring.head;
+	s->time = *now;
+	__atomic_store_n(&m->rx_stamp_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * 'n' bytes got into rx ring, wake rx thread
+ */
+static void mx_rx_written(mx_t *m, guint n, const struct timespec *now)
+{
+	mx_high_water(&m->rx_queue, ring_used(&m->rx_ring));
+	if (n > 0)
+		mx_rx_stamp(m, n, now);
+	/* pairs with mx_rx_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&m->rx_sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&m->rx_wait_mutex);
+		pthread_cond_signal(&m->rx_cond);
+		pthread_mutex_unlock(&m->rx_wait_mutex);
+	}
+}
+
 /*
  * called by interface layer , eg : serial/ethernet/etc..
  * should be a callback function for interface module
  */
 gint mx_rx_data(mx_t *m, gchar *buffer, guint length)
 {
-	pthread_mutex_lock(&m->rx_pool_mutex);
-	if (m->rx_pool_index + length > RX_POOL_LENGTH) {
-		if (length < RX_POOL_LENGTH) {
-			memcpy(m->rx_pool, buffer, length);
-			m->rx_pool_index = length;
-		}
-		else
+	struct timespec now;
+	guint n;
+
+	if (m->config.rx.policy == MX_BLOCK)
+		mx_rx_space_wait(m, length);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* rx thread is behind, newest bytes are dropped and counted */
+	n = ring_write(&m->rx_ring, (guchar*)buffer, length);
+	mx_rx_written(m, n, &now);
+
+	return (n == length) ? 0 : -1;
+}
+
+/*
+ * for interface reading straight into rx ring instead of mx_rx_data():
+ * point 'buffer' at free room of rx ring and return its size, caller
+ * fills it and hands bytes over by mx_rx_commit(). 0 when ring is full,
+ * bytes should go by mx_rx_data() then, so they are dropped and counted.
+ * same thread as mx_rx_data() caller.
+ */
+guint mx_rx_reserve(mx_t *m, gchar **buffer)
+{
+	if (m->config.rx.policy == MX_BLOCK)
+		mx_rx_space_wait(m, 1);
+	return ring_reserve(&m->rx_ring, (guchar**)buffer);
+}
+
+void mx_rx_commit(mx_t *m, guint length)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ring_commit(&m->rx_ring, length);
+	mx_rx_written(m, length, &now);
+}
+
+/*
+ * register 'callback' for packets of 'type', registering same callback
+ * again only updates 'arg'. safe to call from callbacks.
+ */
+gint mx_rx_register(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback, void *arg)
+{
+	return mx_rx_update(m, type, callback, arg, TRUE, 0);
+}
+
+/*
+ * mx_rx_register() with MX_HANDLER_DEFERRED: 'callback' runs on worker
+ * pool (config.worker threads) instead of rx thread, so a slow one
+ * doesn't hold up decoding. packets come in order, up to
+ * MX_SUBSCRIBER_QUEUE of them wait, more are dropped. they hold packet
+ * pool while waiting. callback may still run for packets queued before
+ * mx_rx_unregister().
+ */
+gint mx_rx_register_flags(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback,
+			void *arg, guint flags)
+{
+	return mx_rx_update(m, type, callback, arg, TRUE, flags);
+}
+
+gint mx_rx_unregister(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback)
+{
+	return mx_rx_update(m, type, callback, NULL, FALSE, 0);
+}
+
+/*
+ * counters of deferred 'callback' of 'type', -1 if there is none
+ */
+gint mx_subscriber_stats(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback,
+			mx_subscriber_stats_t *s)
+{
+	mx_handler_vector_t *v;
+	mx_subscriber_stats_t *st;
+	guint i, index;
+	gint ret = -1;
+
+	index = (guint)type - PACKET_TYPE_FIRST;
+	if (index >= PACKET_TYPE_NUMBER)
+		return -1;
+	/* published vector is retired only under this mutex */
+	pthread_mutex_lock(&m->rx_register_mutex);
+	v = m->rx_handler[index];
+	for (i = 0; v && i < v->number; i++) {
+		if (v->handler[i].callback != callback || v->handler[i].subscriber == NULL)
+			continue;
+		st = &v->handler[i].subscriber->stats;
+		s->processed = __atomic_load_n(&st->processed, __ATOMIC_RELAXED);
+		s->dropped = __atomic_load_n(&st->dropped, __ATOMIC_RELAXED);
+		s->wait_total = __atomic_load_n(&st->wait_total, __ATOMIC_RELAXED);
+		s->wait_max = __atomic_load_n(&st->wait_max, __ATOMIC_RELAXED);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&m->rx_register_mutex);
+
+	return ret;
+}
+
+/*
+ * queue 'p' for sending in its tx class, -1 if the class is full and
+ * config.tx.policy refuses it
+ */
+gint mx_tx_packet(mx_t *m, packet_t* p)
+{
+	return mx_tx_queue(m, p, m->config.tx.policy);
+}
+
+/*
+ * send 'request', 'callback' is called by rx thread with the response,
+ * or with NULL response when none came 'timeout' ms after each of
+ * 'retry' resends. callback may be NULL and may issue next request, so
+ * a window of requests can be kept in flight.
+ * -1 if 'request' has no response type, MX_REQUEST_NUMBER requests are
+ * in flight or tx refuses it
+ */
+gint mx_request(mx_t *m, packet_t *request, guint timeout, guint retry,
+			REQUEST_CALLBACK callback, void *arg)
+{
+	mx_request_t *r = NULL;
+	PACKET_TYPE response;
+	guint i, key, order;
+
+	if (mx_request_match(request, &response, &key) < 0)
+		return -1;
+	pthread_mutex_lock(&m->request_mutex);
+	for (i = 0; i < MX_REQUEST_NUMBER && r == NULL; i++) {
+		if (!m->request[i].used)
+			r = &m->request[i];
+	}
+	if (r == NULL) {
+		pthread_mutex_unlock(&m->request_mutex);
+		return -1;
+	}
+	memcpy(&r->packet, request, sizeof(packet_t));
+	r->response = response;
+	r->key = key;
+	r->timeout = timeout;
+	r->retry = retry;
+	r->callback = callback;
+	r->arg = arg;
+	r->order = order = m->request_order++;
+	mx_deadline(&r->deadline, timeout);
+	r->used = TRUE;
+	i = response - PACKET_TYPE_FIRST;
+	__atomic_store_n(&m->request_pending[i], m->request_pending[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->request_used, m->request_used + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->request_mutex);
+
+	if (mx_tx_packet(m, request) < 0) {
+		pthread_mutex_lock(&m->request_mutex);
+		if (r->used && r->order == order) {
+			mx_request_free(m, r);
+			pthread_mutex_unlock(&m->request_mutex);
 			return -1;
-	} else {
-		memcpy(m->rx_pool + m->rx_pool_index, buffer, length);
-		m->rx_pool_index +=  length;
+		}
+		pthread_mutex_unlock(&m->request_mutex);
 	}
-	pthread_mutex_unlock(&m->rx_pool_mutex);
+	/* rx thread may sleep without deadline */
+	pthread_mutex_lock(&m->rx_wait_mutex);
+	m->request_wake = 1;
+	pthread_cond_signal(&m->rx_cond);
+	pthread_mutex_unlock(&m->rx_wait_mutex);
 
 	return 0;
 }
 
-gint mx_rx_register(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback, void *arg)
+void mx_request_stats(mx_t *m, guint *pending, guint *retried, guint *timeout)
+{
+	pthread_mutex_lock(&m->request_mutex);
+	if (pending)
+		*pending = m->request_used;
+	if (retried)
+		*retried = m->request_retried;
+	if (timeout)
+		*timeout = m->request_timeout;
+	pthread_mutex_unlock(&m->request_mutex);
+}
+
+/*
+ * offer binary framing to device, device answers DEVICE_INFO_RESPONSE
+ * with its capability and both sides switch, firmware without
+ * DEVICE_INFO support keeps ASCII. 'callback' (may be NULL) runs on rx
+ * thread when negotiation is done, with NULL response if device never
+ * answered
+ */
+gint mx_negotiate(mx_t *m, REQUEST_CALLBACK callback, void *arg)
+{
+	packet_t p;
+
+	p.type = DEVICE_INFO_REQUEST;
+	p.raw.device_info.board = 0;
+	p.raw.device_info.firmware = 0;
+	p.raw.device_info.capability = m->capability;
+
+	/* answer is taken by mx_rx_negotiate() */
+	return mx_request(m, &p, MX_NEGOTIATE_TIMEOUT, MX_NEGOTIATE_RETRY, callback, arg);
+}
+
+/*
+ * 'callback' learns from mx_link_lost() that the link is gone, set it
+ * before the link is opened
+ */
+void mx_link_notify(mx_t *m, LINK_LOST callback, void *arg)
+{
+	m->link_arg = arg;
+	m->link_callback = callback;
+}
+
+/*
+ * reader of the link (transport rx thread or loop worker) lost it, eg:
+ * USB adapter unplugged, peer closed. callback runs on the reader,
+ * only for the first report.
+ */
+void mx_link_lost(mx_t *m)
 {
-	RxHandler *h;
+	if (__atomic_exchange_n(&m->link_lost, TRUE, __ATOMIC_ACQ_REL))
+		return;
+	if (m->link_callback)
+		m->link_callback(m->link_arg);
+}
 
-	/* prevent saving same callback more entrys */
-	mx_rx_unregister(m, type, callback); 
+/*
+ * FALSE once mx_link_lost() was reported, until mx_init()
+ */
+gboolean mx_link_active(mx_t *m)
+{
+	return !__atomic_load_n(&m->link_lost, __ATOMIC_ACQUIRE);
+}
 
-	h = (RxHandler*)g_malloc(sizeof(RxHandler));
-	h->type = type;
-	h->callback = callback;
-	h->arg = arg;
+/*
+ * copy receive counters of packet 'type' to 's' while rx side runs,
+ * fields are read one by one, so they may be a packet apart
+ */
+gint mx_rx_stats(mx_t *m, PACKET_TYPE type, mx_seq_stats_t *s)
+{
+	mx_seq_stats_t *r;
 
-	pthread_mutex_lock(&m->rx_dispatch_mutex);
-	m->rx_callback_list = g_slist_append(m->rx_callback_list, (gpointer*)h);
-	pthread_mutex_unlock(&m->rx_dispatch_mutex);
+	if ((guint)type - PACKET_TYPE_FIRST >= PACKET_TYPE_NUMBER)
+		return -1;
+	r = &m->rx_counter.seq[type - PACKET_TYPE_FIRST];
+	s->received = __atomic_load_n(&r->received, __ATOMIC_RELAXED);
+	s->lost = __atomic_load_n(&r->lost, __ATOMIC_RELAXED);
+	s->duplicate = __atomic_load_n(&r->duplicate, __ATOMIC_RELAXED);
+	s->reordered = __atomic_load_n(&r->reordered, __ATOMIC_RELAXED);
+	s->valid = __atomic_load_n(&r->valid, __ATOMIC_RELAXED);
+	s->top = __atomic_load_n(&r->top, __ATOMIC_RELAXED);
+	s->window = __atomic_load_n(&r->window, __ATOMIC_RELAXED);
 
 	return 0;
 }
 
-gint mx_rx_unregister(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback)
+/*
+ * reference received packet 'p' in callback, to keep it after return
+ */
+packet_t* mx_packet_ref(packet_t *p)
 {
-	RxHandler *h;
-	GSList *l;
+	mx_packet_t *mp = (mx_packet_t*)p;
 
-	pthread_mutex_lock(&m->rx_dispatch_mutex);
-	for (l = m->rx_callback_list; l != NULL; l = g_slist_next (l)) {
-		h = (RxHandler*)l->data;
-		if ((h->type == type) && (h->callback == callback)) {
-			break;
-		}
-	}
-	if (l != NULL) {
-		m->rx_callback_list = g_slist_remove(m->rx_callback_list, l->data);
-		g_free(h);
+	__atomic_add_fetch(&mp->ref, 1, __ATOMIC_RELAXED);
+
+	return p;
+}
+
+/*
+ * drop reference, may be called by any thread
+ */
+void mx_packet_unref(packet_t *p)
+{
+	mx_packet_t *mp = (mx_packet_t*)p;
+	mx_t *m = mp->mx;
+
+	if (__atomic_sub_fetch(&mp->ref, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	__atomic_sub_fetch(&m->pool_queue.used, 1, __ATOMIC_RELAXED);
+	mp->next = __atomic_load_n(&m->rx_free, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&m->rx_free, &mp->next, mp, TRUE,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * link level losses, any of pointers may be NULL
+ */
+void mx_rx_errors(mx_t *m, guint *error, guint *overflow, guint *dropped,
+			guint *exhausted)
+{
+	if (error)
+		*error = __atomic_load_n(&m->rx_error, __ATOMIC_RELAXED);
+	if (overflow)
+		*overflow = __atomic_load_n(&m->rx_overflow, __ATOMIC_RELAXED);
+	if (dropped)
+		*dropped = __atomic_load_n(&m->rx_ring.dropped, __ATOMIC_RELAXED);
+	if (exhausted)
+		*exhausted = __atomic_load_n(&m->pool_queue.dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * copy counters of queue MX_QUEUE_* to 's'
+ */
+gint mx_queue_stats(mx_t *m, guint queue, mx_queue_stats_t *s)
+{
+	mx_queue_stats_t *q;
+
+	switch (queue) {
+	case MX_QUEUE_RX:
+		q = &m->rx_queue;
+		s->length = m->rx_ring.size;
+		s->used = ring_used(&m->rx_ring);
+		/* skipped by rx thread + refused by ring */
+		s->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED) +
+			__atomic_load_n(&m->rx_ring.dropped, __ATOMIC_RELAXED);
+		break;
+	case MX_QUEUE_POOL:
+		q = &m->pool_queue;
+		s->length = m->config.pool.length;
+		s->used = __atomic_load_n(&q->used, __ATOMIC_RELAXED);
+		s->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+		break;
+	case MX_QUEUE_TX:
+		pthread_mutex_lock(&m->tx_buffer_mutex);
+		memcpy(s, &m->tx_queue, sizeof(mx_queue_stats_t));
+		pthread_mutex_unlock(&m->tx_buffer_mutex);
+		return 0;
+	default:
+		return -1;
 	}
-	pthread_mutex_unlock(&m->rx_dispatch_mutex);
+	s->high_water = __atomic_load_n(&q->high_water, __ATOMIC_RELAXED);
+	s->blocked = __atomic_load_n(&q->blocked, __ATOMIC_RELAXED);
+	s->timeout = __atomic_load_n(&q->timeout, __ATOMIC_RELAXED);
 
 	return 0;
 }
 
-gint mx_tx_packet(mx_t *m, packet_t* p)
+/*
+ * copy counters of tx class MX_TX_*
+ */
+gint mx_tx_stats(mx_t *m, guint tx_class, mx_tx_stats_t *s)
 {
-	/* move packet to buffer*/
+	if (tx_class >= MX_TX_CLASS_NUMBER)
+		return -1;
 	pthread_mutex_lock(&m->tx_buffer_mutex);
-	memcpy(&m->tx_buffer[m->tx_present_index], p, sizeof(packet_t));
-	ADD_ONE_WITH_WRAP_AROUND(m->tx_present_index, TX_BUFFER_LENGTH);
+	memcpy(s, &m->tx_class[tx_class].stats, sizeof(mx_tx_stats_t));
 	pthread_mutex_unlock(&m->tx_buffer_mutex);
 
 	return 0;
 }
 
-void mx_init(mx_t *m, TX_DATA tx_data, void *arg)
+/*
+ * sum up counters of rx/tx side and mx_rx_data() caller while they run
+ */
+void mx_stats(mx_t *m, mx_stats_t *s)
+{
+	mx_rx_counter_t *rc = &m->rx_counter;
+	mx_tx_counter_t *tc = &m->tx_counter;
+	guint i;
+
+	s->rx_bytes = __atomic_load_n(&m->rx_bytes, __ATOMIC_RELAXED);
+	s->rx_frames = __atomic_load_n(&rc->frames, __ATOMIC_RELAXED);
+	s->rx_checksum = __atomic_load_n(&rc->checksum, __ATOMIC_RELAXED);
+	for (i = 0; i <= PACKET_TYPE_NUMBER; i++)
+		s->rx_decode[i] = __atomic_load_n(&rc->decode[i], __ATOMIC_RELAXED);
+	s->rx_dispatched = __atomic_load_n(&rc->dispatched, __ATOMIC_RELAXED);
+	s->rx_overflow = __atomic_load_n(&m->rx_overflow, __ATOMIC_RELAXED);
+	s->rx_lost = s->rx_duplicate = s->rx_reordered = 0;
+	for (i = 0; i < PACKET_TYPE_NUMBER; i++) {
+		s->rx_lost += __atomic_load_n(&rc->seq[i].lost, __ATOMIC_RELAXED);
+		s->rx_duplicate += __atomic_load_n(&rc->seq[i].duplicate, __ATOMIC_RELAXED);
+		s->rx_reordered += __atomic_load_n(&rc->seq[i].reordered, __ATOMIC_RELAXED);
+	}
+	s->tx_bytes = __atomic_load_n(&tc->bytes, __ATOMIC_RELAXED);
+	s->tx_frames = __atomic_load_n(&tc->frames, __ATOMIC_RELAXED);
+	s->tx_error = __atomic_load_n(&tc->error, __ATOMIC_RELAXED);
+	for (i = 0; i < MX_QUEUE_NUMBER; i++)
+		mx_queue_stats(m, i, &s->queue[i]);
+	hist_read(&rc->latency, &s->rx_latency);
+	hist_read(&tc->latency, &s->tx_latency);
+}
+
+static void mx_stats_latency(const gchar *name, const hist_t *h)
 {
+	g_print("%s latency us: n %u mean %u p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+		name, h->total, hist_mean(h), hist_percentile(h, 50),
+		hist_percentile(h, 90), hist_percentile(h, 99),
+		hist_percentile(h, 99.9), h->max);
+}
+
+void mx_stats_dump(const mx_stats_t *s)
+{
+	static const gchar *queue_name[MX_QUEUE_NUMBER] = { "rx ring", "rx pool", "tx" };
+	const mx_queue_stats_t *q;
+	guint i;
+
+	g_print("rx: %" G_GUINT64_FORMAT " bytes, %u frames, %u dispatched, "
+		"%u checksum, %u overflow\n", s->rx_bytes, s->rx_frames,
+		s->rx_dispatched, s->rx_checksum, s->rx_overflow);
+	g_print("rx sequence: %u lost, %u duplicate, %u reordered\n", s->rx_lost,
+		s->rx_duplicate, s->rx_reordered);
+	for (i = 0; i <= PACKET_TYPE_NUMBER; i++) {
+		if (s->rx_decode[i] == 0)
+			continue;
+		if (i < PACKET_TYPE_NUMBER) {
+			g_print("rx decode failed: type %c %u\n", PACKET_TYPE_FIRST + i,
+				s->rx_decode[i]);
+		} else {
+			g_print("rx decode failed: unknown type %u\n", s->rx_decode[i]);
+		}
+	}
+	mx_stats_latency("rx", &s->rx_latency);
+	g_print("tx: %" G_GUINT64_FORMAT " bytes, %u frames, %u error\n",
+		s->tx_bytes, s->tx_frames, s->tx_error);
+	mx_stats_latency("tx", &s->tx_latency);
+	for (i = 0; i < MX_QUEUE_NUMBER; i++) {
+		q = &s->queue[i];
+		g_print("%s: %u/%u used, %u high water, %u dropped, %u blocked, "
+			"%u timeout\n", queue_name[i], q->used, q->length,
+			q->high_water, q->dropped, q->blocked, q->timeout);
+	}
+}
+
+void mx_config_default(mx_config_t *c)
+{
+	c->rx.length = RX_RING_LENGTH;
+	c->rx.policy = MX_DROP_NEWEST;
+	c->rx.timeout = 0;
+	c->pool.length = MX_PACKET_POOL_LENGTH;
+	c->pool.policy = MX_DROP_NEWEST;
+	c->pool.timeout = 0;
+	c->tx.length = TX_BUFFER_LENGTH;
+	c->tx.policy = MX_DROP_OLDEST; /* fresh commands first */
+	c->tx.timeout = 0;
+	c->thread = TRUE;
+	c->worker = 0;
+}
+
+/*
+ * 'config' NULL for mx_config_default(), -1 if rx ring can't be allocated
+ */
+gint mx_init(mx_t *m, TX_DATA tx_data, void *arg, const mx_config_t *config)
+{
+	pthread_condattr_t attr;
+	guint i;
+
+	if (config) {
+		memcpy(&m->config, config, sizeof(mx_config_t));
+	} else {
+		mx_config_default(&m->config);
+	}
+	m->config.pool.policy = MX_DROP_NEWEST;
+	if (!m->config.thread) {
+		/* blocking would stall the loop which empties the queue */
+		if (m->config.rx.policy == MX_BLOCK)
+			m->config.rx.policy = MX_DROP_NEWEST;
+		if (m->config.tx.policy == MX_BLOCK)
+			m->config.tx.policy = MX_DROP_NEWEST;
+	}
+	m->tx_wake = NULL;
+	m->tx_wake_arg = NULL;
+	m->link_lost = FALSE;
+	m->link_callback = NULL;
+	m->link_arg = NULL;
+	m->worker_started = FALSE;
+	if (m->config.tx.length == 0)
+		m->config.tx.length = 1;
+	if (m->config.pool.length == 0)
+		m->config.pool.length = 1;
+	if (ring_init(&m->rx_ring, m->config.rx.length) < 0)
+		return -1;
+	memset(&m->rx_queue, 0, sizeof(mx_queue_stats_t));
+	memset(&m->pool_queue, 0, sizeof(mx_queue_stats_t));
+	memset(&m->tx_queue, 0, sizeof(mx_queue_stats_t));
+	m->rx_queue.length = m->rx_ring.size;
+	m->pool_queue.length = m->config.pool.length;
+	m->tx_queue.length = m->config.tx.length * MX_TX_CLASS_NUMBER;
+
 	m->tx_data = tx_data;
 	m->tx_interface = arg;
 
-	m->rx_pool_index = 0;
-	m->rx_process_index = 0;
-	m->rx_present_index = 0;
-	m->tx_process_index = 0;
-	m->tx_present_index = 0;
-	m->rx_callback_list = NULL;
+	m->rx_pool = g_new0(mx_packet_t, m->config.pool.length);
+	m->rx_free = NULL;
+	for (i = 0; i < m->config.pool.length; i++) {
+		m->rx_pool[i].mx = m;
+		m->rx_pool[i].next = m->rx_free;
+		m->rx_free = &m->rx_pool[i];
+	}
+	m->rx_packet = mx_packet_alloc(m);
+	for (i = 0; i < MX_TX_CLASS_NUMBER; i++) {
+		memset(&m->tx_class[i], 0, sizeof(mx_tx_class_t));
+		m->tx_class[i].entry = g_new(mx_tx_entry_t, MX_TX_SLOTS(m));
+	}
+	memset(m->rx_handler, 0, sizeof(m->rx_handler));
+	m->rx_retired = NULL;
+	m->capability = PACKET_MODE_COBS | PACKET_MODE_CRC16 | PACKET_MODE_CRC32 |
+				PACKET_MODE_SEQ;
+	m->tx_mode = PACKET_MODE_ASCII;
+	m->rx_overflow = 0;
+	m->rx_overflow_run = 0;
+	m->rx_error = 0;
+	m->rx_bytes = 0;
+	m->rx_stamp_head = 0;
+	memset(&m->rx_counter, 0, sizeof(mx_rx_counter_t));
+	memset(&m->tx_counter, 0, sizeof(mx_tx_counter_t));
+	m->rx_sleeping = 0;
 	
-	memset(m->rx_pool, 0, RX_POOL_LENGTH);
+	memset(m->tx_sequence, 0, sizeof(m->tx_sequence));
+	memset(m->tx_length, 0, sizeof(m->tx_length));
+	memset(m->request, 0, sizeof(m->request));
+	memset(m->request_pending, 0, sizeof(m->request_pending));
+	m->request_order = 0;
+	m->request_used = 0;
+	m->request_wake = 0;
+	m->request_retried = 0;
+	m->request_timeout = 0;
+	packet_framer_init(&m->rx_framer);
+	packet_delta_init(&m->rx_delta, DEFAULT_KEYFRAME_INTERVAL);
 
-	pthread_mutex_init(&m->rx_pool_mutex, NULL);
 	pthread_mutex_init(&m->tx_buffer_mutex, NULL);
-	pthread_mutex_init(&m->rx_dispatch_mutex, NULL);
+	pthread_mutex_init(&m->rx_register_mutex, NULL);
+	pthread_mutex_init(&m->rx_wait_mutex, NULL);
+	pthread_mutex_init(&m->request_mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m->rx_cond, &attr);
+	pthread_cond_init(&m->tx_cond, &attr);
+	pthread_cond_init(&m->rx_space_cond, &attr);
+	pthread_cond_init(&m->tx_space_cond, &attr);
+	pthread_condattr_destroy(&attr);
 	
 	mx_start_threads(m);
+
+	return 0;
 }
 
+/*
+ * packets still referenced by subscribers are freed too, requests in
+ * flight are dropped without callback
+ */
 void mx_destroy(mx_t *m)
 {
+	guint i;
+
 	mx_stop_threads(m);
-	g_slist_foreach(m->rx_callback_list, (GFunc)g_free, NULL);
-	g_slist_free(m->rx_callback_list);
+	/* deferred callbacks get what is queued for them */
+	if (m->worker_started)
+		pool_destroy(&m->worker_pool);
+	for (i = 0; i < PACKET_TYPE_NUMBER; i++) {
+		mx_handler_retire(m, m->rx_handler[i]);
+		m->rx_handler[i] = NULL;
+	}
+	mx_handler_reclaim(m);
+	ring_destroy(&m->rx_ring);
+	g_free(m->rx_pool);
+	for (i = 0; i < MX_TX_CLASS_NUMBER; i++)
+		g_free(m->tx_class[i].entry);
+
+	pthread_cond_destroy(&m->tx_space_cond);
+	pthread_cond_destroy(&m->rx_space_cond);
+	pthread_cond_destroy(&m->tx_cond);
+	pthread_cond_destroy(&m->rx_cond);
+	pthread_mutex_destroy(&m->request_mutex);
+	pthread_mutex_destroy(&m->rx_wait_mutex);
+	pthread_mutex_destroy(&m->rx_register_mutex);
+	pthread_mutex_destroy(&m->tx_buffer_mutex);
 }
@@ -32,16 +32,57 @@
 #define MX_H_
 
 #include <pthread.h>
+#include <sys/uio.h>
 #include <glib.h>
 #include "packet.h"
+#include "ring.h"
+#include "hist.h"
+#include "pool.h"
 
 /*
  * macro 
  */
 
-#define RX_POOL_LENGTH (MAX_PACKET_DATA_LENGTH * 5)
-#define RX_BUFFER_LENGTH 10
-#define TX_BUFFER_LENGTH 10
+#define MX_CACHE_LINE 64
+#define MX_ALIGNED __attribute__((aligned(MX_CACHE_LINE))) /* own cache line */
+
+/* default queue depths, see mx_config_t */
+#define RX_RING_LENGTH 8192 /* power of two */
+#define MX_PACKET_POOL_LENGTH 64 /* received packets shared by subscribers */
+#define TX_BUFFER_LENGTH 10 /* per tx class */
+#define MX_OVERFLOW_FALLBACK 3 /* overflows without good frame, then back to ASCII */
+
+/* what a full queue does with a new entry */
+#define MX_DROP_NEWEST 0 /* refuse it */
+#define MX_DROP_OLDEST 1 /* make room by throwing away oldest entries */
+#define MX_BLOCK 2 /* wait for room up to timeout, then refuse it */
+
+#define MX_QUEUE_RX 0 /* bytes from interface, rx ring */
+#define MX_QUEUE_POOL 1 /* received packets */
+#define MX_QUEUE_TX 2 /* packets to send */
+#define MX_QUEUE_NUMBER 3
+
+/* tx classes, strict priority, lower one is sent first */
+#define MX_TX_CONTROL 0 /* DEVICE_MOTOR_CONTROL */
+#define MX_TX_COMMAND 1 /* requests, everything else */
+#define MX_TX_BULK 2 /* DEVICE_PARAM_* */
+#define MX_TX_CLASS_NUMBER 3
+/* frames coalesced into one tx_data() call, bytes bound the time a
+ * higher class waits behind a batch on the wire */
+#define MX_TX_BATCH 16
+#define MX_TX_BATCH_BYTES 256
+
+#define MX_REQUEST_NUMBER 64 /* requests in flight */
+#define MX_NEGOTIATE_TIMEOUT 200 /* ms */
+#define MX_NEGOTIATE_RETRY 2
+
+/* mx_rx_register_flags() */
+#define MX_HANDLER_DEFERRED 0x01 /* callback runs on worker pool */
+#define MX_SUBSCRIBER_QUEUE 32 /* packets queued for a deferred callback */
+#define MX_SUBSCRIBER_BATCH 16 /* packets taken in one go, then worker moves on */
+
+#define MX_SEQ_WINDOW 32 /* sequences behind the newest one kept track of */
+#define MX_STAMP_NUMBER 64 /* mx_rx_data() calls timed, power of two */
 
 /*
  * data structure 
@@ -50,45 +91,318 @@
 struct mx_struct;
 typedef struct mx_struct mx_t;
 typedef gint (*RX_CALLBACK)(packet_t *p, void *arg);
-typedef gint (*TX_DATA)(void *tx_interface, gchar *buffer, guint length);
+/* 'response' NULL: request timed out */
+typedef void (*REQUEST_CALLBACK)(packet_t *request, packet_t *response, void *arg);
+/* write 'iov', return bytes written or -1, an interface never waiting
+ * for room may take fewer and send the rest later (transport_tx_data()) */
+typedef gint (*TX_DATA)(void *tx_interface, const struct iovec *iov, guint count);
+/* packet queued, mx_service() should run */
+typedef void (*TX_WAKE)(void *arg);
+/* link lost, called once by its reader, see mx_link_lost() */
+typedef void (*LINK_LOST)(void *arg);
+
+typedef struct _mx_queue_config_struct {
+	guint length;
+	guint policy; /* MX_DROP_NEWEST, MX_DROP_OLDEST, MX_BLOCK */
+	guint timeout; /* ms, MX_BLOCK */
+} mx_queue_config_t;
+
+/*
+ * queue setup for mx_init(), mx_config_default() gives the defaults.
+ * rx: ring is SPSC, so with MX_DROP_OLDEST rx thread skips backlog
+ *	over half of ring instead, MX_BLOCK blocks mx_rx_data() caller.
+ * pool: subscribers may hold packets, only MX_DROP_NEWEST is possible.
+ * tx: length and policy apply to each tx class, MX_BLOCK blocks
+ *	mx_tx_packet() caller.
+ * without threads MX_BLOCK is taken as MX_DROP_NEWEST.
+ */
+typedef struct _mx_config_struct {
+	mx_queue_config_t rx;
+	mx_queue_config_t pool;
+	mx_queue_config_t tx;
+	gboolean thread; /* FALSE: no rx/tx threads, see mx_service() */
+	guint worker; /* threads for deferred callbacks, 0 for default */
+} mx_config_t;
+
+typedef struct _mx_queue_stats_struct {
+	guint length;
+	guint used;
+	guint high_water; /* most used ever */
+	guint dropped; /* entries (bytes for rx) thrown away */
+	guint blocked; /* times a producer waited for room */
+	guint timeout; /* waits given up */
+} mx_queue_stats_t;
+
+/*
+ * one tx class, latency is from mx_tx_packet() until tx_data() returned
+ */
+typedef struct _mx_tx_stats_struct {
+	guint sent; /* frames */
+	guint error; /* frames tx_data() failed to write */
+	guint64 latency_total; /* us */
+	guint latency_max; /* us */
+} mx_tx_stats_t;
+
+typedef struct _mx_tx_entry_struct {
+	packet_t packet;
+	struct timespec queued; /* CLOCK_MONOTONIC */
+} mx_tx_entry_t;
+
+typedef struct _mx_tx_class_struct {
+	mx_tx_entry_t *entry; /* config.tx.length + 1 */
+	guint process_index; /* zero based */
+	guint present_index; /* zero based */
+	guint used;
+	mx_tx_stats_t stats;
+} mx_tx_class_t;
+
+/*
+ * request waiting for its response. protocol has no request id, so a
+ * response is told by its type and key (channel / param index), same
+ * key requests are answered in order
+ */
+typedef struct _mx_request_struct {
+	gboolean used;
+	guint order; /* issue order */
+	packet_t packet;
+	PACKET_TYPE response;
+	guint key;
+	guint timeout; /* ms per try */
+	guint retry; /* resends left */
+	struct timespec deadline; /* CLOCK_REALTIME */
+	REQUEST_CALLBACK callback;
+	void *arg;
+} mx_request_t;
+
+/*
+ * receive accounting of one packet type, sequence counters work only
+ * when PACKET_MODE_SEQ is negotiated. sequence is 8 bits, so a gap of
+ * more than 127 packets can't be told from reordering.
+ */
+typedef struct _mx_seq_stats_struct {
+	guint received;
+	guint lost; /* skipped sequences not arrived (yet) */
+	guint duplicate;
+	guint reordered; /* arrived after a later sequence */
+	/* tracking state */
+	gboolean valid;
+	guchar top; /* newest sequence */
+	guint32 window; /* bit n set: sequence (top - n) received */
+} mx_seq_stats_t;
+
+/*
+ * received packet, shared by all subscribers of it. a subscriber keeps
+ * it beyond its callback by mx_packet_ref() and gives it back by
+ * mx_packet_unref(), the last reference puts it back to free list.
+ */
+typedef struct _mx_packet_struct {
+	packet_t packet; /* MUST be first */
+	gint ref;
+	mx_t *mx;
+	struct _mx_packet_struct *next; /* free list */
+} mx_packet_t;
 
-typedef struct _RxHandler {
-	PACKET_TYPE type;
+typedef struct _mx_subscriber_stats_struct {
+	guint processed;
+	guint dropped; /* queue was full */
+	guint64 wait_total; /* us, queued until callback */
+	guint wait_max; /* us */
+} mx_subscriber_stats_t;
+
+/*
+ * MX_HANDLER_DEFERRED callback, rx thread queues packets (referenced)
+ * and schedules it on worker pool, it runs on one worker at a time, so
+ * packets come in order. every handler vector holding it and being
+ * scheduled keep a reference.
+ */
+typedef struct _mx_subscriber_struct {
+	pool_task_t task; /* MUST be first */
+	mx_t *mx;
+	RX_CALLBACK callback;
+	void *arg;
+	gint ref;
+	gint scheduled;
+	guint head; /* rx thread */
+	guint tail; /* worker */
+	packet_t *queue[MX_SUBSCRIBER_QUEUE];
+	struct timespec queued[MX_SUBSCRIBER_QUEUE]; /* CLOCK_MONOTONIC */
+	mx_subscriber_stats_t stats;
+} mx_subscriber_t;
+
+/*
+ * arrival of rx ring bytes before 'position', stamped by mx_rx_data().
+ * when rx side is more than MX_STAMP_NUMBER writes behind, writes go
+ * unstamped and their frames take time of a later one
+ */
+typedef struct _mx_stamp_struct {
+	guint position; /* rx ring head after write */
+	struct timespec time; /* CLOCK_MONOTONIC */
+} mx_stamp_t;
+
+/*
+ * counters of rx side (rx thread or event loop), added atomically so they
+ * stay exact if frames get decoded on more than one thread
+ */
+typedef struct _mx_rx_counter_struct {
+	guint frames; /* framed */
+	guint checksum; /* failed checksum / CRC */
+	guint decode[PACKET_TYPE_NUMBER + 1]; /* failed to decode per type, last: unknown type */
+	guint dispatched; /* decoded and handed to subscribers */
+	mx_seq_stats_t seq[PACKET_TYPE_NUMBER]; /* per type, see mx_rx_stats() */
+	guint stamp_tail; /* next mx_stamp_t to take */
+	hist_t latency; /* us, last byte in mx_rx_data() until dispatch */
+} mx_rx_counter_t;
+
+/*
+ * counters of tx side (tx thread or event loop), atomic adds as well
+ */
+typedef struct _mx_tx_counter_struct {
+	guint64 bytes;
+	guint frames;
+	guint error; /* frames tx_data() failed to write */
+	hist_t latency; /* us, mx_tx_packet() until tx_data() returned */
+} mx_tx_counter_t;
+
+/*
+ * snapshot of mx_stats(), counters are summed up from the threads
+ * owning them while they keep running, so they may be a few frames
+ * apart from each other
+ */
+typedef struct _mx_stats_struct {
+	guint64 rx_bytes; /* given to mx_rx_data() */
+	guint rx_frames;
+	guint rx_checksum;
+	guint rx_decode[PACKET_TYPE_NUMBER + 1]; /* see mx_rx_counter_t */
+	guint rx_dispatched;
+	guint rx_overflow; /* frames too long for framer */
+	guint rx_lost; /* sums of mx_seq_stats_t over all types */
+	guint rx_duplicate;
+	guint rx_reordered;
+	guint64 tx_bytes;
+	guint tx_frames;
+	guint tx_error;
+	mx_queue_stats_t queue[MX_QUEUE_NUMBER]; /* MX_QUEUE_* */
+	hist_t rx_latency;
+	hist_t tx_latency;
+} mx_stats_t;
+
+typedef struct _mx_handler_struct {
 	RX_CALLBACK callback;
 	void *arg;
-} RxHandler;
+	mx_subscriber_t *subscriber; /* NULL: called by rx thread */
+} mx_handler_t;
+
+/*
+ * handlers of one packet type, never changed once published, a new
+ * vector replaces it on (un)register, old one is freed by rx thread
+ * when it isn't dispatching
+ */
+typedef struct _mx_handler_vector_struct {
+	struct _mx_handler_vector_struct *next; /* retired list */
+	guint number;
+	mx_handler_t handler[];
+} mx_handler_vector_t;
 
 struct mx_struct {
+	mx_config_t config;
+
 	pthread_t thread_rx;
-	gchar rx_pool[RX_POOL_LENGTH];
-	guint rx_pool_index;
-	packet_t rx_buffer[RX_BUFFER_LENGTH];
-	guint rx_process_index; /* zero based */	
-	guint rx_present_index; /* zero based */	
-	pthread_mutex_t rx_pool_mutex;
-	GSList *rx_callback_list;
+	ring_t rx_ring; /* filled by interface / scanned by rx thread */
+	pthread_mutex_t rx_wait_mutex;
+	pthread_cond_t rx_cond; /* rx ring got bytes */
+	gint rx_sleeping; /* rx thread waits on rx_cond */
+	pthread_cond_t rx_space_cond; /* rx ring got room */
+	gint rx_space_waiting; /* mx_rx_data() waits on rx_space_cond */
+	mx_queue_stats_t rx_queue; /* dropped: skipped by rx thread */
+	packet_framer_t rx_framer;
+	packet_delta_t rx_delta; /* ANALOG_DATA_DELTA stream state */
+	mx_packet_t *rx_pool; /* config.pool.length packets */
+	mx_packet_t *rx_free; /* free list, only rx thread takes from it */
+	packet_t *rx_packet; /* frame being collected */
+	packet_t rx_spare; /* collects frames when pool is used up */
+	mx_queue_stats_t pool_queue; /* dropped: frames, pool used up */
 
 	pthread_t thread_tx;
-	packet_t tx_buffer[TX_BUFFER_LENGTH];
-	guint tx_process_index; /* zero based */	
-	guint tx_present_index; /* zero based */		
+	mx_tx_class_t tx_class[MX_TX_CLASS_NUMBER]; /* with tx_buffer_mutex */
 	pthread_mutex_t tx_buffer_mutex;
+	pthread_cond_t tx_cond; /* tx buffer got packet */
+	pthread_cond_t tx_space_cond; /* tx buffer got room */
+	mx_queue_stats_t tx_queue; /* all classes, with tx_buffer_mutex */
 	void *tx_interface;
 	TX_DATA tx_data;
+	TX_WAKE tx_wake; /* set by event loop when !config.thread */
+	void *tx_wake_arg;
+	gboolean link_lost; /* with atomics */
+	LINK_LOST link_callback; /* set before link is opened */
+	void *link_arg;
 
-	pthread_mutex_t rx_dispatch_mutex;
+	mx_handler_vector_t *rx_handler[PACKET_TYPE_NUMBER];
+	mx_handler_vector_t *rx_retired; /* replaced vectors to be freed */
+	pthread_mutex_t rx_register_mutex; /* serializes (un)register */
+	pool_t worker_pool; /* deferred callbacks, started by first of them */
+	gboolean worker_started;
 	gboolean thread_start;
+
+	guint capability; /* PACKET_MODE_* supported by us */
+	guint tx_mode; /* PACKET_MODE_* negotiated with device */
+	guint rx_overflow;
+	guint rx_overflow_run; /* overflows since last good frame */
+
+	guint rx_error; /* frames failed to decode */
+	/* tx thread */
+	guchar tx_sequence[PACKET_TYPE_NUMBER]; /* next sequence per type */
+	guchar tx_length[PACKET_TYPE_NUMBER]; /* last frame length per type */
+
+	/* mx_rx_data() caller */
+	guint64 rx_bytes MX_ALIGNED;
+	guint rx_stamp_head;
+	mx_stamp_t rx_stamp[MX_STAMP_NUMBER];
+	mx_rx_counter_t rx_counter MX_ALIGNED;
+	mx_tx_counter_t tx_counter MX_ALIGNED;
+
+	pthread_mutex_t request_mutex;
+	mx_request_t request[MX_REQUEST_NUMBER]; /* with request_mutex */
+	guint request_order;
+	guint request_used;
+	guint request_pending[PACKET_TYPE_NUMBER]; /* per response type */
+	gint request_wake; /* with rx_wait_mutex, rx thread recalculates timeout */
+	guint request_retried;
+	guint request_timeout;
 };
 
 /*
  * functions
  */
 
-extern void mx_init(mx_t *m, TX_DATA tx_data, void *arg);
+extern void mx_config_default(mx_config_t *c);
+extern gint mx_init(mx_t *m, TX_DATA tx_data, void *arg, const mx_config_t *config);
 extern void mx_destroy(mx_t *m);
+extern gint mx_service(mx_t *m);
 extern gint mx_rx_data(mx_t *m, gchar *buffer, guint length);
+extern guint mx_rx_reserve(mx_t *m, gchar **buffer);
+extern void mx_rx_commit(mx_t *m, guint length);
 extern gint mx_rx_register(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback, void *arg);
+extern gint mx_rx_register_flags(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback,
+			void *arg, guint flags);
 extern gint mx_rx_unregister(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback);
+extern gint mx_subscriber_stats(mx_t *m, PACKET_TYPE type, RX_CALLBACK callback,
+			mx_subscriber_stats_t *s);
 extern gint mx_tx_packet(mx_t *m, packet_t *p);
+extern gint mx_request(mx_t *m, packet_t *request, guint timeout, guint retry,
+			REQUEST_CALLBACK callback, void *arg);
+extern void mx_request_stats(mx_t *m, guint *pending, guint *retried, guint *timeout);
+extern gint mx_negotiate(mx_t *m, REQUEST_CALLBACK callback, void *arg);
+extern void mx_link_notify(mx_t *m, LINK_LOST callback, void *arg);
+extern void mx_link_lost(mx_t *m);
+extern gboolean mx_link_active(mx_t *m);
+extern gint mx_rx_stats(mx_t *m, PACKET_TYPE type, mx_seq_stats_t *s);
+extern void mx_rx_errors(mx_t *m, guint *error, guint *overflow, guint *dropped,
+			guint *exhausted);
+extern gint mx_queue_stats(mx_t *m, guint queue, mx_queue_stats_t *s);
+extern gint mx_tx_stats(mx_t *m, guint tx_class, mx_tx_stats_t *s);
+extern void mx_stats(mx_t *m, mx_stats_t *s);
+extern void mx_stats_dump(const mx_stats_t *s);
+extern packet_t* mx_packet_ref(packet_t *p);
+extern void mx_packet_unref(packet_t *p);
 
 #endif
@@ -30,111 +30,300 @@
 
 #include <stdio.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "amcc.h"
-#include "mx.h"
 #include "packet.h"
+#include "checksum.h"
 
 #define DEBUG_PACKET 0
 
-static void packet_checksum_add(packet_t *p)
+/*
+ * checksum engine of framing 'mode'
+ */
+static const checksum_t* packet_checksum(unsigned int mode)
 {
-	unsigned int i;
-	unsigned int checksum = 0;
-
-	for(i = 0; i < p->data_length; i++) {
-		checksum += p->data[i];
+	if (mode & PACKET_MODE_CRC32) {
+		return checksum_get(CHECKSUM_CRC32);
+	} else if (mode & (PACKET_MODE_CRC16 | PACKET_MODE_COBS)) {
+		return checksum_get(CHECKSUM_CRC16);
 	}
-	checksum %= 4096;
-	p->data[i++] = '=' + checksum / 64;
-	p->data[i++] = '=' + checksum % 64;
-	p->data[i++] = PACKET_END;
-	p->data_length += 3;
+	return checksum_get(CHECKSUM_SUM);
 }
 
-static int packet_checksum_verify(packet_t *p)
+/*
+ * ASCII frame carries checksum as 6 bits armor chars, MSB first
+ */
+#define PACKET_CHECKSUM_CHARS(ck) (((ck)->width + 5) / 6)
+
+static void packet_checksum_add(packet_t *p, unsigned int mode)
 {
-	unsigned char a, b;
+	const checksum_t *ck = packet_checksum(mode);
 	unsigned int i;
-	unsigned int checksum = 0;
+	unsigned int checksum;
 
-	for(i = 0; i < p->data_length - 3; i++) { // 3 => START_TAG(1B) + checksum(2B)
-		checksum += p->data[i];
+	checksum = ck->update(ck->init, p->data, p->data_length);
+	for (i = PACKET_CHECKSUM_CHARS(ck); i--; ) {
+		p->data[p->data_length++] = '=' + ((checksum >> (i * 6)) & 0x3f);
 	}
-	checksum %= 4096;
-	a = '=' + checksum / 64;
-	b = '=' + checksum % 64;
+	p->data[p->data_length++] = PACKET_END;
+}
 
-	if ((a == p->data[i++]) && (b == p->data[i++])) {
-		return PACKET_SUCCESS;
+/*
+ * payload codec of each type, generated from PACKET_SCHEMA.
+ * 'i' is payload offset, 'r' raw data of packet
+ */
+
+/* size of fixed part */
+#define PACKET_U8(f) + 1
+#define PACKET_U16(f) + 2
+#define PACKET_S16(f) + 2
+#define PACKET_U32(f) + 4
+#define PACKET_S32(f) + 4
+#define PACKET_ARRAY_S16(f, count, max)
+#define PACKET_ARRAY_U16(f, count, max)
+#define PACKET_STRING(f, max) + 1
+#define PACKET_TAIL(f, length, max)
+#define PACKET_CHECK(e)
+#define X(type, raw_t, member, fields) PACKET_SIZE_##type = 0 fields,
+enum {
+	PACKET_SCHEMA(X)
+};
+#undef X
+#undef PACKET_U8
+#undef PACKET_U16
+#undef PACKET_S16
+#undef PACKET_U32
+#undef PACKET_S32
+#undef PACKET_ARRAY_S16
+#undef PACKET_ARRAY_U16
+#undef PACKET_STRING
+#undef PACKET_TAIL
+#undef PACKET_CHECK
+
+/* raw -> payload, at most 'size' bytes */
+#define PACKET_U8(f) d[i++] = r->f;
+#define PACKET_U16(f) d[i++] = r->f; d[i++] = (unsigned short)r->f >> 8;
+#define PACKET_S16(f) PACKET_U16(f)
+#define PACKET_U32(f) d[i++] = r->f; d[i++] = (unsigned int)r->f >> 8; \
+			d[i++] = (unsigned int)r->f >> 16; d[i++] = (unsigned int)r->f >> 24;
+#define PACKET_S32(f) PACKET_U32(f)
+#define PACKET_ARRAY_U16(f, count, max) \
+	n = (count); \
+	if (n > (max) || i + n * 2 > size) \
+		return PACKET_FAIL; \
+	for (k = 0; k < n; k++) { \
+		d[i++] = r->f[k]; \
+		d[i++] = (unsigned short)r->f[k] >> 8; \
 	}
-	return PACKET_FAIL;
+#define PACKET_ARRAY_S16(f, count, max) PACKET_ARRAY_U16(f, count, max)
+#define PACKET_STRING(f, max) \
+	for (n = 0; n < (max) - 1 && r->f[n]; n++); \
+	if (i + 1 + n > size) \
+		return PACKET_FAIL; \
+	d[i++] = n; \
+	memcpy(&d[i], r->f, n); \
+	i += n;
+#define PACKET_TAIL(f, length, max) \
+	n = r->length; \
+	if (n > (max) || i + n > size) \
+		return PACKET_FAIL; \
+	memcpy(&d[i], r->f, n); \
+	i += n;
+#define PACKET_CHECK(e) \
+	if (!(e)) \
+		return PACKET_FAIL;
+#define X(type, raw_t, member, fields) \
+static int packet_pack_##type(packet_t *p, unsigned char *d, unsigned int size, \
+			unsigned int *length) \
+{ \
+	raw_t *r = &p->raw.member; \
+	unsigned int i = 0, k = 0, n = 0; \
+	(void)r; (void)i; (void)k; (void)n; \
+	if (size < PACKET_SIZE_##type) \
+		return PACKET_FAIL; \
+	fields \
+	*length = i; \
+	return PACKET_SUCCESS; \
 }
+PACKET_SCHEMA(X)
+#undef X
+#undef PACKET_U8
+#undef PACKET_U16
+#undef PACKET_S16
+#undef PACKET_U32
+#undef PACKET_S32
+#undef PACKET_ARRAY_S16
+#undef PACKET_ARRAY_U16
+#undef PACKET_STRING
+#undef PACKET_TAIL
+#undef PACKET_CHECK
 
-int packet_encode(packet_t *p)
+/* payload -> raw, fixed part is checked once */
+#define PACKET_U8(f) r->f = d[i++];
+#define PACKET_U16(f) r->f = d[i] | (d[i + 1] << 8); i += 2;
+#define PACKET_S16(f) r->f = (short)(d[i] | (d[i + 1] << 8)); i += 2;
+#define PACKET_U32(f) r->f = d[i] | (d[i + 1] << 8) | (d[i + 2] << 16) | \
+			((unsigned int)d[i + 3] << 24); i += 4;
+#define PACKET_S32(f) PACKET_U32(f)
+#define PACKET_ARRAY_U16(f, count, max) \
+	n = (count); \
+	if (n > (max) || i + n * 2 > length) \
+		return PACKET_FAIL; \
+	for (k = 0; k < n; k++, i += 2) { \
+		r->f[k] = d[i] | (d[i + 1] << 8); \
+	}
+#define PACKET_ARRAY_S16(f, count, max) PACKET_ARRAY_U16(f, count, max)
+#define PACKET_STRING(f, max) \
+	n = d[i++]; \
+	if (n > (max) - 1 || i + n > length) \
+		return PACKET_FAIL; \
+	memcpy(r->f, &d[i], n); \
+	r->f[n] = '\0'; \
+	i += n;
+#define PACKET_TAIL(f, length_member, max) \
+	n = length - i; \
+	for (k = (max); k < n; k++) { \
+		if (k >= (max) + pad || d[i + k]) \
+			return PACKET_FAIL; \
+	} \
+	if (n > (max)) \
+		n = (max); /* zero padding of last ASCII group */ \
+	memcpy(r->f, &d[i], n); \
+	r->length_member = n; \
+	i += n;
+#define PACKET_CHECK(e) \
+	if (!(e)) \
+		return PACKET_FAIL;
+#define X(type, raw_t, member, fields) \
+static int packet_unpack_##type(packet_t *p, const unsigned char *d, unsigned int length, \
+			unsigned int pad) \
+{ \
+	raw_t *r = &p->raw.member; \
+	unsigned int i = 0, k = 0, n = 0; \
+	(void)r; (void)d; (void)i; (void)k; (void)n; (void)pad; \
+	if (length < PACKET_SIZE_##type) \
+		return PACKET_FAIL; \
+	fields \
+	return PACKET_SUCCESS; \
+}
+PACKET_SCHEMA(X)
+#undef X
+#undef PACKET_U8
+#undef PACKET_U16
+#undef PACKET_S16
+#undef PACKET_U32
+#undef PACKET_S32
+#undef PACKET_ARRAY_S16
+#undef PACKET_ARRAY_U16
+#undef PACKET_STRING
+#undef PACKET_TAIL
+#undef PACKET_CHECK
+
+typedef struct _packet_codec_struct {
+	int (*pack)(packet_t *p, unsigned char *d, unsigned int size, unsigned int *length);
+	int (*unpack)(packet_t *p, const unsigned char *d, unsigned int length,
+			unsigned int pad);
+} packet_codec_t;
+
+#define X(type, raw_t, member, fields) { packet_pack_##type, packet_unpack_##type },
+static const packet_codec_t packet_codec[PACKET_TYPE_NUMBER] = {
+	PACKET_SCHEMA(X)
+};
+#undef X
+
+/*
+ * put payload of 'raw' to 'd', PACKET_FAIL if longer than 'size'
+ */
+static int packet_pack(packet_t *p, unsigned char *d, unsigned int size, unsigned int *length)
+{
+	unsigned int index = (unsigned int)p->type - PACKET_TYPE_FIRST;
+
+	if (index >= PACKET_TYPE_NUMBER)
+		return PACKET_FAIL;
+	return packet_codec[index].pack(p, d, size, length);
+}
+
+/*
+ * fill 'raw' according decoded payload 'd', last 'pad' bytes may be
+ * zero padding rather than payload
+ */
+static int packet_unpack(packet_t *p, const unsigned char *d, unsigned int length,
+			unsigned int pad)
 {
-	/*
-	 * encode packet according 'raw'
-	 * make packet data buffer containing all data to be send
-	*/
+	unsigned int index = (unsigned int)p->type - PACKET_TYPE_FIRST;
+
+	if (index >= PACKET_TYPE_NUMBER)
+		return PACKET_FAIL;
+	return packet_codec[index].unpack(p, d, length, pad);
+}
+
+/*
+ * same as packet_unpack(), 'd' begins with sequence in PACKET_MODE_SEQ
+ */
+static int packet_unpack_mode(packet_t *p, const unsigned char *d, unsigned int length,
+			unsigned int mode)
+{
+	p->sequence = 0;
+	if (mode & PACKET_MODE_SEQ) {
+		if (length < 1)
+			return PACKET_FAIL;
+		p->sequence = d[0];
+		d++;
+		length--;
+	}
+	/* ASCII armor pads the last group with up to 2 zero bytes */
+	return packet_unpack(p, d, length, (mode & PACKET_MODE_COBS) ? 0 : 2);
+}
+
+/*
+ * ASCII frame, armored in place: payload is packed right after
+ * START/TYPE, then every 3 bytes group is turned into 4 chars working
+ * backward from the last group, output of a group never reaches input
+ * of the groups before it, so no scratch buffer is needed.
+ * in PACKET_MODE_SEQ p->sequence is armored as first byte of DATA.
+ */
+static int packet_encode_ascii(packet_t *p, unsigned int mode)
+{
+	const checksum_t *ck = packet_checksum(mode);
 	unsigned char a, b, c;
-	unsigned char i, j, k;
-	char buffer[MAX_PACKET_DATA_LENGTH];
+	unsigned int length, groups, in, out, seq;
 
+	seq = (mode & PACKET_MODE_SEQ) ? 1 : 0;
+	if (packet_pack(p, &p->data[2 + seq], MAX_PACKET_DATA_LENGTH - 2 - seq,
+				&length) != PACKET_SUCCESS)
+		return PACKET_FAIL;
+	if (seq)
+		p->data[2] = p->sequence;
+	length += seq;
+	/* START(1) + TYPE(1) + DATA(4*n) + CRC + END(1) */
+	groups = (length + 2) / 3;
+	if (2 + groups * 4 + PACKET_CHECKSUM_CHARS(ck) + 1 > MAX_PACKET_DATA_LENGTH)
+		return PACKET_FAIL;
 	p->data[0] = PACKET_START;
 	p->data[1] = p->type;
-	p->data_length = 2;
-
-	switch (p->type) {
-	case ANALOG_DATA_RESPONSE:
-		p->data[2] = p->raw.analog_data.channel_number;
-		p->data_length ++;
-		for (i = 0; i < p->raw.analog_data.channel_number; i++) {
-			if (i == MAX_CHANNEL) { /* prevent data error */
-				p->raw.analog_data.channel_number = MAX_CHANNEL;
-				break;
-			}
-			memcpy(&p->data[3 + i * 2], &p->raw.analog_data.value[i], 2);
-			p->data_length += 2;
-		}
-	}
+	memset(&p->data[2 + length], 0, groups * 3 - length); /* pad last group */
 
-	i = 2;
-	j = 0;
-	k = p->data_length - i;
-
-	while (k) {
-		if (k) {
-			a = p->data[i++];
-			k--;
-		} else {
-			a = 0;
-		}
-		if (k) {
-			b = p->data[i++];
-			k--;
-		} else {
-			b = 0;
-		}
-		if (k) {
-			c = p->data[i++];
-			k--;
-		} else {
-			c = 0;
-		}
-		buffer[j++] = '=' + (a >> 2);
-		buffer[j++] = '=' + (((a & 0x03) << 4) | ((b & 0xf0) >> 4));
-		buffer[j++] = '=' + (((b & 0x0f) << 2) | ((c & 0xc0) >> 6));
-		buffer[j++] = '=' + ( c & 0x3f);
+	in = 2 + groups * 3;
+	out = 2 + groups * 4;
+	p->data_length = out;
+	while (in > 2) {
+		c = p->data[--in];
+		b = p->data[--in];
+		a = p->data[--in];
+		p->data[--out] = '=' + (c & 0x3f);
+		p->data[--out] = '=' + (((b & 0x0f) << 2) | (c >> 6));
+		p->data[--out] = '=' + (((a & 0x03) << 4) | (b >> 4));
+		p->data[--out] = '=' + (a >> 2);
 	}
-	memcpy(&p->data[2], buffer, j);
-	p->data_length = j + 2; /* 2 (START/TYPE) */
-	packet_checksum_add(p);
+	packet_checksum_add(p, mode);
 
 #if DEBUG_PACKET
 	g_print("[E] ");
-	for (i = 0; i < p->data_length; i++) {
-		g_print("%c", p->data[i]);
+	for (in = 0; in < p->data_length; in++) {
+		g_print("%c", p->data[in]);
 	}
 	g_print("\n");
 #endif
@@ -142,88 +331,631 @@ int packet_encode(packet_t *p)
 	return PACKET_SUCCESS;
 }
 
-int packet_decode(packet_t *p)
+/*
+ * binary frame, COBS stuffed in place:
+ * [code] TYPE DATA CRC(2 or 4, LE) [0x00]
+ * frames are shorter than 254 bytes, so stuffing never grows
+ * more than the leading code byte and no 0xFF split code is needed.
+ */
+typedef char packet_cobs_no_split[(MAX_PACKET_DATA_LENGTH <= 255) ? 1 : -1];
+
+static int packet_encode_cobs(packet_t *p, unsigned int mode)
 {
-	unsigned char i;
-	unsigned char a, b, c, d;
-	unsigned char x, y, z;
-	unsigned char in, out, max;
-	unsigned char buffer[MAX_PACKET_DATA_LENGTH];
-	int ret;
+	const checksum_t *ck = packet_checksum(mode);
+	unsigned int i, code, end, seq;
+	unsigned int crc;
+
+	/* code + TYPE + SEQ + DATA + CRC + delimiter */
+	seq = (mode & PACKET_MODE_SEQ) ? 1 : 0;
+	if (packet_pack(p, &p->data[2 + seq], MAX_PACKET_DATA_LENGTH - 3 - seq - ck->width / 8,
+				&end) != PACKET_SUCCESS)
+		return PACKET_FAIL;
+	p->data[1] = p->type;
+	if (seq)
+		p->data[2] = p->sequence;
+	end += 2 + seq;
+	crc = ck->update(ck->init, &p->data[1], end - 1);
+	for (i = 0; i < ck->width / 8; i++) {
+		p->data[end++] = crc >> (i * 8);
+	}
+
+	code = 0;
+	for (i = 1; i < end; i++) {
+		if (p->data[i] == 0) {
+			p->data[code] = i - code;
+			code = i;
+		}
+	}
+	p->data[code] = end - code;
+	p->data[end++] = PACKET_DELIMITER;
+	p->data_length = end;
+
+	return PACKET_SUCCESS;
+}
+
+int packet_encode(packet_t *p)
+{
+	return packet_encode_ascii(p, PACKET_MODE_ASCII);
+}
+
+int packet_encode_mode(packet_t *p, unsigned int mode)
+{
+	if (mode & PACKET_MODE_COBS) {
+		return packet_encode_cobs(p, mode);
+	}
+	return packet_encode_ascii(p, mode);
+}
 
-	if(PACKET_SUCCESS != packet_checksum_verify(p)) {
+static int packet_stream_ascii(packet_t *p, unsigned int mode, PACKET_WRITE write, void *arg)
+{
+	const checksum_t *ck = packet_checksum(mode);
+	unsigned char out[8]; /* 4 armor chars, or CRC(up to 6) + END */
+	unsigned char a, b, c;
+	unsigned int length, in, i, seq;
+	unsigned int checksum;
+
+	seq = (mode & PACKET_MODE_SEQ) ? 1 : 0;
+	if (packet_pack(p, &p->data[seq], MAX_PACKET_DATA_LENGTH - seq, &length) != PACKET_SUCCESS)
+		return PACKET_FAIL;
+	if (seq)
+		p->data[0] = p->sequence;
+	length += seq;
+	/* START(1) + TYPE(1) + DATA(4*n) + CRC + END(1) */
+	if (2 + (length + 2) / 3 * 4 + PACKET_CHECKSUM_CHARS(ck) + 1 > MAX_PACKET_FRAME_LENGTH)
 		return PACKET_FAIL;
+	out[0] = PACKET_START;
+	out[1] = p->type;
+	checksum = ck->update(ck->init, out, 2);
+	if (write(arg, out, 2) != PACKET_SUCCESS)
+		return PACKET_FAIL;
+	for (in = 0; in < length; ) {
+		a = p->data[in++];
+		b = in < length ? p->data[in++] : 0;
+		c = in < length ? p->data[in++] : 0;
+		out[0] = '=' + (a >> 2);
+		out[1] = '=' + (((a & 0x03) << 4) | (b >> 4));
+		out[2] = '=' + (((b & 0x0f) << 2) | (c >> 6));
+		out[3] = '=' + (c & 0x3f);
+		checksum = ck->update(checksum, out, 4);
+		if (write(arg, out, 4) != PACKET_SUCCESS)
+			return PACKET_FAIL;
+	}
+	length = 0;
+	for (i = PACKET_CHECKSUM_CHARS(ck); i--; ) {
+		out[length++] = '=' + ((checksum >> (i * 6)) & 0x3f);
 	}
+	out[length++] = PACKET_END;
+
+	return write(arg, out, length);
+}
+
+static int packet_stream_cobs(packet_t *p, unsigned int mode, PACKET_WRITE write, void *arg)
+{
+	const checksum_t *ck = packet_checksum(mode);
+	unsigned char code;
+	unsigned int s, n, end, i, seq;
+	unsigned int crc;
 
-	if (p->data_length < 2) {
+	/* TYPE + SEQ + DATA + CRC */
+	seq = (mode & PACKET_MODE_SEQ) ? 1 : 0;
+	if (packet_pack(p, &p->data[1 + seq], MAX_PACKET_DATA_LENGTH - 1 - seq - ck->width / 8,
+				&end) != PACKET_SUCCESS)
 		return PACKET_FAIL;
+	p->data[0] = p->type;
+	if (seq)
+		p->data[1] = p->sequence;
+	end += 1 + seq;
+	crc = ck->update(ck->init, p->data, end);
+	for (i = 0; i < ck->width / 8; i++) {
+		p->data[end++] = crc >> (i * 8);
 	}
+
+	/* each block is its code followed by the non-zero run it covers */
+	s = 0;
+	for (;;) {
+		for (n = 0; s + n < end && p->data[s + n] && n < 0xfe; n++);
+		code = n + 1;
+		if (write(arg, &code, 1) != PACKET_SUCCESS ||
+				(n && write(arg, &p->data[s], n) != PACKET_SUCCESS))
+			return PACKET_FAIL;
+		s += n;
+		if (s >= end)
+			break;
+		if (code != 0xff)
+			s++; /* zero replaced by code */
+	}
+	code = PACKET_DELIMITER;
+
+	return write(arg, &code, 1);
+}
+
+/*
+ * encode 'p' straight into 'write' (eg: UART driver) without building
+ * the frame, p->data only holds the packed payload, so on a small MCU
+ * MAX_PACKET_DATA_LENGTH may be cut to TYPE + largest payload + CRC.
+ */
+int packet_encode_stream(packet_t *p, unsigned int mode, PACKET_WRITE write, void *arg)
+{
+	if (mode & PACKET_MODE_COBS) {
+		return packet_stream_cobs(p, mode, write, arg);
+	}
+	return packet_stream_ascii(p, mode, write, arg);
+}
+
+/*
+ * find next PACKET_START or PACKET_END in [s, end), NULL if none
+ */
+static const unsigned char* packet_scan(const unsigned char *s, const unsigned char *end)
+{
+#if defined(__SSE2__)
+	const __m128i start = _mm_set1_epi8(PACKET_START);
+	const __m128i stop = _mm_set1_epi8(PACKET_END);
+	__m128i v;
+	int mask;
+
+	while (end - s >= 16) {
+		v = _mm_loadu_si128((const __m128i*)s);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, start),
+						      _mm_cmpeq_epi8(v, stop)));
+		if (mask)
+			return s + __builtin_ctz(mask);
+		s += 16;
+	}
+#endif
+	for (; s < end; s++) {
+		if (*s == PACKET_START || *s == PACKET_END)
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * decode 'frame' (START ... END) into p->data, each 4 armor chars are
+ * turned into 3 bytes at once. legacy sum checksum is verified in the
+ * same pass, CRC runs over the frame first.
+ * 'frame' may be p->data itself, output never overtakes input.
+ */
+static int packet_unarmor(packet_t *p, const unsigned char *frame, unsigned int length,
+			unsigned int mode)
+{
+	const checksum_t *ck = packet_checksum(mode);
+	unsigned int in, out, groups, chars, i;
+	unsigned int a, b, c, d, bad;
+	unsigned int word;
+	unsigned int checksum, sum;
+
+	/* START(1) + TYPE(1) + DATA(4*n) + CRC + END(1) */
+	chars = PACKET_CHECKSUM_CHARS(ck);
+	if (length < 3 + chars || length > MAX_PACKET_DATA_LENGTH || (length - 3 - chars) % 4)
+		return PACKET_FAIL;
+	if (frame[0] != PACKET_START || frame[length - 1] != PACKET_END)
+		return PACKET_FAIL;
+
+	sum = (ck->update == checksum_sum);
+	if (sum) {
+		checksum = frame[0] + frame[1];
+	} else {
+		checksum = ck->update(ck->init, frame, length - 1 - chars);
+	}
+	p->type = frame[1];
+	bad = 0;
+	in = 2;
+	out = 0;
+	for (groups = (length - 3 - chars) / 4; groups; groups--) {
+		a = frame[in++];
+		b = frame[in++];
+		c = frame[in++];
+		d = frame[in++];
+		if (sum)
+			checksum += a + b + c + d;
+		a -= '=';
+		b -= '=';
+		c -= '=';
+		d -= '=';
+		bad |= a | b | c | d; /* armor char out of range sets high bits */
+		word = (a << 18) | (b << 12) | (c << 6) | d;
+		p->data[out++] = word >> 16;
+		p->data[out++] = word >> 8;
+		p->data[out++] = word;
+	}
+	p->data_length = out;
+
+	if (bad & ~0x3fu)
+		return PACKET_FAIL;
+	if (sum)
+		checksum %= 4096;
+	for (i = chars; i--; in++) {
+		if (frame[in] != '=' + ((checksum >> (i * 6)) & 0x3f))
+			return PACKET_FAIL_CHECKSUM;
+	}
+
+	return PACKET_SUCCESS;
+}
+
+static int packet_decode_ascii(packet_t *p, unsigned int mode)
+{
+	int ret;
 #if DEBUG_PACKET
+	unsigned int i;
+
 	g_print("[D] ");
 	for (i = 0; i < p->data_length; i++) {
 		g_print("%c", p->data[i]);
 	}
 #endif
-	p->type = p->data[1]; /* begin with PACKET_START */
+	ret = packet_unarmor(p, p->data, p->data_length, mode);
+	if (ret != PACKET_SUCCESS) {
+		return ret;
+	}
+	return packet_unpack_mode(p, p->data, p->data_length, mode);
+}
 
-	in = 2;
-	out = 0;
-	max = p->data_length;
+int packet_decode(packet_t *p)
+{
+	return packet_decode_ascii(p, PACKET_MODE_ASCII);
+}
 
-	while (p->data_length)
-	{
-		a = p->data[in++] - '=';
-		b = p->data[in++] - '=';
-		c = p->data[in++] - '=';
-		d = p->data[in++] - '=';
+/*
+ * p->data holds a binary frame without delimiter, unstuffed in place
+ */
+static int packet_decode_cobs(packet_t *p, unsigned int mode)
+{
+	const checksum_t *ck = packet_checksum(mode);
+	unsigned int in, out, code, n, length, bytes, i;
+	unsigned int crc;
 
-		/* CRC space check*/
-		if(in > max - 3)
-			break;
+	bytes = ck->width / 8;
+	length = p->data_length;
+	if (length < 2 + bytes || length > MAX_PACKET_DATA_LENGTH) /* code + TYPE + CRC */
+		return PACKET_FAIL;
+
+	in = out = 0;
+	while (in < length) {
+		code = n = p->data[in++];
+		if (code == 0 || in + code - 1 > length)
+			return PACKET_FAIL;
+		while (--n) {
+			p->data[out++] = p->data[in++];
+		}
+		if (code != 0xff && in < length) {
+			p->data[out++] = 0;
+		}
+	}
+	if (out < 1 + bytes)
+		return PACKET_FAIL;
 
-		x = (a << 2) | (b >> 4);
-		y = ((b & 0x0f) << 4) | (c >> 2);
-		z = ((c & 0x03) << 6) | d;
+	out -= bytes;
+	crc = ck->update(ck->init, p->data, out);
+	for (i = 0; i < bytes; i++) {
+		if (p->data[out + i] != ((crc >> (i * 8)) & 0xff))
+			return PACKET_FAIL_CHECKSUM;
+	}
 
-		if(p->data_length--) {
-			buffer[out++] = x; 
-		} else { 
+	p->type = p->data[0];
+	p->data_length = out - 1;
+	return packet_unpack_mode(p, &p->data[1], p->data_length, mode);
+}
+
+int packet_decode_mode(packet_t *p, unsigned int mode)
+{
+	if (mode & PACKET_MODE_COBS) {
+		return packet_decode_cobs(p, mode);
+	}
+	return packet_decode_ascii(p, mode);
+}
+
+/*
+ * decode every complete ASCII frame found in 'buffer' into p[0] ... p[count - 1].
+ * frames are decoded straight from 'buffer', bad frames are skipped.
+ * return number of decoded packets, 'used' tells how many bytes of
+ * 'buffer' have been consumed, an unfinished frame at the end is left
+ * for next call.
+ */
+unsigned int packet_decode_batch(const unsigned char *buffer, unsigned int length,
+			packet_t *p, unsigned int count, unsigned int *used, unsigned int mode)
+{
+	const unsigned char *s, *e, *end;
+	unsigned int n = 0;
+
+	s = buffer;
+	end = buffer + length;
+	while (n < count) {
+		s = memchr(s, PACKET_START, end - s);
+		if (s == NULL) {
+			s = end;
 			break;
 		}
-		if(p->data_length--) {
-			buffer[out++] = y; 
-		} else {
-			break;
+		e = packet_scan(s + 1, end);
+		if (e == NULL)
+			break; /* unfinished frame */
+		if (*e == PACKET_START) {
+			s = e; /* resync */
+			continue;
 		}
-		if(p->data_length--) {
-			buffer[out++] = z; 
-		} else {
-			break;
+		if (packet_unarmor(&p[n], s, e - s + 1, mode) == PACKET_SUCCESS &&
+				packet_unpack_mode(&p[n], p[n].data, p[n].data_length,
+					mode) == PACKET_SUCCESS) {
+			n++;
 		}
+		s = e + 1;
 	}
-	memcpy(p->data, buffer, out);
-	p->data_length = out;
+	*used = s - buffer;
 
-	switch (p->type) {
-	case ANALOG_DATA_RESPONSE:
-		p->raw.analog_data.channel_number = *(unsigned char*)&p->data[0];
-		for (i = 0; i < p->raw.analog_data.channel_number; i++) {
-			if (i == MAX_CHANNEL) { /* prevent data error */
-				p->raw.analog_data.channel_number = MAX_CHANNEL;
-				break;
-			}
-			p->raw.analog_data.value[i] = *(unsigned short*)&p->data[1 + i * 2];
+	return n;
+}
+
+/*
+ * get sample 'index' of an ANALOG_DATA_BATCH packet as analog data
+ */
+int packet_batch_sample(const packet_t *p, unsigned int index, analog_data_t *a)
+{
+	const analog_batch_t *b = &p->raw.analog_batch;
+
+	if (p->type != ANALOG_DATA_BATCH || index >= b->sample_number ||
+			b->channel_number == 0 || b->channel_number > MAX_CHANNEL)
+		return PACKET_FAIL;
+	a->channel_number = b->channel_number;
+	memcpy(a->value, &b->value[index * b->channel_number],
+				b->channel_number * sizeof(short));
+
+	return PACKET_SUCCESS;
+}
+
+void packet_delta_init(packet_delta_t *s, unsigned int interval)
+{
+	memset(s, 0, sizeof(packet_delta_t));
+	s->interval = interval ? interval : 1;
+}
+
+/*
+ * compress batch 'b' into ANALOG_DATA_DELTA packet 'p', 'b' may be
+ * p->raw.analog_batch. PACKET_FAIL if it doesn't fit, send 'b' as
+ * ANALOG_DATA_BATCH instead, next delta packet will be a keyframe.
+ */
+int packet_delta_encode(packet_delta_t *s, const analog_batch_t *b, packet_t *p)
+{
+	unsigned int i, n, length;
+	unsigned short zz;
+	short last[MAX_CHANNEL];
+	short delta;
+	unsigned char data[MAX_DELTA_DATA];
+	unsigned char keyframe;
+	analog_delta_t *d;
+
+	n = b->channel_number * b->sample_number;
+	if (b->channel_number > MAX_CHANNEL || n > MAX_BATCH_VALUE)
+		return PACKET_FAIL;
+
+	keyframe = (s->countdown == 0);
+	if (keyframe) {
+		memset(last, 0, sizeof(last));
+	} else {
+		memcpy(last, s->last, sizeof(last));
+	}
+	length = 0;
+	for (i = 0; i < n; i++) {
+		delta = b->value[i] - last[i % b->channel_number];
+		last[i % b->channel_number] = b->value[i];
+		zz = ((unsigned short)delta << 1) ^ (unsigned short)(delta >> 15);
+		while (zz >= 0x80) {
+			if (length >= MAX_DELTA_DATA - 1)
+				goto overflow;
+			data[length++] = zz | 0x80;
+			zz >>= 7;
 		}
-#if DEBUG_PACKET
-	g_print("\t");
-	for (i = 0; i < p->data_length; i++) {
-		g_print("%d,", p->data[i]);
+		if (length >= MAX_DELTA_DATA)
+			goto overflow;
+		data[length++] = zz;
 	}
-	g_print("\n");
-#endif
-		break;
-	default:
-		return PACKET_FAIL;
+
+	d = &p->raw.analog_delta;
+	d->timestamp = b->timestamp;
+	d->period = b->period;
+	d->channel_number = b->channel_number;
+	d->sample_number = b->sample_number;
+	d->sequence = s->sequence++;
+	d->flags = keyframe ? DELTA_KEYFRAME : 0;
+	d->length = length;
+	memcpy(d->data, data, length);
+	p->type = ANALOG_DATA_DELTA;
+
+	memcpy(s->last, last, sizeof(last));
+	s->countdown = (keyframe ? s->interval : s->countdown) - 1;
+	s->raw_bytes += 8 + n * 2;
+	s->coded_bytes += 10 + length;
+
+	return PACKET_SUCCESS;
+overflow:
+	s->countdown = 0;
+	return PACKET_FAIL;
+}
+
+/*
+ * expand ANALOG_DATA_DELTA packet 'p' into ANALOG_DATA_BATCH in place.
+ * PACKET_FAIL if packet is corrupted or a packet before it is lost,
+ * decoding resumes at next keyframe.
+ */
+int packet_delta_decode(packet_delta_t *s, packet_t *p)
+{
+	unsigned int i, n, in, shift;
+	unsigned short zz;
+	short last[MAX_CHANNEL];
+	short value[MAX_BATCH_VALUE];
+	analog_delta_t *d = &p->raw.analog_delta;
+	analog_batch_t *b = &p->raw.analog_batch;
+	unsigned int timestamp;
+	unsigned short period;
+	unsigned char channel_number, sample_number;
+
+	n = d->channel_number * d->sample_number;
+	if (d->channel_number > MAX_CHANNEL || n > MAX_BATCH_VALUE)
+		goto error;
+	if (d->flags & DELTA_KEYFRAME) {
+		memset(last, 0, sizeof(last));
+	} else if (s->valid && d->sequence == s->sequence) {
+		memcpy(last, s->last, sizeof(last));
+	} else {
+		goto error; /* chain broken, wait for keyframe */
+	}
+
+	in = 0;
+	for (i = 0; i < n; i++) {
+		zz = 0;
+		shift = 0;
+		do {
+			if (in >= d->length || shift > 14)
+				goto error;
+			zz |= (d->data[in] & 0x7f) << shift;
+			shift += 7;
+		} while (d->data[in++] & 0x80);
+		last[i % d->channel_number] += (short)((zz >> 1) ^ -(zz & 1));
+		value[i] = last[i % d->channel_number];
 	}
+
+	memcpy(s->last, last, sizeof(last));
+	s->valid = 1;
+	s->sequence = d->sequence + 1;
+	s->raw_bytes += 8 + n * 2;
+	s->coded_bytes += 10 + in;
+
+	/* raw.analog_delta and raw.analog_batch share memory */
+	timestamp = d->timestamp;
+	period = d->period;
+	channel_number = d->channel_number;
+	sample_number = d->sample_number;
+	p->type = ANALOG_DATA_BATCH;
+	b->timestamp = timestamp;
+	b->period = period;
+	b->channel_number = channel_number;
+	b->sample_number = sample_number;
+	memcpy(b->value, value, n * sizeof(short));
+
 	return PACKET_SUCCESS;
+error:
+	s->valid = 0;
+	return PACKET_FAIL;
+}
+
+void packet_framer_init(packet_framer_t *f)
+{
+	f->state = PACKET_FRAMER_HUNT;
+	f->mode = PACKET_MODE_ASCII;
+	f->length = 0;
+	f->overflow = 0;
+}
+
+/*
+ * switch framing mode, MUST be called on a frame boundary (eg: right
+ * after the frame which negotiated the mode), since a binary frame
+ * has no start tag, next byte is taken as beginning of a frame.
+ */
+void packet_framer_mode(packet_framer_t *f, unsigned int mode)
+{
+	f->mode = mode;
+	f->length = 0;
+	f->state = (mode & PACKET_MODE_COBS) ? PACKET_FRAMER_BODY : PACKET_FRAMER_HUNT;
+}
+
+static int packet_framer_feed_cobs(packet_framer_t *f, packet_t *p,
+			const unsigned char *buffer, unsigned int length, unsigned int *used)
+{
+	const unsigned char *s, *d, *end;
+	unsigned int n;
+
+	s = buffer;
+	end = buffer + length;
+	while (s < end) {
+		if (f->state != PACKET_FRAMER_BODY) {
+			/* lost sync, frame begins after next delimiter */
+			s = memchr(s, PACKET_DELIMITER, end - s);
+			if (s == NULL)
+				break;
+			f->length = 0;
+			f->state = PACKET_FRAMER_BODY;
+			s++;
+			continue;
+		}
+		d = memchr(s, PACKET_DELIMITER, end - s);
+		n = (d ? d : end) - s;
+		if (f->length + n > MAX_PACKET_DATA_LENGTH) {
+			f->overflow++;
+			f->state = PACKET_FRAMER_HUNT;
+			s = d ? d : end;
+			continue;
+		}
+		memcpy(p->data + f->length, s, n);
+		f->length += n;
+		s += n;
+		if (d == NULL)
+			break;
+		s++;
+		if (f->length == 0)
+			continue; /* back-to-back delimiters */
+		p->data_length = f->length;
+		f->length = 0;
+		*used = s - buffer;
+		return PACKET_SUCCESS;
+	}
+	*used = length;
+
+	return PACKET_FAIL;
+}
+
+/*
+ * scan 'buffer' for a complete frame, frame bytes are collected in p->data,
+ * so p MUST be the same packet between calls until a frame is completed.
+ * return PACKET_SUCCESS if p holds a complete frame, 'used' tells how many
+ * bytes of 'buffer' have been consumed
+ */
+int packet_framer_feed(packet_framer_t *f, packet_t *p,
+			const unsigned char *buffer, unsigned int length, unsigned int *used)
+{
+	const unsigned char *s, *d, *end;
+	unsigned int n;
+
+	if (f->mode & PACKET_MODE_COBS) {
+		return packet_framer_feed_cobs(f, p, buffer, length, used);
+	}
+	s = buffer;
+	end = buffer + length;
+	while (s < end) {
+		if (f->state != PACKET_FRAMER_BODY) {
+			/* skip garbage between frames */
+			s = memchr(s, PACKET_START, end - s);
+			if (s == NULL)
+				break;
+			p->data[0] = PACKET_START;
+			f->length = 1;
+			f->state = PACKET_FRAMER_BODY;
+			s++;
+			continue;
+		}
+		d = packet_scan(s, end);
+		n = (d ? d : end) - s;
+		if (f->length + n + 1 > MAX_PACKET_DATA_LENGTH) {
+			/* too long to be a frame, hunt for next START */
+			f->overflow++;
+			f->state = PACKET_FRAMER_HUNT;
+			s = d ? d : end;
+			continue;
+		}
+		memcpy(p->data + f->length, s, n);
+		f->length += n;
+		s += n;
+		if (d == NULL)
+			break;
+		if (*d == PACKET_START) {
+			/* always resync on START, drop partial frame */
+			f->state = PACKET_FRAMER_HUNT;
+			continue;
+		}
+		p->data[f->length++] = PACKET_END;
+		p->data_length = f->length;
+		f->state = PACKET_FRAMER_HUNT;
+		*used = d + 1 - buffer;
+		return PACKET_SUCCESS;
+	}
+	*used = length;
+
+	return PACKET_FAIL;
 }
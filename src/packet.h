@@ -31,18 +31,46 @@
 #ifndef PACKET_H_
 #define PACKET_H_
 
-#define MAX_PACKET_DATA_LENGTH 200
+/* longest frame on the wire */
+#define MAX_PACKET_FRAME_LENGTH 200
+/* packet_t buffer, MCU build may define a smaller one, see packet_encode_stream() */
+#ifndef MAX_PACKET_DATA_LENGTH
+#define MAX_PACKET_DATA_LENGTH MAX_PACKET_FRAME_LENGTH
+#endif
 
 struct packet_struct;
 typedef struct packet_struct packet_t;
 
 #define PACKET_SUCCESS 0
 #define PACKET_FAIL 1
+#define PACKET_FAIL_CHECKSUM 2 /* decode: frame intact, checksum / CRC wrong */
 
 #define PACKET_START '('
 #define PACKET_END ')'
+#define PACKET_DELIMITER 0x00 /* end of binary frame */
+
+/*
+ * framing mode, also used as capability bits in DEVICE_INFO_*,
+ * both sides use the common mode after DEVICE_INFO_RESPONSE
+ */
+#define PACKET_MODE_ASCII 0x00 /* '=' armor and sum checksum, always supported */
+#define PACKET_MODE_COBS 0x01 /* COBS stuffed binary and CRC-16 */
+#define PACKET_MODE_CRC16 0x02 /* CRC-16 instead of sum checksum in ASCII frame */
+#define PACKET_MODE_CRC32 0x04 /* CRC-32C instead of CRC-16/sum checksum */
+#define PACKET_MODE_SEQ 0x08 /* sequence byte leads DATA */
 
 #define MAX_CHANNEL 20
+#define MAX_BATCH_VALUE 64 /* channel_number * sample_number in one batch */
+/*
+ * varint bytes in one ANALOG_DATA_DELTA, largest frame must fit
+ * MAX_PACKET_FRAME_LENGTH in every mode, ASCII + CRC32 + SEQ is worst:
+ * 2 + (1 + 10 + 130 + 2) / 3 * 4 + 6 + 1 = 197
+ */
+#define MAX_DELTA_DATA 130
+#define MAX_ANALOG_NAME_LENGTH 16
+#define MAX_MOTOR 8
+#define DELTA_KEYFRAME 0x01
+#define DEFAULT_KEYFRAME_INTERVAL 16
 
 #define ACCX_CHANNEL 0
 #define ACCY_CHANNEL 1
@@ -52,29 +80,104 @@ typedef struct packet_struct packet_t;
 #define GYROZ_CHANNEL 5
 
 
+/*
+ * Packet schema, payload layout of every packet type:
+ * X(TYPE, raw data type, member of 'raw', fields)
+ *
+ * fields are packed in order, multi-byte values are little endian:
+ * PACKET_U8/U16/S16/U32/S32(member)
+ * PACKET_ARRAY_S16/U16(member, count, max) 'count' values, count is an
+ *	expression of previous fields of 'r' (raw data of the packet)
+ * PACKET_STRING(member, max) length byte + chars
+ * PACKET_TAIL(member, length member, max) rest of payload as bytes,
+ *	packet is refused if more than max are left, apart from the zero
+ *	padding of an ASCII frame
+ * PACKET_CHECK(expression) no data, packet is refused unless expression
+ *	of previous fields of 'r' holds
+ *
+ * Types are numbered in schema order from 'A', ONLY append new types.
+ */
+#define PACKET_SCHEMA(X) \
+	X(ANALOG_NAME_REQUEST, analog_name_t, analog_name, \
+		PACKET_U8(channel)) \
+	X(ANALOG_NAME_RESPONSE, analog_name_t, analog_name, \
+		PACKET_U8(channel) \
+		PACKET_STRING(name, MAX_ANALOG_NAME_LENGTH)) \
+	X(ANALOG_DATA_REQUEST, analog_data_t, analog_data, ) \
+	X(ANALOG_DATA_RESPONSE, analog_data_t, analog_data, \
+		PACKET_U8(channel_number) \
+		PACKET_ARRAY_S16(value, r->channel_number, MAX_CHANNEL)) \
+	X(DEVICE_INFO_REQUEST, dev_info_t, device_info, \
+		PACKET_U8(board) \
+		PACKET_U8(firmware) \
+		PACKET_U8(capability)) \
+	X(DEVICE_INFO_RESPONSE, dev_info_t, device_info, \
+		PACKET_U8(board) \
+		PACKET_U8(firmware) \
+		PACKET_U8(capability)) \
+	X(DEVICE_MOTOR_CONTROL, motor_control_t, motor_control, \
+		PACKET_U8(motor_number) \
+		PACKET_ARRAY_U16(value, r->motor_number, MAX_MOTOR)) \
+	X(DEVICE_PARAM_REQUEST, device_param_t, device_param, \
+		PACKET_U8(index)) \
+	X(DEVICE_PARAM_RESPONSE, device_param_t, device_param, \
+		PACKET_U8(index) \
+		PACKET_S32(value)) \
+	X(DEVICE_PARAM_SAVE, device_param_t, device_param, ) \
+	X(ANALOG_DATA_BATCH, analog_batch_t, analog_batch, \
+		PACKET_U8(channel_number) \
+		PACKET_U8(sample_number) \
+		PACKET_U32(timestamp) \
+		PACKET_U16(period) \
+		PACKET_CHECK(r->channel_number <= MAX_CHANNEL) \
+		PACKET_ARRAY_S16(value, r->channel_number * r->sample_number, MAX_BATCH_VALUE)) \
+	X(ANALOG_DATA_DELTA, analog_delta_t, analog_delta, \
+		PACKET_U8(channel_number) \
+		PACKET_U8(sample_number) \
+		PACKET_U8(sequence) \
+		PACKET_U8(flags) \
+		PACKET_U32(timestamp) \
+		PACKET_U16(period) \
+		PACKET_CHECK(r->channel_number <= MAX_CHANNEL) \
+		PACKET_TAIL(data, length, MAX_DELTA_DATA)) \
+	X(DEVICE_PARAM_SET, device_param_t, device_param, \
+		PACKET_U8(index) \
+		PACKET_S32(value))
+
+#define PACKET_TYPE_ENUM(type, raw_t, member, fields) type,
+
 typedef enum _PACKET_SUB_TYPE {
-	ANALOG_NAME_REQUEST = 'A',
-	ANALOG_NAME_RESPONSE,
-	ANALOG_DATA_REQUEST,
-	ANALOG_DATA_RESPONSE,
-	DEVICE_INFO_REQUEST,
-	DEVICE_INFO_RESPONSE,
-	DEVICE_MOTOR_CONTROL,
-	DEVICE_PARAM_REQUEST,
-	DEVICE_PARAM_RESPONSE,
-	DEVICE_PARAM_SAVE,
+	PACKET_TYPE_BASE = 'A' - 1,
+	PACKET_SCHEMA(PACKET_TYPE_ENUM)
+	PACKET_TYPE_END
 } PACKET_TYPE;
 
+#define PACKET_TYPE_FIRST ANALOG_NAME_REQUEST
+#define PACKET_TYPE_NUMBER (PACKET_TYPE_END - PACKET_TYPE_FIRST)
+
 /* Packet format 
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 | START | TYPE | DATA | CRC | END |
 |  (1)  | (1)  | (4*n)| (2) | (1) |
 +-+-+-+-++-+-+-+-+-+-+-+-+-+-+-+-+-
+ CRC is 3 chars with PACKET_MODE_CRC16, 6 chars with PACKET_MODE_CRC32
+ With PACKET_MODE_SEQ first byte of DATA (before armor) is sequence,
+ counted by sender per TYPE, wraps at 256.
+*/
+
+/* Binary packet format (PACKET_MODE_COBS)
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+| CODE | TYPE | DATA | CRC16 | DELIMITER |
+| (1)  | (1)  | (n)  |  (2)  |    (1)    |
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ CODE ... CRC16 is COBS stuffed, so DELIMITER (0x00) appears only once
+ CRC16 is replaced by 4 bytes CRC-32C with PACKET_MODE_CRC32
+ With PACKET_MODE_SEQ a sequence byte goes between TYPE and DATA
 */
 
 /*
- * Be careful to modify following data structure,
- * cause they will let packet encode/decode error
+ * Raw data of packets, wire layout is described by PACKET_SCHEMA,
+ * so members may be reordered/padded freely.
  *
  * Please don't COPY following to/from packet data buffer, for
  * alignment issue.
@@ -82,7 +185,7 @@ typedef enum _PACKET_SUB_TYPE {
 
 typedef struct _analog_name_struct {
 	unsigned char channel;
-	char *name;
+	char name[MAX_ANALOG_NAME_LENGTH]; /* NUL terminated */
 } analog_name_t;
 
 typedef struct _analog_data_struct {
@@ -90,23 +193,115 @@ typedef struct _analog_data_struct {
 	short value[MAX_CHANNEL];
 } analog_data_t;
 
+/*
+ * N consecutive samples, sample i of channel c is
+ * value[i * channel_number + c]
+ */
+typedef struct _analog_batch_struct {
+	unsigned char channel_number;
+	unsigned char sample_number;
+	unsigned int timestamp; /* device time of first sample (us) */
+	unsigned short period; /* time between two samples (us) */
+	short value[MAX_BATCH_VALUE];
+} analog_batch_t;
+
+/*
+ * compressed ANALOG_DATA_BATCH, each value is a zigzag varint of its
+ * difference to the previous sample of same channel. first sample of
+ * a keyframe is coded against zero, otherwise against the last sample
+ * of previous packet, so a lost packet breaks the chain until next
+ * keyframe.
+ */
+typedef struct _analog_delta_struct {
+	unsigned char channel_number;
+	unsigned char sample_number;
+	unsigned char sequence;
+	unsigned char flags; /* DELTA_KEYFRAME */
+	unsigned int timestamp;
+	unsigned short period;
+	unsigned char length; /* bytes used in data */
+	unsigned char data[MAX_DELTA_DATA];
+} analog_delta_t;
+
 typedef struct dev_info_struct {
 	unsigned char board;
 	unsigned char firmware;
+	unsigned char capability; /* PACKET_MODE_* bits */
 } dev_info_t;
 
+typedef struct _motor_control_struct {
+	unsigned char motor_number;
+	unsigned short value[MAX_MOTOR];
+} motor_control_t;
+
+typedef struct _device_param_struct {
+	unsigned char index;
+	int value;
+} device_param_t;
+
 struct packet_struct {
 	PACKET_TYPE type;
+	unsigned char sequence; /* PACKET_MODE_SEQ only, 0 otherwise */
 	union {
 		analog_name_t analog_name;
 		analog_data_t analog_data;
+		analog_batch_t analog_batch;
+		analog_delta_t analog_delta;
 		dev_info_t device_info;
+		motor_control_t motor_control;
+		device_param_t device_param;
 	} raw;
 	unsigned char data[MAX_PACKET_DATA_LENGTH];
 	unsigned int data_length;
 };
 
+/*
+ * Resumable frame scanner for received byte stream.
+ * It keeps its position between calls, so every byte is examined
+ * only once, and bytes of a frame are stored straight into the
+ * packet that will be decoded.
+ */
+
+#define PACKET_FRAMER_HUNT 0 /* waiting for PACKET_START */
+#define PACKET_FRAMER_BODY 1 /* collecting frame until PACKET_END */
+
+typedef struct _packet_framer_struct {
+	unsigned char state;
+	unsigned char mode;
+	unsigned int length;
+	unsigned int overflow; /* frames dropped for being too long */
+} packet_framer_t;
+
+/*
+ * delta coder state, one for each sample stream on each side
+ */
+typedef struct _packet_delta_struct {
+	unsigned char sequence; /* next sequence to send / expected */
+	unsigned char valid; /* decoder: last[] matches sender */
+	unsigned char interval; /* encoder: packets between keyframes */
+	unsigned char countdown; /* encoder: packets before next keyframe */
+	short last[MAX_CHANNEL];
+	unsigned int raw_bytes; /* payload bytes as ANALOG_DATA_BATCH */
+	unsigned int coded_bytes; /* payload bytes as ANALOG_DATA_DELTA */
+} packet_delta_t;
+
+/* frame output of packet_encode_stream(), PACKET_SUCCESS or PACKET_FAIL */
+typedef int (*PACKET_WRITE)(void *arg, const unsigned char *buffer, unsigned int length);
+
 extern int packet_encode(packet_t *p);
 extern int packet_decode(packet_t *p);
+extern int packet_encode_mode(packet_t *p, unsigned int mode);
+extern int packet_decode_mode(packet_t *p, unsigned int mode);
+extern int packet_encode_stream(packet_t *p, unsigned int mode, PACKET_WRITE write, void *arg);
+extern unsigned int packet_decode_batch(const unsigned char *buffer, unsigned int length,
+			packet_t *p, unsigned int count, unsigned int *used, unsigned int mode);
+extern int packet_batch_sample(const packet_t *p, unsigned int index, analog_data_t *a);
+extern void packet_delta_init(packet_delta_t *s, unsigned int interval);
+extern int packet_delta_encode(packet_delta_t *s, const analog_batch_t *b, packet_t *p);
+extern int packet_delta_decode(packet_delta_t *s, packet_t *p);
+extern void packet_framer_init(packet_framer_t *f);
+extern void packet_framer_mode(packet_framer_t *f, unsigned int mode);
+extern int packet_framer_feed(packet_framer_t *f, packet_t *p,
+			const unsigned char *buffer, unsigned int length, unsigned int *used);
 
 #endif
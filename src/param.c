@@ -0,0 +1,233 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <string.h>
+
+#include "param.h"
+
+static void param_answer(packet_t *request, packet_t *response, void *arg);
+
+/*
+ * with t->mutex: next index to send, -1 if none is left
+ */
+static gint param_next(param_table_t *t)
+{
+	while (t->next < t->number) {
+		if (t->request == DEVICE_PARAM_REQUEST || (t->flag[t->next] & PARAM_DIRTY))
+			return t->next++;
+		t->next++;
+	}
+
+	return -1;
+}
+
+/*
+ * with t->mutex: fill window, TRUE when transfer is over
+ */
+static gboolean param_pump(param_table_t *t)
+{
+	packet_t p;
+	gint index;
+
+	while (t->pending < PARAM_WINDOW && (index = param_next(t)) >= 0) {
+		p.type = t->request;
+		p.raw.device_param.index = index;
+		p.raw.device_param.value = t->local[index];
+		if (mx_request(t->mx, &p, PARAM_TIMEOUT, PARAM_RETRY, param_answer, t) < 0) {
+			t->failed++;
+			continue;
+		}
+		t->pending++;
+	}
+
+	return t->pending == 0;
+}
+
+/*
+ * with t->mutex held, released here: end transfer if it's over and tell
+ * 'done'
+ */
+static void param_finish(param_table_t *t, gboolean over)
+{
+	PARAM_DONE done;
+	void *arg;
+	packet_t p;
+	gint result;
+
+	if (!over) {
+		pthread_mutex_unlock(&t->mutex);
+		return;
+	}
+	result = t->failed ? -1 : 0;
+	if (t->request == DEVICE_PARAM_SET && t->save && result == 0) {
+		p.type = DEVICE_PARAM_SAVE;
+		mx_tx_packet(t->mx, &p);
+	}
+	done = t->done;
+	arg = t->arg;
+	t->busy = FALSE;
+	pthread_mutex_unlock(&t->mutex);
+	if (done)
+		done(t, result, arg);
+}
+
+/*
+ * mx rx thread: DEVICE_PARAM_RESPONSE to a request or set, NULL on timeout
+ */
+static void param_answer(packet_t *request, packet_t *response, void *arg)
+{
+	param_table_t *t = (param_table_t*)arg;
+	guint index = request->raw.device_param.index;
+
+	pthread_mutex_lock(&t->mutex);
+	t->pending--;
+	if (response == NULL) {
+		t->failed++;
+	} else {
+		t->value[index] = response->raw.device_param.value;
+		t->flag[index] |= PARAM_VALID;
+		/* device may clamp what was set, unless changed meanwhile keep its value */
+		if (!(t->flag[index] & PARAM_DIRTY) || (request->type == DEVICE_PARAM_SET &&
+				t->local[index] == request->raw.device_param.value)) {
+			t->local[index] = t->value[index];
+			t->flag[index] &= ~PARAM_DIRTY;
+		}
+	}
+	param_finish(t, param_pump(t));
+}
+
+static gint param_start(param_table_t *t, PACKET_TYPE request, gboolean save,
+			PARAM_DONE done, void *arg)
+{
+	pthread_mutex_lock(&t->mutex);
+	if (t->busy) {
+		pthread_mutex_unlock(&t->mutex);
+		return -1;
+	}
+	t->busy = TRUE;
+	t->request = request;
+	t->save = save;
+	t->next = 0;
+	t->pending = 0;
+	t->failed = 0;
+	t->done = done;
+	t->arg = arg;
+	param_finish(t, param_pump(t));
+
+	return 0;
+}
+
+void param_init(param_table_t *t, mx_t *mx, guint number)
+{
+	t->mx = mx;
+	t->number = number < MAX_PARAM ? number : MAX_PARAM;
+	memset(t->value, 0, sizeof(t->value));
+	memset(t->local, 0, sizeof(t->local));
+	memset(t->flag, 0, sizeof(t->flag));
+	t->busy = FALSE;
+	pthread_mutex_init(&t->mutex, NULL);
+}
+
+/*
+ * mx must be destroyed first when a transfer may be in progress
+ */
+void param_destroy(param_table_t *t)
+{
+	pthread_mutex_destroy(&t->mutex);
+}
+
+/*
+ * read all parameters from device, -1 if a transfer is in progress
+ */
+gint param_fetch(param_table_t *t, PARAM_DONE done, void *arg)
+{
+	return param_start(t, DEVICE_PARAM_REQUEST, FALSE, done, arg);
+}
+
+/*
+ * write changed parameters to device, and store them to its flash when
+ * 'save' and all were written, -1 if a transfer is in progress
+ */
+gint param_upload(param_table_t *t, gboolean save, PARAM_DONE done, void *arg)
+{
+	return param_start(t, DEVICE_PARAM_SET, save, done, arg);
+}
+
+/*
+ * local value of parameter 'index', -1 if it's unknown
+ */
+gint param_get(param_table_t *t, guint index, gint *value)
+{
+	gint ret = -1;
+
+	if (index >= t->number)
+		return -1;
+	pthread_mutex_lock(&t->mutex);
+	if (t->flag[index] & (PARAM_VALID | PARAM_DIRTY)) {
+		*value = t->local[index];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+gint param_set(param_table_t *t, guint index, gint value)
+{
+	if (index >= t->number)
+		return -1;
+	pthread_mutex_lock(&t->mutex);
+	t->local[index] = value;
+	if ((t->flag[index] & PARAM_VALID) && t->value[index] == value) {
+		t->flag[index] &= ~PARAM_DIRTY;
+	} else {
+		t->flag[index] |= PARAM_DIRTY;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return 0;
+}
+
+/*
+ * number of parameters param_upload() would send
+ */
+guint param_dirty(param_table_t *t)
+{
+	guint i, n = 0;
+
+	pthread_mutex_lock(&t->mutex);
+	for (i = 0; i < t->number; i++) {
+		if (t->flag[i] & PARAM_DIRTY)
+			n++;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return n;
+}
@@ -0,0 +1,95 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef PARAM_H_
+#define PARAM_H_
+
+#include <pthread.h>
+#include <glib.h>
+#include "mx.h"
+
+/*
+ * macro 
+ */
+
+#define MAX_PARAM 256 /* index is one byte */
+#define PARAM_WINDOW 8 /* requests in flight, within default tx class length */
+#define PARAM_TIMEOUT 200 /* ms */
+#define PARAM_RETRY 3 /* resends of a lost parameter */
+
+#define PARAM_VALID 0x01 /* value got from device */
+#define PARAM_DIRTY 0x02 /* local value not on device yet */
+
+/*
+ * data structure 
+ */
+
+struct _param_table_struct;
+typedef void (*PARAM_DONE)(struct _param_table_struct *t, gint result, void *arg);
+
+/*
+ * host copy of device parameters. param_fetch() reads all of them and
+ * param_upload() writes only changed ones, both keep PARAM_WINDOW
+ * requests in flight and resend only lost ones (see mx_request()).
+ * 'done' is called by mx rx thread, result 0 or -1 if some parameter
+ * got no answer.
+ */
+typedef struct _param_table_struct {
+	mx_t *mx;
+	guint number; /* parameters on device */
+	gint value[MAX_PARAM]; /* device value */
+	gint local[MAX_PARAM]; /* value set by param_set() */
+	guchar flag[MAX_PARAM]; /* PARAM_VALID, PARAM_DIRTY */
+	pthread_mutex_t mutex;
+
+	/* transfer in progress */
+	gboolean busy;
+	PACKET_TYPE request; /* DEVICE_PARAM_REQUEST / DEVICE_PARAM_SET */
+	gboolean save; /* DEVICE_PARAM_SAVE after upload */
+	guint next; /* next index to look at */
+	guint pending; /* requests in flight */
+	guint failed;
+	PARAM_DONE done;
+	void *arg;
+} param_table_t;
+
+/*
+ * functions
+ */
+
+extern void param_init(param_table_t *t, mx_t *mx, guint number);
+extern void param_destroy(param_table_t *t);
+extern gint param_fetch(param_table_t *t, PARAM_DONE done, void *arg);
+extern gint param_upload(param_table_t *t, gboolean save, PARAM_DONE done, void *arg);
+extern gint param_get(param_table_t *t, guint index, gint *value);
+extern gint param_set(param_table_t *t, guint index, gint value);
+extern guint param_dirty(param_table_t *t);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "pool.h"
+
+static pool_task_t* pool_take(pool_worker_t *w)
+{
+	pool_task_t *task;
+
+	pthread_mutex_lock(&w->mutex);
+	task = w->head;
+	if (task) {
+		w->head = task->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return task;
+}
+
+/*
+ * own queue first, then other workers' ones starting after 'w'
+ */
+static pool_task_t* pool_find(pool_t *pool, pool_worker_t *w)
+{
+	pool_task_t *task;
+	guint i, self;
+
+	task = pool_take(w);
+	if (task)
+		return task;
+	self = w - pool->worker;
+	for (i = 1; i < pool->worker_number; i++) {
+		task = pool_take(&pool->worker[(self + i) % pool->worker_number]);
+		if (task) {
+			w->stolen++;
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+static void* pool_worker(void *data)
+{
+	pool_worker_t *w = (pool_worker_t*)data;
+	pool_t *pool = w->pool;
+	pool_task_t *task;
+
+	while (1) {
+		task = pool_find(pool, w);
+		if (task) {
+			/* only a task taken off a queue counts down */
+			__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+			task->run(task);
+			continue;
+		}
+		/* sleeping is raised before pending is checked, pool_submit() does reverse */
+		pthread_mutex_lock(&pool->mutex);
+		__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 && pool->active)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!pool->active && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+/*
+ * start 'worker_number' threads (0 for POOL_WORKER_NUMBER)
+ */
+void pool_init(pool_t *pool, guint worker_number)
+{
+	pool_worker_t *w;
+	guint i;
+
+	if (worker_number == 0)
+		worker_number = POOL_WORKER_NUMBER;
+	if (worker_number > MAX_POOL_WORKER)
+		worker_number = MAX_POOL_WORKER;
+	pool->worker_number = worker_number;
+	pool->next = 0;
+	pool->pending = 0;
+	pool->sleeping = 0;
+	pool->active = TRUE;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for (i = 0; i < worker_number; i++) {
+		w = &pool->worker[i];
+		w->head = NULL;
+		w->tail = NULL;
+		w->pool = pool;
+		w->stolen = 0;
+		pthread_mutex_init(&w->mutex, NULL);
+	}
+	for (i = 0; i < worker_number; i++)
+		pthread_create(&pool->worker[i].thread, NULL, pool_worker, &pool->worker[i]);
+}
+
+/*
+ * queued tasks, and ones they submit, are run before workers stop
+ */
+void pool_destroy(pool_t *pool)
+{
+	guint i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->active = FALSE;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (i = 0; i < pool->worker_number; i++) {
+		pthread_join(pool->worker[i].thread, NULL);
+		pthread_mutex_destroy(&pool->worker[i].mutex);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+void pool_submit(pool_t *pool, pool_task_t *task)
+{
+	pool_worker_t *w;
+
+	w = &pool->worker[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) %
+			pool->worker_number];
+	task->next = NULL;
+	/*
+	 * counted before it's queued, so pending never drops below what
+	 * is queued and a worker never sleeps with a task waiting
+	 */
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&w->mutex);
+	if (w->tail) {
+		w->tail->next = task;
+	} else {
+		w->head = task;
+	}
+	w->tail = task;
+	pthread_mutex_unlock(&w->mutex);
+
+	if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->mutex);
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
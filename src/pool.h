@@ -0,0 +1,89 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+#include <glib.h>
+
+/*
+ * macro 
+ */
+
+#define MAX_POOL_WORKER 8
+#define POOL_WORKER_NUMBER 2 /* default */
+
+/*
+ * data structure 
+ */
+
+/*
+ * unit of work, embedded in caller's object, it's queued by pointer so
+ * it mustn't be submitted again before it runs
+ */
+typedef struct _pool_task_struct {
+	void (*run)(struct _pool_task_struct *task);
+	struct _pool_task_struct *next;
+} pool_task_t;
+
+/*
+ * task queue of one worker, tasks are submitted round robin, a worker
+ * without tasks steals the oldest one of another worker
+ */
+typedef struct _pool_worker_struct {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pool_task_t *head;
+	pool_task_t *tail;
+	struct _pool_struct *pool;
+	guint stolen; /* tasks taken from other workers */
+} pool_worker_t;
+
+typedef struct _pool_struct {
+	pool_worker_t worker[MAX_POOL_WORKER];
+	guint worker_number;
+	guint next; /* worker for next submit */
+	gint pending; /* tasks submitted and not taken yet, never below queued */
+	gint sleeping; /* workers waiting on cond */
+	gboolean active;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; /* task queued */
+} pool_t;
+
+/*
+ * functions
+ */
+
+extern void pool_init(pool_t *pool, guint worker_number);
+extern void pool_destroy(pool_t *pool);
+extern void pool_submit(pool_t *pool, pool_task_t *task);
+
+#endif
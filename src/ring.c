@@ -0,0 +1,186 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+/*
+ * 'size' is rounded up to a power of two, -1 if it is 0 or the power
+ * of two doesn't fit unsigned int
+ */
+int ring_init(ring_t *r, unsigned int size)
+{
+	unsigned int n;
+
+	if (size == 0 || size > (1u << 31))
+		return -1;
+	for (n = 1; n < size; n <<= 1);
+	memset(r, 0, sizeof(ring_t));
+	r->buffer = malloc(n);
+	if (r->buffer == NULL)
+		return -1;
+	r->size = n;
+	r->mask = n - 1;
+
+	return 0;
+}
+
+void ring_destroy(ring_t *r)
+{
+	free(r->buffer);
+	r->buffer = NULL;
+}
+
+/*
+ * producer: copy as much of 'd' as fits, bytes already in ring are never
+ * thrown away, return bytes stored
+ */
+unsigned int ring_write(ring_t *r, const unsigned char *d, unsigned int length)
+{
+	unsigned int head, space, n, part;
+
+	head = r->head;
+	space = r->size - (head - r->tail_cache);
+	if (space < length) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		space = r->size - (head - r->tail_cache);
+	}
+	n = length;
+	if (n > space) {
+		n = space;
+		__atomic_store_n(&r->overflow, r->overflow + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&r->dropped, r->dropped + length - n, __ATOMIC_RELAXED);
+	}
+	part = r->size - (head & r->mask);
+	if (part > n)
+		part = n;
+	memcpy(r->buffer + (head & r->mask), d, part);
+	memcpy(r->buffer, d + part, n - part);
+	/* bytes are visible before new head */
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/*
+ * producer: point 'd' at free space after head, return size of it, only
+ * the contiguous part up to end of buffer is given. bytes filled in are
+ * published by ring_commit(), so caller may read(2) straight into ring
+ */
+unsigned int ring_reserve(ring_t *r, unsigned char **d)
+{
+	unsigned int head, space, part;
+
+	head = r->head;
+	part = r->size - (head & r->mask);
+	space = r->size - (head - r->tail_cache);
+	if (space < part) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		space = r->size - (head - r->tail_cache);
+	}
+	*d = r->buffer + (head & r->mask);
+
+	return space < part ? space : part;
+}
+
+/*
+ * producer: publish 'length' bytes filled in after ring_reserve()
+ */
+void ring_commit(ring_t *r, unsigned int length)
+{
+	/* bytes are visible before new head */
+	__atomic_store_n(&r->head, r->head + length, __ATOMIC_RELEASE);
+}
+
+/*
+ * consumer: point 'd' at readable bytes, return number of them, only
+ * the contiguous part up to end of buffer is given, so call again after
+ * ring_consume() to get the wrapped part
+ */
+unsigned int ring_peek(ring_t *r, const unsigned char **d)
+{
+	unsigned int tail, n, part;
+
+	tail = r->tail;
+	if (r->head_cache == tail)
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	n = r->head_cache - tail;
+	part = r->size - (tail & r->mask);
+	*d = r->buffer + (tail & r->mask);
+
+	return n < part ? n : part;
+}
+
+/*
+ * consumer: release 'length' bytes got by ring_peek()
+ */
+void ring_consume(ring_t *r, unsigned int length)
+{
+	/* bytes are read before producer may reuse them */
+	__atomic_store_n(&r->tail, r->tail + length, __ATOMIC_RELEASE);
+}
+
+/*
+ * consumer: throw away oldest bytes until at most 'keep' are left,
+ * return bytes thrown away
+ */
+unsigned int ring_discard(ring_t *r, unsigned int keep)
+{
+	unsigned int n;
+
+	r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	n = r->head_cache - r->tail;
+	if (n <= keep)
+		return 0;
+	ring_consume(r, n - keep);
+
+	return n - keep;
+}
+
+/*
+ * bytes in ring, exact only when called by one of the two sides
+ */
+unsigned int ring_used(ring_t *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * producer: room left in ring
+ */
+unsigned int ring_space(ring_t *r)
+{
+	r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	return r->size - (r->head - r->tail_cache);
+}
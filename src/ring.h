@@ -0,0 +1,83 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef RING_H_
+#define RING_H_
+
+/*
+ * macro 
+ */
+
+#define RING_CACHE_LINE 64
+#define RING_ALIGNED __attribute__((aligned(RING_CACHE_LINE)))
+
+/*
+ * data structure 
+ */
+
+/*
+ * single producer / single consumer byte ring, lock free.
+ * head and tail run freely and wrap at 2^32, size is a power of two,
+ * each side works on its own cache line and keeps a copy of the other
+ * side's index, so the shared line is only read when the copy says
+ * ring is full (producer) or empty (consumer).
+ */
+typedef struct _ring_struct {
+	unsigned char *buffer;
+	unsigned int size;
+	unsigned int mask;
+
+	/* producer */
+	unsigned int head RING_ALIGNED;
+	unsigned int tail_cache;
+	unsigned int overflow; /* writes not fitting */
+	unsigned int dropped; /* bytes of those writes not stored */
+
+	/* consumer */
+	unsigned int tail RING_ALIGNED;
+	unsigned int head_cache;
+} ring_t;
+
+/*
+ * functions
+ */
+
+extern int ring_init(ring_t *r, unsigned int size);
+extern void ring_destroy(ring_t *r);
+extern unsigned int ring_write(ring_t *r, const unsigned char *d, unsigned int length);
+extern unsigned int ring_reserve(ring_t *r, unsigned char **d);
+extern void ring_commit(ring_t *r, unsigned int length);
+extern unsigned int ring_peek(ring_t *r, const unsigned char **d);
+extern void ring_consume(ring_t *r, unsigned int length);
+extern unsigned int ring_discard(ring_t *r, unsigned int keep);
+extern unsigned int ring_used(ring_t *r);
+extern unsigned int ring_space(ring_t *r);
+
+#endif
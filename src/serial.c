@@ -35,70 +35,141 @@
 #include <errno.h>  
 #include <termios.h>
 #include <sys/types.h>
-#include <sys/time.h>
-#include <sys/select.h>
-#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "amcc.h"
 #include "mx.h"
 #include "serial.h"
+#include "baud.h"
 
-static void* serial_rx_thread(void *data)
-{
-	gint n;
-	gint max_fd;
-	gint length;
-	gchar buffer[200];
-
-	fd_set input;
-	struct timeval timeout;
-
-	serial_t *s = (serial_t*)data;
-	max_fd = s->fd + 1;
-	
-	while (s->active) {
-		FD_ZERO(&input);
-		FD_SET(s->fd, &input);
-
-		timeout.tv_sec  = 1;
-		timeout.tv_usec = 0;
-		/* Do the select */
-		n = select(max_fd, &input, NULL, NULL, &timeout);
-		/* See if there was an error */
-		if (n < 0) {
-			g_print("select failed");
-			serial_close(s);
-			return;
-		} else if (n == 0) {
-			continue;
-		} else {
-			/* We have input */
-			if (FD_ISSET(s->fd, &input)) {
-				length = read(s->fd, buffer, 200);
-#if 0
-				guint i;
-				g_print("[serial_t] ");
-				for (i = 0; i < length; i++) {
-					g_print("%c", buffer[i]);
-				}
-				g_print("\n");
-				
+/* standard rates, others go by baud_set() */
+static const serial_speed_t serial_speed[] = {
+	{ 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 }, { 150, B150 },
+	{ 200, B200 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 },
+	{ 1800, B1800 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+	{ 115200, B115200 },
+#ifdef B230400
+	{ 230400, B230400 },
 #endif
-				s->rx_handler(s->mx, buffer, length);
-			}
-		}
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B500000
+	{ 500000, B500000 },
+#endif
+#ifdef B576000
+	{ 576000, B576000 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+#ifdef B1152000
+	{ 1152000, B1152000 },
+#endif
+#ifdef B1500000
+	{ 1500000, B1500000 },
+#endif
+#ifdef B2000000
+	{ 2000000, B2000000 },
+#endif
+#ifdef B2500000
+	{ 2500000, B2500000 },
+#endif
+#ifdef B3000000
+	{ 3000000, B3000000 },
+#endif
+#ifdef B3500000
+	{ 3500000, B3500000 },
+#endif
+#ifdef B4000000
+	{ 4000000, B4000000 },
+#endif
+};
+
+#define SERIAL_SPEED_NUMBER (sizeof(serial_speed) / sizeof(serial_speed[0]))
+
+/*
+ * B* of 'rate', B0 if it isn't a standard one
+ */
+static speed_t serial_speed_find(guint rate)
+{
+	guint i;
+
+	for (i = 0; i < SERIAL_SPEED_NUMBER; i++) {
+		if (serial_speed[i].rate == rate)
+			return serial_speed[i].speed;
+	}
+	return B0;
+}
+
+/*
+ * rate of B* 'speed', 0 if unknown
+ */
+static guint serial_speed_rate(speed_t speed)
+{
+	guint i;
+
+	for (i = 0; i < SERIAL_SPEED_NUMBER; i++) {
+		if (serial_speed[i].speed == speed)
+			return serial_speed[i].rate;
 	}
+	return 0;
+}
+
+/*
+ * USB serial adapters buffer input for their latency timer (16 ms on
+ * FTDI) unless ASYNC_LOW_LATENCY is set, ttys without it (eg: pty) fail
+ * the ioctl and are left alone
+ */
+static void serial_low_latency(serial_t *s, gboolean on)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+
+	if (ioctl(s->fd, TIOCGSERIAL, &ss) < 0)
+		return;
+	if (on) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+	} else {
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+	}
+	ioctl(s->fd, TIOCSSERIAL, &ss);
+#endif
 }
 
-void serial_init(serial_t *s, RX_HANDLER rx_handler, mx_t *mx)
+void serial_init(serial_t *s)
 {
-	s->mx = mx;
-	s->rx_handler = rx_handler;
+	s->rx_mode = SERIAL_RX_LOW_LATENCY;
+	s->fd = -1;
+	s->baudrate = 0;
+	s->active = FALSE;
 }
 
+/*
+ * SERIAL_RX_*, before serial_open()
+ */
+void serial_set_rx_mode(serial_t *s, guint mode)
+{
+	s->rx_mode = mode;
+}
+
+/*
+ * 'baudrate' in bit/s, any rate the driver takes (termios2 BOTHER on
+ * Linux), s->baudrate tells the one in effect
+ */
 gint serial_open(serial_t *s, gchar *name, guint baudrate)
 {
 	struct termios options;
+	speed_t speed;
 
 	strncpy(s->name, name, MAX_SERIAL_NAME_LENGTH);
 	s->baudrate = baudrate;
@@ -112,27 +183,10 @@ gint serial_open(serial_t *s, gchar *name, guint baudrate)
 	}
 	/* set serial port parameters */
 	tcgetattr(s->fd, &options);
-	switch (baudrate) {
-	case 115200:
-	   s->baudrate = B115200;
-	   break;
-	case 57600:
-	   s->baudrate = B57600;
-	   break;
-	case 38400:
-	   s->baudrate = B38400;
-	   break;
-	case 19200:
-	   s->baudrate  = B19200;
-	   break;
-	case 9600:
-	   s->baudrate  = B9600;
-	   break;
-	case 4800:
-	   s->baudrate  = B4800;
-	   break;
-	}
-	cfsetispeed(&options, s->baudrate);
+	speed = serial_speed_find(baudrate);
+	/* other rate: standard one until baud_set() below */
+	cfsetispeed(&options, (speed != B0) ? speed : B38400);
+	cfsetospeed(&options, (speed != B0) ? speed : B38400);
 	options.c_cflag |= (CLOCAL | CREAD);
 	/* ALWAYS use 8N1 */
 	options.c_cflag &= ~PARENB;
@@ -141,31 +195,89 @@ gint serial_open(serial_t *s, gchar *name, guint baudrate)
 	options.c_cflag |= CS8;
 	options.c_lflag  &= ~(ICANON | ECHO | ECHOE | ISIG);  /*Input*/
 	options.c_oflag  &= ~OPOST;   /*Output*/
+	/* read() is non-blocking, VMIN only decides when epoll reports input */
+	options.c_cc[VMIN] = (s->rx_mode == SERIAL_RX_BATCH) ? SERIAL_RX_MIN : 1;
+	options.c_cc[VTIME] = 0;
 	tcsetattr(s->fd, TCSANOW, &options);	
-	/* start rx thread */
+	if (speed == B0 && baud_set(s->fd, baudrate) == -1) {
+		fprintf(stderr, "%s doesn't take %u baud\n", name, baudrate);
+		serial_close(s);
+		return -1;
+	}
+	/* driver rounds to a divisor it has, eg: FTDI */
+	s->baudrate = baud_get(s->fd);
+	if (s->baudrate == 0) {
+		tcgetattr(s->fd, &options);
+		s->baudrate = serial_speed_rate(cfgetospeed(&options));
+	}
+	serial_low_latency(s, s->rx_mode == SERIAL_RX_LOW_LATENCY);
 	s->active = TRUE;
-	pthread_create( &s->thread_rx, NULL, serial_rx_thread, (void*)s);	
 
 	return 0;
 }
 
+/*
+ * reader of fd (see transport_open()) must have stopped
+ */
 gint serial_close(serial_t *s)
 {
-	if (s->fd != -1) {
-		close(s->fd);
-		s->active = FALSE;
-		pthread_join(s->thread_rx, NULL);
-	}
+	if (s->fd == -1)
+		return 0;
+	__atomic_store_n(&s->active, FALSE, __ATOMIC_RELEASE);
+	close(s->fd);
+	s->fd = -1;
+
 	return 0;
 }
 
-gint serial_tx_data(void *p, gchar *buffer, guint length)
+/*
+ * write all of 'iov', fd is non-blocking: a short write goes on where
+ * it stopped, EAGAIN waits until fd is writable again
+ */
+gint serial_tx_data(void *p, const struct iovec *iov, guint count)
 {
 	serial_t *s = (serial_t*)p;
-	gint len;
-	
-	if (s->active) {
-		len = write(s->fd, buffer, length);
-		return len;
+	struct iovec v[SERIAL_TX_IOV];
+	struct pollfd pfd;
+	guint i, n;
+	gssize len;
+	gint ret, total = 0;
+
+	if (!s->active)
+		return -1;
+	while (count > 0) {
+		n = count < SERIAL_TX_IOV ? count : SERIAL_TX_IOV;
+		memcpy(v, iov, n * sizeof(struct iovec));
+		iov += n;
+		count -= n;
+		i = 0;
+		while (i < n) {
+			len = writev(s->fd, v + i, n - i);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN)
+					return -1;
+				/* tty output queue is full */
+				pfd.fd = s->fd;
+				pfd.events = POLLOUT;
+				ret = poll(&pfd, 1, SERIAL_TX_TIMEOUT);
+				if (ret == 0 || (ret < 0 && errno != EINTR) || !s->active)
+					return -1;
+				continue;
+			}
+			total += len;
+			/* skip written buffers, a partly written one is advanced */
+			while (i < n && (gsize)len >= v[i].iov_len) {
+				len -= v[i].iov_len;
+				i++;
+			}
+			if (i < n) {
+				v[i].iov_base = (gchar*)v[i].iov_base + len;
+				v[i].iov_len -= len;
+			}
+		}
 	}
+
+	return total;
 }
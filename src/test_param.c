@@ -0,0 +1,332 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_param: param_fetch() and param_upload() against a simulated
+ * device answering after 2 ms. The device negotiates COBS + CRC-32C
+ * framing, the fetch is chained from the mx_negotiate() callback. It
+ * ignores the first request of every 5th parameter and the first
+ * DEVICE_PARAM_SET so they're resent, and clamps stored values to
+ * +-TEST_CLAMP. Reads the parameter table, changes some parameters (one
+ * of them to the value it has, so it's not sent), uploads and saves
+ * them, then reads the table back into a fresh copy and checks the
+ * device took the new values.
+ *
+ * test_param
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mx.h"
+#include "param.h"
+
+/*
+ * macro
+ */
+
+#define TEST_PARAMS 16 /* device sets parameter i to i * 10 */
+#define TEST_CLAMP 1000 /* device stores values within +-TEST_CLAMP */
+#define TEST_MODE (PACKET_MODE_COBS | PACKET_MODE_CRC32) /* device capability */
+#define TEST_DELAY_US 2000 /* device turnaround */
+#define TEST_QUEUE 64 /* answers pending in device, power of two */
+#define TEST_TIMEOUT 5000 /* ms a transfer may take */
+
+/*
+ * data structure
+ */
+
+typedef struct _test_struct {
+	/* device */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	packet_t answer[TEST_QUEUE];
+	guint64 due[TEST_QUEUE]; /* us */
+	guint head;
+	guint tail;
+	guint mode; /* framing both ways, with atomics */
+	gint value[TEST_PARAMS];
+	guint seen[TEST_PARAMS]; /* requests per parameter */
+	guint set[TEST_PARAMS]; /* DEVICE_PARAM_SET per parameter */
+	guint sets;
+	guint saves;
+	guint garbled; /* frames device couldn't decode */
+	gboolean run; /* with atomics */
+	/* host */
+	guint negotiated; /* host tx mode when fetch started */
+	gint result; /* of last transfer, with atomics */
+	gboolean done; /* with atomics */
+} test_t;
+
+static mx_t mx;
+static test_t test;
+static param_table_t table, check;
+
+/*
+ * functions
+ */
+
+static guint64 test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * queue 'p' to be sent by device after TEST_DELAY_US, with test.mutex
+ */
+static void test_answer(packet_t *p)
+{
+	test.answer[test.tail] = *p;
+	test.due[test.tail] = test_now() + TEST_DELAY_US;
+	test.tail = (test.tail + 1) & (TEST_QUEUE - 1);
+}
+
+/*
+ * device side of the wire, take one request, with test.mutex
+ */
+static void test_take(packet_t *p)
+{
+	guint index = p->raw.device_param.index;
+	gint value = p->raw.device_param.value;
+
+	switch (p->type) {
+	case DEVICE_INFO_REQUEST:
+		p->type = DEVICE_INFO_RESPONSE;
+		p->raw.device_info.board = 1;
+		p->raw.device_info.firmware = 1;
+		p->raw.device_info.capability = TEST_MODE;
+		test_answer(p);
+		break;
+	case DEVICE_PARAM_REQUEST:
+		if (index >= TEST_PARAMS || (index % 5 == 2 && test.seen[index]++ == 0))
+			break;
+		p->type = DEVICE_PARAM_RESPONSE;
+		p->raw.device_param.value = test.value[index];
+		test_answer(p);
+		break;
+	case DEVICE_PARAM_SET:
+		if (index >= TEST_PARAMS || test.sets++ == 0)
+			break;
+		test.set[index]++;
+		test.value[index] = value > TEST_CLAMP ? TEST_CLAMP :
+			value < -TEST_CLAMP ? -TEST_CLAMP : value;
+		p->type = DEVICE_PARAM_RESPONSE;
+		p->raw.device_param.value = test.value[index];
+		test_answer(p);
+		break;
+	case DEVICE_PARAM_SAVE:
+		test.saves++;
+		break;
+	default:
+		break;
+	}
+}
+
+static gint test_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	packet_t p;
+	guint i;
+	gint length = 0;
+
+	pthread_mutex_lock(&test.mutex);
+	for (i = 0; i < count; i++) {
+		length += iov[i].iov_len;
+		memcpy(p.data, iov[i].iov_base, iov[i].iov_len);
+		p.data_length = iov[i].iov_len;
+		/* decoder takes COBS frame without its delimiter */
+		if ((test.mode & PACKET_MODE_COBS) && p.data_length &&
+				p.data[p.data_length - 1] == PACKET_DELIMITER)
+			p.data_length--;
+		if (packet_decode_mode(&p, test.mode) != PACKET_SUCCESS) {
+			test.garbled++;
+			continue;
+		}
+		test_take(&p);
+	}
+	pthread_mutex_unlock(&test.mutex);
+
+	return length;
+}
+
+static void* test_device(void *arg)
+{
+	packet_t p;
+
+	while (__atomic_load_n(&test.run, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&test.mutex);
+		if (test.head == test.tail || test.due[test.head] > test_now()) {
+			pthread_mutex_unlock(&test.mutex);
+			usleep(200);
+			continue;
+		}
+		p = test.answer[test.head];
+		test.head = (test.head + 1) & (TEST_QUEUE - 1);
+		packet_encode_mode(&p, test.mode);
+		/* frame following DEVICE_INFO_RESPONSE uses common mode */
+		if (p.type == DEVICE_INFO_RESPONSE)
+			test.mode = TEST_MODE & mx.capability;
+		pthread_mutex_unlock(&test.mutex);
+
+		mx_rx_data(&mx, (gchar*)p.data, p.data_length);
+	}
+
+	return NULL;
+}
+
+/*
+ * mx rx thread: transfer is over
+ */
+static void test_done(param_table_t *t, gint result, void *arg)
+{
+	__atomic_store_n(&test.result, result, __ATOMIC_RELAXED);
+	__atomic_store_n(&test.done, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+ * mx rx thread: framing negotiated, read the table
+ */
+static void test_negotiated(packet_t *request, packet_t *response, void *arg)
+{
+	pthread_mutex_lock(&mx.tx_buffer_mutex);
+	test.negotiated = response ? mx.tx_mode : ~0u;
+	pthread_mutex_unlock(&mx.tx_buffer_mutex);
+	if (param_fetch(&table, test_done, NULL) < 0)
+		test_done(&table, -1, NULL);
+}
+
+/*
+ * wait for test_done(), return its result, -1 on timeout
+ */
+static gint test_wait(const gchar *name, guint64 start)
+{
+	guint waited;
+
+	for (waited = 0; !__atomic_load_n(&test.done, __ATOMIC_ACQUIRE); waited++) {
+		if (waited > TEST_TIMEOUT) {
+			printf("%s timed out\n", name);
+			return -1;
+		}
+		usleep(1000);
+	}
+	__atomic_store_n(&test.done, FALSE, __ATOMIC_RELAXED);
+	printf("%-6s %6.1f ms result %d\n", name, (test_now() - start) / 1e3,
+		__atomic_load_n(&test.result, __ATOMIC_RELAXED));
+
+	return __atomic_load_n(&test.result, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char *argv[])
+{
+	guint64 start;
+	guint i, retried, timeout;
+	gint value, expect, failed = 0;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	memset(&test, 0, sizeof(test));
+	pthread_mutex_init(&test.mutex, NULL);
+	for (i = 0; i < TEST_PARAMS; i++)
+		test.value[i] = i * 10;
+	if (mx_init(&mx, test_tx_data, NULL, NULL) < 0)
+		return 1;
+	test.run = TRUE;
+	pthread_create(&test.thread, NULL, test_device, NULL);
+	param_init(&table, &mx, TEST_PARAMS);
+	param_init(&check, &mx, TEST_PARAMS);
+
+	start = test_now();
+	if (mx_negotiate(&mx, test_negotiated, NULL) < 0 || test_wait("fetch", start))
+		failed = 1;
+	printf("framing mode %#x\n", test.negotiated);
+	if (test.negotiated != TEST_MODE) {
+		printf("fetch didn't wait for negotiation\n");
+		failed = 1;
+	}
+	for (i = 0; i < TEST_PARAMS; i++) {
+		if (param_get(&table, i, &value) < 0 || value != (gint)i * 10) {
+			printf("param %u wrong after fetch\n", i);
+			failed = 1;
+		}
+	}
+
+	param_set(&table, 3, -3);
+	param_set(&table, 5, 50); /* what device has */
+	param_set(&table, 7, 70000); /* device clamps it */
+	param_set(&table, TEST_PARAMS - 1, 1);
+	if (param_dirty(&table) != 3) {
+		printf("dirty %u, 3 expected\n", param_dirty(&table));
+		failed = 1;
+	}
+	start = test_now();
+	if (param_upload(&table, TRUE, test_done, NULL) < 0 || test_wait("upload", start))
+		failed = 1;
+	if (param_dirty(&table) || param_get(&table, 7, &value) < 0 || value != TEST_CLAMP) {
+		printf("upload didn't take device values\n");
+		failed = 1;
+	}
+
+	start = test_now();
+	if (param_fetch(&check, test_done, NULL) < 0 || test_wait("check", start))
+		failed = 1;
+	for (i = 0; i < TEST_PARAMS; i++) {
+		if (param_get(&check, i, &value) < 0 || param_get(&table, i, &expect) < 0 ||
+				value != expect) {
+			printf("param %u not on device\n", i);
+			failed = 1;
+		}
+	}
+	mx_request_stats(&mx, NULL, &retried, &timeout);
+	printf("retried %u timeout %u\n", retried, timeout);
+
+	__atomic_store_n(&test.run, FALSE, __ATOMIC_RELAXED);
+	pthread_join(test.thread, NULL);
+	mx_destroy(&mx);
+	param_destroy(&table);
+	param_destroy(&check);
+
+	/* 3, 7 and 15 written once each after the lost one, 5 unchanged */
+	if (test.set[3] != 1 || test.set[5] || test.set[7] != 1 ||
+			test.set[TEST_PARAMS - 1] != 1 || test.saves != 1) {
+		printf("sets %u saves %u, only changed parameters expected\n",
+			test.sets, test.saves);
+		failed = 1;
+	}
+	if (test.garbled || retried == 0 || timeout) {
+		printf("garbled %u retried %u timeout %u\n", test.garbled, retried, timeout);
+		failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,278 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_pool: MX_HANDLER_DEFERRED subscribers on the worker pool. One
+ * inline subscriber counts frames, a slow deferred one takes 5 ms a
+ * frame, a medium one 300 us and is registered halfway, frames come
+ * every 500 us. Inline one must see every frame, deferred ones
+ * must see theirs in order, slow one drops what its queue can't hold
+ * and queue-wait latency is reported. Then submitters hand the bare pool
+ * one task at a time and wait for it, so workers keep going to sleep
+ * and being woken, a lost wakeup leaves a task waiting.
+ *
+ * test_pool [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mx.h"
+#include "pool.h"
+
+/*
+ * macro
+ */
+
+#define TEST_FRAMES 2000 /* default */
+#define TEST_GAP 500 /* us between frames */
+#define TEST_SLOW 5000 /* us a slow callback takes */
+#define TEST_MEDIUM 300 /* us */
+#define TEST_WORKERS 3
+#define TEST_SUBMITTERS 4
+#define TEST_HANDOFFS 5000 /* tasks per submitter */
+#define TEST_HANDOFF_TIMEOUT 1000000 /* us a task may wait for a worker */
+
+/*
+ * data structure
+ */
+
+typedef struct _test_subscriber_struct {
+	guint delay; /* us */
+	guint received;
+	gint last; /* value[0] of last frame, -1 none */
+	guint disorder; /* frames older than one before */
+} test_subscriber_t;
+
+typedef struct _test_handoff_struct {
+	pool_task_t task; /* first, task is cast back */
+	pthread_t thread;
+	gboolean done; /* with atomics */
+	guint lost; /* tasks not run in time */
+	guint64 wait_max; /* us */
+} test_handoff_t;
+
+static pool_t pool;
+static test_subscriber_t slow = { TEST_SLOW, 0, -1, 0 };
+static test_subscriber_t medium = { TEST_MEDIUM, 0, -1, 0 };
+static guint inline_received; /* with atomics */
+
+/*
+ * functions
+ */
+
+static gint test_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	return 0;
+}
+
+static gint test_inline(packet_t *p, void *arg)
+{
+	__atomic_store_n(&inline_received, inline_received + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * worker pool, one worker at a time for a subscriber
+ */
+static gint test_deferred(packet_t *p, test_subscriber_t *s)
+{
+	gint value = p->raw.analog_data.value[0];
+
+	if (value <= s->last)
+		s->disorder++;
+	s->last = value;
+	s->received++;
+	usleep(s->delay);
+
+	return 0;
+}
+
+static gint test_slow(packet_t *p, void *arg)
+{
+	return test_deferred(p, &slow);
+}
+
+static gint test_medium(packet_t *p, void *arg)
+{
+	return test_deferred(p, &medium);
+}
+
+static guint64 test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void test_handoff_run(pool_task_t *task)
+{
+	test_handoff_t *h = (test_handoff_t*)task;
+
+	__atomic_store_n(&h->done, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+ * submit a task, wait until a worker ran it, again
+ */
+static void* test_handoff(void *arg)
+{
+	test_handoff_t *h = (test_handoff_t*)arg;
+	guint64 start, wait;
+	guint i;
+
+	h->task.run = test_handoff_run;
+	for (i = 0; i < TEST_HANDOFFS; i++) {
+		__atomic_store_n(&h->done, FALSE, __ATOMIC_RELAXED);
+		start = test_now();
+		pool_submit(&pool, &h->task);
+		while (!__atomic_load_n(&h->done, __ATOMIC_ACQUIRE)) {
+			if (test_now() - start > TEST_HANDOFF_TIMEOUT) {
+				/* task is still queued, it can't be submitted again */
+				h->lost++;
+				return NULL;
+			}
+			sched_yield();
+		}
+		wait = test_now() - start;
+		if (wait > h->wait_max)
+			h->wait_max = wait;
+	}
+
+	return NULL;
+}
+
+static void test_show(mx_t *m, const gchar *name, RX_CALLBACK callback,
+			test_subscriber_t *t, mx_subscriber_stats_t *s)
+{
+	memset(s, 0, sizeof(*s));
+	mx_subscriber_stats(m, ANALOG_DATA_RESPONSE, callback, s);
+	printf("%-6s processed %5u dropped %5u out of order %u wait avg %6llu us max %6u us\n",
+		name, s->processed, s->dropped, t->disorder,
+		s->processed ? (unsigned long long)(s->wait_total / s->processed) : 0ULL,
+		s->wait_max);
+}
+
+int main(int argc, char *argv[])
+{
+	static mx_t mx;
+	mx_config_t c;
+	mx_subscriber_stats_t ss, ms;
+	packet_t p;
+	guint frames = TEST_FRAMES;
+	static test_handoff_t handoff[TEST_SUBMITTERS];
+	guint i, overflow, dropped, exhausted, lost;
+	guint64 wait_max;
+	gint pending, failed = 0;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (frames < 2)
+		frames = 2;
+	mx_config_default(&c);
+	c.worker = TEST_WORKERS;
+	if (mx_init(&mx, test_tx_data, NULL, &c) < 0)
+		return 1;
+	mx_rx_register(&mx, ANALOG_DATA_RESPONSE, test_inline, NULL);
+	mx_rx_register_flags(&mx, ANALOG_DATA_RESPONSE, test_slow, NULL,
+		MX_HANDLER_DEFERRED);
+
+	memset(&p, 0, sizeof(p));
+	p.type = ANALOG_DATA_RESPONSE;
+	p.raw.analog_data.channel_number = 1;
+	for (i = 0; i < frames; i++) {
+		if (i == frames / 2) {
+			/* medium one starts here, so stats tell them apart */
+			mx_rx_register_flags(&mx, ANALOG_DATA_RESPONSE, test_medium,
+				NULL, MX_HANDLER_DEFERRED);
+		}
+		p.raw.analog_data.value[0] = i;
+		packet_encode(&p);
+		mx_rx_data(&mx, (gchar*)p.data, p.data_length);
+		usleep(TEST_GAP);
+	}
+	/* slow one empties its queue */
+	usleep(MX_SUBSCRIBER_QUEUE * TEST_SLOW * 2);
+
+	printf("inline received %u of %u\n", __atomic_load_n(&inline_received,
+		__ATOMIC_RELAXED), frames);
+	mx_rx_errors(&mx, NULL, &overflow, &dropped, &exhausted);
+	printf("rx overflow %u dropped %u pool exhausted %u\n", overflow, dropped, exhausted);
+	test_show(&mx, "slow", test_slow, &slow, &ss);
+	test_show(&mx, "medium", test_medium, &medium, &ms);
+	mx_destroy(&mx);
+
+	pool_init(&pool, TEST_WORKERS);
+	for (i = 0; i < TEST_SUBMITTERS; i++)
+		pthread_create(&handoff[i].thread, NULL, test_handoff, &handoff[i]);
+	lost = 0;
+	wait_max = 0;
+	for (i = 0; i < TEST_SUBMITTERS; i++) {
+		pthread_join(handoff[i].thread, NULL);
+		lost += handoff[i].lost;
+		if (handoff[i].wait_max > wait_max)
+			wait_max = handoff[i].wait_max;
+	}
+	pending = __atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST);
+	pool_destroy(&pool);
+	printf("handoff %u tasks, lost %u pending %d wait max %llu us\n",
+		TEST_SUBMITTERS * TEST_HANDOFFS, lost, pending,
+		(unsigned long long)wait_max);
+
+	if (inline_received != frames) {
+		printf("deferred subscribers stalled rx\n");
+		failed = 1;
+	}
+	if (slow.disorder || medium.disorder) {
+		printf("deferred frames out of order\n");
+		failed = 1;
+	}
+	if (ss.processed != slow.received || ss.processed + ss.dropped != frames ||
+			ss.dropped == 0 || ss.wait_max == 0) {
+		printf("slow subscriber queue miscounted\n");
+		failed = 1;
+	}
+	if (ms.processed != medium.received || ms.processed + ms.dropped != frames - frames / 2) {
+		printf("medium subscriber queue miscounted\n");
+		failed = 1;
+	}
+	if (lost || pending) {
+		printf("pool worker slept with a task queued\n");
+		failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,226 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_queue: mx queue depths and drop policies against a slow consumer.
+ * 200 frames, one per 200 us, go into a 256-byte rx ring whose
+ * subscriber takes 2 ms a frame, 20 commands into a 4-entry tx class
+ * whose link takes 20 ms a write, once for each policy:
+ *   MX_DROP_NEWEST  late frames / commands are refused
+ *   MX_DROP_OLDEST  early ones are thrown away, the newest arrive
+ *   MX_BLOCK        producers wait, nothing is lost
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mx.h"
+
+/*
+ * macro
+ */
+
+#define TEST_FRAMES 200
+#define TEST_COMMANDS 20
+#define TEST_RX_LENGTH 256
+#define TEST_TX_LENGTH 4
+#define TEST_POOL_LENGTH 8
+#define TEST_FRAME_US 200
+#define TEST_CALLBACK_US 2000
+#define TEST_WRITE_US 20000
+
+/*
+ * data structure
+ */
+
+typedef struct _test_struct {
+	guint received; /* with atomics */
+	gshort last; /* value[0] of last frame received */
+	gboolean slow; /* with atomics */
+} test_t;
+
+static test_t test;
+
+/*
+ * functions
+ */
+
+static gint test_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	guint i;
+	gint length = 0;
+
+	if (__atomic_load_n(&test.slow, __ATOMIC_RELAXED))
+		usleep(TEST_WRITE_US);
+	for (i = 0; i < count; i++)
+		length += iov[i].iov_len;
+
+	return length;
+}
+
+static gint test_callback(packet_t *p, void *arg)
+{
+	__atomic_store_n(&test.last, p->raw.analog_data.value[0], __ATOMIC_RELAXED);
+	__atomic_store_n(&test.received, test.received + 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&test.slow, __ATOMIC_RELAXED))
+		usleep(TEST_CALLBACK_US);
+
+	return 0;
+}
+
+static void test_show(mx_t *m, const gchar *name, guint queue, mx_queue_stats_t *s)
+{
+	mx_queue_stats(m, queue, s);
+	printf("  %-4s length %4u high water %4u dropped %5u blocked %3u timeout %u\n",
+		name, s->length, s->high_water, s->dropped, s->blocked, s->timeout);
+}
+
+static const gchar* test_policy(guint policy)
+{
+	switch (policy) {
+	case MX_DROP_NEWEST:
+		return "drop newest";
+	case MX_DROP_OLDEST:
+		return "drop oldest";
+	default:
+		return "block";
+	}
+}
+
+/*
+ * return 0 if queues behaved as 'policy' says
+ */
+static gint test_run(guint policy)
+{
+	static mx_t mx;
+	mx_config_t c;
+	mx_queue_stats_t rx, pool, tx;
+	packet_t p;
+	guint i, frame = 0, received, refused = 0;
+	gshort last;
+	gint failed = 0;
+
+	mx_config_default(&c);
+	c.rx.length = TEST_RX_LENGTH;
+	c.rx.policy = policy;
+	c.rx.timeout = 100;
+	c.pool.length = TEST_POOL_LENGTH;
+	c.tx.length = TEST_TX_LENGTH;
+	c.tx.policy = policy;
+	c.tx.timeout = 100;
+	memset(&test, 0, sizeof(test));
+	test.slow = TRUE;
+	if (mx_init(&mx, test_tx_data, NULL, &c) < 0)
+		return -1;
+	mx_rx_register(&mx, ANALOG_DATA_RESPONSE, test_callback, NULL);
+
+	memset(&p, 0, sizeof(p));
+	for (i = 0; i < TEST_FRAMES; i++) {
+		p.type = ANALOG_DATA_RESPONSE;
+		p.raw.analog_data.channel_number = 6;
+		p.raw.analog_data.value[0] = i;
+		packet_encode(&p);
+		frame = p.data_length;
+		mx_rx_data(&mx, (gchar*)p.data, p.data_length);
+		usleep(TEST_FRAME_US);
+	}
+	p.type = DEVICE_INFO_REQUEST;
+	for (i = 0; i < TEST_COMMANDS; i++) {
+		if (mx_tx_packet(&mx, &p) < 0)
+			refused++;
+	}
+	/* let both sides drain */
+	usleep(TEST_FRAMES * TEST_CALLBACK_US / 2);
+	for (i = 0; i < 50; i++) {
+		mx_queue_stats(&mx, MX_QUEUE_TX, &tx);
+		if (tx.used == 0)
+			break;
+		usleep(TEST_WRITE_US);
+	}
+
+	received = __atomic_load_n(&test.received, __ATOMIC_ACQUIRE);
+	last = __atomic_load_n(&test.last, __ATOMIC_RELAXED);
+	printf("%s: received %u of %u, last %d, commands refused %u\n", test_policy(policy),
+		received, TEST_FRAMES, last, refused);
+	test_show(&mx, "rx", MX_QUEUE_RX, &rx);
+	test_show(&mx, "pool", MX_QUEUE_POOL, &pool);
+	test_show(&mx, "tx", MX_QUEUE_TX, &tx);
+	__atomic_store_n(&test.slow, FALSE, __ATOMIC_RELAXED);
+	mx_destroy(&mx);
+
+	if (rx.high_water > rx.length || tx.high_water > tx.length)
+		failed = -1;
+	switch (policy) {
+	case MX_DROP_NEWEST:
+		if (rx.dropped == 0 || received >= TEST_FRAMES)
+			failed = -1;
+		if (refused == 0 || tx.dropped != refused)
+			failed = -1;
+		break;
+	case MX_DROP_OLDEST:
+		/*
+		 * stale frames are skipped once the subscriber returns, so
+		 * the last one received is within a ring of the newest
+		 */
+		if (rx.dropped == 0 || received >= TEST_FRAMES ||
+				last < (gint)(TEST_FRAMES - TEST_RX_LENGTH / frame))
+			failed = -1;
+		if (refused != 0 || tx.dropped == 0)
+			failed = -1;
+		break;
+	default:
+		if (received != TEST_FRAMES || rx.dropped || rx.blocked == 0 ||
+				rx.timeout)
+			failed = -1;
+		if (refused != 0 || tx.blocked == 0 || tx.timeout)
+			failed = -1;
+		break;
+	}
+	if (failed)
+		printf("  FAIL\n");
+
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	gint failed = 0;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	if (test_run(MX_DROP_NEWEST))
+		failed = 1;
+	if (test_run(MX_DROP_OLDEST))
+		failed = 1;
+	if (test_run(MX_BLOCK))
+		failed = 1;
+
+	return failed;
+}
@@ -0,0 +1,316 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_request: mx_request() against a simulated device answering
+ * DEVICE_PARAM_REQUEST after 5 ms. The device ignores the first request
+ * of every 7th parameter (index % 7 == 3) so it's retried, and never
+ * answers parameter 250 so it times out. Reads the table one request at
+ * a time, then with a window of requests in flight, checks every
+ * response is matched to its request and the window takes about one
+ * round trip. Last the link stalls with the request's tx class full
+ * under MX_BLOCK, retries must be dropped rather than hold up the rx
+ * thread, so the request still times out on time.
+ *
+ * test_request
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mx.h"
+
+/*
+ * macro
+ */
+
+#define TEST_PARAMS 251 /* last one is never answered */
+#define TEST_LOST 250
+#define TEST_DELAY_US 5000 /* device turnaround */
+#define TEST_TIMEOUT 30 /* ms */
+#define TEST_RETRY 2
+#define TEST_QUEUE 1024 /* answers pending in device, power of two */
+#define TEST_TX_TIMEOUT 2000 /* ms MX_BLOCK waits for tx room */
+
+/*
+ * data structure
+ */
+
+typedef struct _test_answer_struct {
+	guint index;
+	guint64 due; /* us */
+} test_answer_t;
+
+typedef struct _test_struct {
+	/* device */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	test_answer_t answer[TEST_QUEUE];
+	guint head;
+	guint tail;
+	guint seen[TEST_PARAMS]; /* requests per parameter */
+	gboolean run; /* with atomics */
+	gboolean stall; /* link takes nothing, with atomics */
+	gboolean stalled; /* tx thread stuck in test_tx_data(), with atomics */
+	/* host, callbacks run on rx thread */
+	guint total;
+	guint next;
+	guint done; /* with atomics */
+	guint answered;
+	guint timeout;
+	guint wrong;
+} test_t;
+
+static mx_t mx;
+static test_t test;
+
+/*
+ * functions
+ */
+
+static guint64 test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * device side of the wire, queue an answer for every request it takes
+ */
+static gint test_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	packet_t p;
+	guint i, index;
+	gint length = 0;
+
+	while (__atomic_load_n(&test.stall, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&test.stalled, TRUE, __ATOMIC_RELAXED);
+		usleep(1000);
+	}
+	for (i = 0; i < count; i++) {
+		length += iov[i].iov_len;
+		memcpy(p.data, iov[i].iov_base, iov[i].iov_len);
+		p.data_length = iov[i].iov_len;
+		if (packet_decode(&p) != PACKET_SUCCESS || p.type != DEVICE_PARAM_REQUEST)
+			continue;
+		index = p.raw.device_param.index;
+		if (index >= TEST_PARAMS || index == TEST_LOST)
+			continue;
+		pthread_mutex_lock(&test.mutex);
+		if (index % 7 == 3 && test.seen[index]++ == 0) {
+			pthread_mutex_unlock(&test.mutex);
+			continue;
+		}
+		test.answer[test.tail].index = index;
+		test.answer[test.tail].due = test_now() + TEST_DELAY_US;
+		test.tail = (test.tail + 1) & (TEST_QUEUE - 1);
+		pthread_mutex_unlock(&test.mutex);
+	}
+
+	return length;
+}
+
+static void* test_device(void *arg)
+{
+	packet_t p;
+	test_answer_t a;
+
+	while (__atomic_load_n(&test.run, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&test.mutex);
+		if (test.head == test.tail || test.answer[test.head].due > test_now()) {
+			pthread_mutex_unlock(&test.mutex);
+			usleep(200);
+			continue;
+		}
+		a = test.answer[test.head];
+		test.head = (test.head + 1) & (TEST_QUEUE - 1);
+		pthread_mutex_unlock(&test.mutex);
+
+		p.type = DEVICE_PARAM_RESPONSE;
+		p.raw.device_param.index = a.index;
+		p.raw.device_param.value = a.index * 10;
+		packet_encode(&p);
+		mx_rx_data(&mx, (gchar*)p.data, p.data_length);
+	}
+
+	return NULL;
+}
+
+static void test_issue(guint index);
+
+static void test_callback(packet_t *request, packet_t *response, void *arg)
+{
+	guint index = request->raw.device_param.index;
+
+	if (response == NULL) {
+		test.timeout++;
+		if (index != TEST_LOST)
+			test.wrong++;
+	} else if (response->raw.device_param.index != index ||
+			response->raw.device_param.value != (gint)index * 10) {
+		test.wrong++;
+	} else {
+		test.answered++;
+	}
+	if (test.next < test.total)
+		test_issue(test.next++);
+	__atomic_store_n(&test.done, test.done + 1, __ATOMIC_RELEASE);
+}
+
+static void test_issue(guint index)
+{
+	packet_t p;
+
+	p.type = DEVICE_PARAM_REQUEST;
+	p.raw.device_param.index = index;
+	if (mx_request(&mx, &p, TEST_TIMEOUT, TEST_RETRY, test_callback, NULL) < 0) {
+		printf("request %u refused\n", index);
+		test.wrong++;
+		__atomic_store_n(&test.done, test.done + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * read parameters 0 .. 'total' - 1 keeping 'window' requests in flight,
+ * return us taken
+ */
+static guint64 test_read(guint total, guint window)
+{
+	guint64 start = test_now();
+	guint i;
+
+	pthread_mutex_lock(&test.mutex);
+	memset(test.seen, 0, sizeof(test.seen));
+	pthread_mutex_unlock(&test.mutex);
+	test.total = total;
+	test.next = window;
+	__atomic_store_n(&test.done, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < window; i++)
+		test_issue(i);
+	while (__atomic_load_n(&test.done, __ATOMIC_ACQUIRE) < total)
+		usleep(100);
+
+	return test_now() - start;
+}
+
+/*
+ * stall the link, request TEST_LOST and fill its tx class up behind it,
+ * return us until the request timed out
+ */
+static guint64 test_stall(mx_config_t *c)
+{
+	guint64 start;
+	packet_t p;
+	guint i;
+
+	memset(&p, 0, sizeof(p));
+	p.type = DEVICE_PARAM_SAVE;
+	__atomic_store_n(&test.stall, TRUE, __ATOMIC_RELAXED);
+	mx_tx_packet(&mx, &p);
+	while (!__atomic_load_n(&test.stalled, __ATOMIC_RELAXED))
+		usleep(100);
+
+	test.total = 1;
+	test.next = 1;
+	__atomic_store_n(&test.done, 0, __ATOMIC_RELEASE);
+	start = test_now();
+	test_issue(TEST_LOST);
+	for (i = 1; i < c->tx.length; i++)
+		mx_tx_packet(&mx, &p);
+	while (__atomic_load_n(&test.done, __ATOMIC_ACQUIRE) < 1)
+		usleep(100);
+	start = test_now() - start;
+	__atomic_store_n(&test.stall, FALSE, __ATOMIC_RELAXED);
+
+	return start;
+}
+
+int main(int argc, char *argv[])
+{
+	mx_config_t c;
+	mx_queue_stats_t tx;
+	guint64 serial, window, stall;
+	guint pending, retried, timeout, lost;
+	gint failed = 0;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	memset(&test, 0, sizeof(test));
+	pthread_mutex_init(&test.mutex, NULL);
+	mx_config_default(&c);
+	c.tx.length = MX_REQUEST_NUMBER;
+	c.tx.policy = MX_BLOCK;
+	c.tx.timeout = TEST_TX_TIMEOUT;
+	if (mx_init(&mx, test_tx_data, NULL, &c) < 0)
+		return 1;
+	test.run = TRUE;
+	pthread_create(&test.thread, NULL, test_device, NULL);
+
+	serial = test_read(64, 1);
+	printf("64 parameters one at a time %6.1f ms\n", serial / 1e3);
+	window = test_read(64, 32);
+	printf("64 parameters 32 in flight  %6.1f ms\n", window / 1e3);
+	test_read(TEST_PARAMS, MX_REQUEST_NUMBER);
+	mx_request_stats(&mx, &pending, &retried, &timeout);
+	printf("answered %u timeout %u wrong %u, pending %u retried %u timeout %u\n",
+		test.answered, test.timeout, test.wrong, pending, retried, timeout);
+	lost = test.timeout;
+	stall = test_stall(&c);
+	mx_queue_stats(&mx, MX_QUEUE_TX, &tx);
+	printf("stalled link, tx class full: timed out in %.1f ms, tx dropped %u\n",
+		stall / 1e3, tx.dropped);
+
+	__atomic_store_n(&test.run, FALSE, __ATOMIC_RELAXED);
+	pthread_join(test.thread, NULL);
+	mx_destroy(&mx);
+
+	if (test.wrong || lost != 1 || timeout != 1 || pending ||
+			test.answered != 64 + 64 + TEST_PARAMS - 1 || retried == 0) {
+		printf("responses not matched to requests\n");
+		failed = 1;
+	}
+	/* one round trip plus the retry of lost ones, not 64 */
+	if (window * 4 > serial) {
+		printf("window isn't faster than one at a time\n");
+		failed = 1;
+	}
+	/* resends dropped by the full class, not waited for on the rx thread */
+	if (test.timeout != 2 || stall >= TEST_TX_TIMEOUT * 1000ULL / 2 ||
+			tx.dropped < TEST_RETRY) {
+		printf("retry held up rx thread behind full tx class\n");
+		failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,227 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_ring: SPSC ring stress test. producer thread writes a byte
+ * counter in random sized pieces by ring_write() and by ring_reserve()
+ * + ring_commit(), consumer reads it back by ring_peek() + ring_consume()
+ * and sometimes ring_discard(), every byte must be the one expected at
+ * its stream position. indexes start just below 2^32 so they wrap.
+ * prints MB/s for each ring size.
+ * ring_init() must refuse a size of 0 and one whose power of two
+ * doesn't fit unsigned int.
+ *
+ * test_ring [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "ring.h"
+
+/*
+ * macro
+ */
+
+#define TEST_MEGABYTES 16 /* default, per ring size */
+#define TEST_PIECE 512 /* largest write */
+#define TEST_START 0xfffff000u /* head/tail start, wraps soon */
+#define TEST_DISCARD 4096 /* consumer discards once per this many peeks */
+
+/*
+ * data structure
+ */
+
+typedef struct _test_struct {
+	ring_t ring;
+	unsigned long long total; /* bytes producer writes */
+	unsigned long long written; /* producer: bytes stored */
+	unsigned long long read; /* consumer: bytes checked */
+	unsigned long long discarded;
+	unsigned long long wrong; /* bytes not matching stream position */
+	int done; /* producer finished, with atomics */
+} test_t;
+
+/*
+ * functions
+ */
+
+static unsigned int test_random(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+static void* test_producer(void *data)
+{
+	test_t *t = (test_t*)data;
+	unsigned char piece[TEST_PIECE];
+	unsigned char *d;
+	unsigned int seed = 1, i, n, stored;
+	unsigned long long position = 0;
+
+	while (position < t->total) {
+		n = 1 + test_random(&seed) % TEST_PIECE;
+		if (n > t->total - position)
+			n = t->total - position;
+		if (test_random(&seed) & 1) {
+			/* zero copy, like a read(2) into the ring */
+			stored = ring_reserve(&t->ring, &d);
+			if (stored > n)
+				stored = n;
+			for (i = 0; i < stored; i++)
+				d[i] = (unsigned char)(position + i);
+			ring_commit(&t->ring, stored);
+		} else {
+			for (i = 0; i < n; i++)
+				piece[i] = (unsigned char)(position + i);
+			/* whatever doesn't fit is written again next time */
+			stored = ring_write(&t->ring, piece, n);
+		}
+		position += stored;
+		if (stored == 0)
+			sched_yield();
+	}
+	t->written = position;
+	__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void test_consumer(test_t *t)
+{
+	const unsigned char *d;
+	unsigned long long position = 0;
+	unsigned int n, i, peek = 0;
+	int done;
+
+	while (1) {
+		done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+		if (ring_used(&t->ring) > t->ring.size)
+			t->wrong++;
+		if (++peek % TEST_DISCARD == 0) {
+			n = ring_discard(&t->ring, t->ring.size / 2);
+			position += n;
+			t->discarded += n;
+		}
+		n = ring_peek(&t->ring, &d);
+		for (i = 0; i < n; i++) {
+			if (d[i] != (unsigned char)(position + i))
+				t->wrong++;
+		}
+		ring_consume(&t->ring, n);
+		position += n;
+		if (n == 0) {
+			/* 'done' was read before ring turned out empty */
+			if (done)
+				break;
+			sched_yield();
+		}
+	}
+	t->read = position;
+}
+
+static int test_run(unsigned int size, unsigned long long total)
+{
+	static test_t t;
+	pthread_t thread;
+	struct timespec start, end;
+	double second;
+	int failed;
+
+	memset(&t, 0, sizeof(t));
+	if (ring_init(&t.ring, size) < 0) {
+		printf("ring_init(%u) failed\n", size);
+		return -1;
+	}
+	t.ring.head = t.ring.tail = TEST_START;
+	t.ring.head_cache = t.ring.tail_cache = TEST_START;
+	t.total = total;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&thread, NULL, test_producer, &t);
+	test_consumer(&t);
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	second = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	failed = (t.wrong || t.read != t.written || t.written != total);
+	printf("%6u %9.1f %10llu %10u %10llu %s\n", t.ring.size, total / second / 1e6,
+		t.discarded, t.ring.overflow, t.wrong, failed ? "FAIL" : "ok");
+	ring_destroy(&t.ring);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * sizes ring_init() can't round up to a power of two
+ */
+static int test_bounds(void)
+{
+	static const unsigned int size[] = { 0, (1u << 31) + 1, ~0u };
+	ring_t r;
+	unsigned int i;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(size) / sizeof(size[0]); i++) {
+		if (ring_init(&r, size[i]) == 0) {
+			printf("ring_init(%u) not refused\n", size[i]);
+			ring_destroy(&r);
+			failed = 1;
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int size[] = { 64, 1000, 8192, 65536 };
+	unsigned long long total = TEST_MEGABYTES;
+	unsigned int i;
+	int failed;
+
+	failed = test_bounds();
+
+	if (argc > 1)
+		total = strtoull(argv[1], NULL, 0);
+	total <<= 20;
+	printf("  size      MB/s  discarded   overflow      wrong\n");
+	for (i = 0; i < sizeof(size) / sizeof(size[0]); i++) {
+		if (test_run(size[i], total))
+			failed = 1;
+	}
+
+	return failed;
+}
@@ -0,0 +1,244 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_stats: sequence accounting of mx_rx_stats() and mx_stats(). A
+ * device answer switches to PACKET_MODE_SEQ, then blocks of 8 frames
+ * go in with one sequence lost, one late and one duplicated, while a
+ * reader thread polls both stats calls. Counters must come out exact
+ * and never go back while the rx thread writes them. Then several
+ * threads add to one hist_t, no value may get lost.
+ *
+ * test_stats [blocks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mx.h"
+
+/*
+ * macro
+ */
+
+#define TEST_BLOCKS 2000 /* default */
+#define TEST_BLOCK 8 /* frames a block, divides 256 so sequence wraps */
+#define TEST_WAIT 5000 /* ms for rx thread to catch up */
+#define TEST_WRITERS 4 /* threads adding to one histogram */
+#define TEST_VALUES 100000 /* values each of them adds */
+
+/*
+ * data structure
+ */
+
+typedef struct _test_reader_struct {
+	mx_t *mx;
+	gint stop; /* with atomics */
+	guint polls;
+	guint backward; /* counter seen smaller than before */
+} test_reader_t;
+
+typedef struct _test_writer_struct {
+	hist_t *hist;
+	guint index;
+} test_writer_t;
+
+/*
+ * offsets in a block, 2 comes after 3, 4 twice, 5 never
+ */
+static const guchar test_order[TEST_BLOCK] = { 0, 1, 3, 2, 4, 4, 6, 7 };
+
+/*
+ * functions
+ */
+
+static gint test_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	return 0;
+}
+
+static void* test_reader(void *arg)
+{
+	test_reader_t *r = arg;
+	mx_seq_stats_t s, last;
+	mx_stats_t t;
+
+	memset(&last, 0, sizeof(last));
+	while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+		mx_rx_stats(r->mx, ANALOG_DATA_RESPONSE, &s);
+		mx_stats(r->mx, &t);
+		/* lost goes down when a late one shows up, so not checked */
+		if (s.received < last.received || s.duplicate < last.duplicate ||
+				s.reordered < last.reordered)
+			r->backward++;
+		last = s;
+		r->polls++;
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+/*
+ * writer 'i' adds i, i + TEST_WRITERS, ... so sum and max are known
+ */
+static void* test_writer(void *arg)
+{
+	test_writer_t *w = arg;
+	guint n;
+
+	for (n = 0; n < TEST_VALUES; n++)
+		hist_add(w->hist, n * TEST_WRITERS + w->index);
+
+	return NULL;
+}
+
+/*
+ * TEST_WRITERS threads add to one histogram at once
+ */
+static gint test_hist(void)
+{
+	static hist_t h;
+	hist_t copy;
+	pthread_t thread[TEST_WRITERS];
+	test_writer_t writer[TEST_WRITERS];
+	guint64 values = (guint64)TEST_WRITERS * TEST_VALUES;
+	guint i;
+
+	hist_init(&h);
+	for (i = 0; i < TEST_WRITERS; i++) {
+		writer[i].hist = &h;
+		writer[i].index = i;
+		pthread_create(&thread[i], NULL, test_writer, &writer[i]);
+	}
+	for (i = 0; i < TEST_WRITERS; i++)
+		pthread_join(thread[i], NULL);
+	hist_read(&h, &copy);
+	printf("hist writers %u, total %u max %u sum %llu\n", TEST_WRITERS,
+		copy.total, copy.max, copy.sum);
+	if (copy.total != values || h.total != values ||
+			copy.max != values - 1 || copy.sum != values * (values - 1) / 2) {
+		printf("histogram lost values\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void test_send(mx_t *m, packet_t *p, guint mode)
+{
+	packet_encode_mode(p, mode);
+	mx_rx_data(m, (gchar*)p->data, p->data_length);
+}
+
+int main(int argc, char *argv[])
+{
+	static mx_t mx;
+	mx_config_t c;
+	mx_seq_stats_t s;
+	mx_stats_t t;
+	test_reader_t reader;
+	pthread_t thread;
+	packet_t p;
+	guint blocks = TEST_BLOCKS;
+	guint i, j, frames;
+	gint failed = 0;
+
+	if (argc > 1)
+		blocks = atoi(argv[1]);
+	if (blocks < 1)
+		blocks = 1;
+	frames = blocks * TEST_BLOCK;
+	mx_config_default(&c);
+	c.rx.policy = MX_BLOCK;
+	c.rx.timeout = TEST_WAIT;
+	if (mx_init(&mx, test_tx_data, NULL, &c) < 0)
+		return 1;
+
+	memset(&reader, 0, sizeof(reader));
+	reader.mx = &mx;
+	pthread_create(&thread, NULL, test_reader, &reader);
+
+	/* device answer, frames after it carry sequence */
+	memset(&p, 0, sizeof(p));
+	p.type = DEVICE_INFO_RESPONSE;
+	p.raw.device_info.capability = PACKET_MODE_SEQ;
+	test_send(&mx, &p, PACKET_MODE_ASCII);
+
+	memset(&p, 0, sizeof(p));
+	p.type = ANALOG_DATA_RESPONSE;
+	p.raw.analog_data.channel_number = 1;
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < TEST_BLOCK; j++) {
+			p.sequence = i * TEST_BLOCK + test_order[j];
+			p.raw.analog_data.value[0] = p.sequence;
+			test_send(&mx, &p, PACKET_MODE_SEQ);
+		}
+	}
+	for (i = 0; i < TEST_WAIT; i++) {
+		mx_rx_stats(&mx, ANALOG_DATA_RESPONSE, &s);
+		if (s.received >= frames)
+			break;
+		usleep(1000);
+	}
+	__atomic_store_n(&reader.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+
+	mx_rx_stats(&mx, ANALOG_DATA_RESPONSE, &s);
+	mx_stats(&mx, &t);
+	printf("received %u of %u, lost %u duplicate %u reordered %u\n",
+		s.received, frames, s.lost, s.duplicate, s.reordered);
+	printf("reader polls %u, went backward %u\n", reader.polls, reader.backward);
+	mx_stats_dump(&t);
+	mx_destroy(&mx);
+
+	if (s.received != frames || s.lost != blocks || s.duplicate != blocks ||
+			s.reordered != blocks) {
+		printf("sequence counters wrong\n");
+		failed = 1;
+	}
+	if (t.rx_lost != s.lost || t.rx_duplicate != s.duplicate ||
+			t.rx_reordered != s.reordered) {
+		printf("mx_stats() totals differ from mx_rx_stats()\n");
+		failed = 1;
+	}
+	if (reader.backward) {
+		printf("counters went backward\n");
+		failed = 1;
+	}
+	if (test_hist())
+		failed = 1;
+
+	return failed;
+}
@@ -0,0 +1,421 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+/*
+ * test_transport: transport_open() failures and link loss. Opens that
+ * fail (unknown scheme, no port, refused, bad path, busy port, a file
+ * epoll can't poll) must return -1 and leave no descriptor open. A
+ * tcp link whose peer closes must be reported to mx by the transport
+ * rx thread, and by a loop worker when the loop reads it. A loop link
+ * to a peer that stops reading must not hold the worker: a request
+ * times out on time while frames pile up, and once the peer reads
+ * again every frame it gets is whole and in order.
+ *
+ * test_transport
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mx.h"
+#include "transport.h"
+#include "loop.h"
+
+/*
+ * macro
+ */
+
+#define TEST_WAIT 2000 /* ms for link loss to be reported */
+#define TEST_BUFFER 4096 /* socket buffers of stalled link */
+#define TEST_FLOOD 1000 /* ms of frames, fills socket buffers */
+#define TEST_TIMEOUT 100 /* ms, request nobody answers */
+#define TEST_LATE 500 /* ms, worker stuck in a write */
+#define TEST_IDLE 200 /* ms without data, peer drained link */
+
+/*
+ * data structure
+ */
+
+static guint lost; /* link lost callbacks, with atomics */
+static guint64 timed_out; /* ms request timed out at, with atomics */
+
+/*
+ * functions
+ */
+
+static void test_lost(void *arg)
+{
+	__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+}
+
+static guint64 test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void test_timeout(packet_t *request, packet_t *response, void *arg)
+{
+	__atomic_store_n(&timed_out, test_now(), __ATOMIC_RELAXED);
+}
+
+static gint test_tx_data(void *tx_interface, const struct iovec *iov, guint count)
+{
+	return 0;
+}
+
+/*
+ * descriptors open in this process
+ */
+static gint test_fds(void)
+{
+	DIR *d;
+	struct dirent *e;
+	gint n = 0;
+
+	d = opendir("/proc/self/fd");
+	if (d == NULL)
+		return -1;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] != '.')
+			n++;
+	}
+	closedir(d);
+
+	return n - 1; /* opendir() itself */
+}
+
+/*
+ * tcp socket listening on loopback, its port to 'port'
+ */
+static gint test_listen(guint *port)
+{
+	struct sockaddr_in a;
+	socklen_t length = sizeof(a);
+	gint fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&a, sizeof(a)) == -1 || listen(fd, 1) == -1 ||
+			getsockname(fd, (struct sockaddr*)&a, &length) == -1) {
+		close(fd);
+		return -1;
+	}
+	*port = ntohs(a.sin_port);
+
+	return fd;
+}
+
+/*
+ * each of 'uri' must fail without leaving a descriptor behind
+ */
+static gint test_open_fail(mx_t *m, const gchar *uri)
+{
+	transport_t t;
+	gint before, after;
+
+	before = test_fds();
+	if (transport_open(&t, uri, m, NULL) == 0) {
+		printf("%s: opened\n", uri);
+		transport_close(&t);
+		return -1;
+	}
+	after = test_fds();
+	printf("%s: failed, descriptors %d before %d after\n", uri, before, after);
+
+	return (before == after) ? 0 : -1;
+}
+
+/*
+ * transport (thread) or 'loop' reads link to peer which closes, mx
+ * must hear of it once
+ */
+static gint test_lost_link(loop_t *loop)
+{
+	static mx_t mx;
+	mx_config_t c;
+	transport_config_t tc;
+	transport_t t;
+	loop_link_t link;
+	gchar uri[64];
+	guint port, i;
+	gint listen_fd, peer, before, failed = 0;
+
+	__atomic_store_n(&lost, 0, __ATOMIC_RELAXED);
+	before = test_fds();
+	listen_fd = test_listen(&port);
+	if (listen_fd == -1)
+		return -1;
+	mx_config_default(&c);
+	c.thread = (loop == NULL);
+	if (mx_init(&mx, transport_tx_data, &t, &c) < 0)
+		return -1;
+	mx_link_notify(&mx, test_lost, NULL);
+	transport_config_default(&tc);
+	tc.thread = (loop == NULL);
+	snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%u", port);
+	if (transport_open(&t, uri, &mx, &tc) < 0) {
+		mx_destroy(&mx);
+		close(listen_fd);
+		return -1;
+	}
+	if (loop && loop_add(loop, &link, &t) < 0)
+		failed = -1;
+	peer = accept(listen_fd, NULL, NULL);
+	if (peer == -1)
+		failed = -1;
+	if (!mx_link_active(&mx) || __atomic_load_n(&lost, __ATOMIC_RELAXED)) {
+		printf("link reported lost while up\n");
+		failed = -1;
+	}
+	close(peer);
+	for (i = 0; i < TEST_WAIT; i++) {
+		if (!mx_link_active(&mx))
+			break;
+		usleep(1000);
+	}
+	printf("%s: link lost reported %u time(s) after %u ms\n",
+		loop ? "loop" : "rx thread", __atomic_load_n(&lost, __ATOMIC_RELAXED), i);
+	if (mx_link_active(&mx) || __atomic_load_n(&lost, __ATOMIC_RELAXED) != 1)
+		failed = -1;
+
+	if (loop && failed == 0)
+		loop_remove(loop, &link);
+	transport_close(&t);
+	mx_destroy(&mx);
+	close(listen_fd);
+	if (test_fds() != before) {
+		printf("descriptors left open\n");
+		failed = -1;
+	}
+
+	return failed;
+}
+
+/*
+ * queue DEVICE_MOTOR_CONTROL 'sequence'
+ */
+static void test_queue(mx_t *m, guint sequence)
+{
+	packet_t p;
+
+	memset(&p, 0, sizeof(p));
+	p.type = DEVICE_MOTOR_CONTROL;
+	p.raw.motor_control.motor_number = 2;
+	p.raw.motor_control.value[0] = sequence & 0xffff;
+	p.raw.motor_control.value[1] = sequence >> 16;
+	mx_tx_packet(m, &p);
+}
+
+/*
+ * read 'peer' until it stays idle, frames must decode and sequences
+ * of DEVICE_MOTOR_CONTROL rise. return frames read, -1 on a bad one
+ */
+static gint test_drain(gint peer)
+{
+	unsigned char buffer[4096];
+	packet_framer_t f;
+	packet_t p;
+	struct pollfd pfd;
+	guint offset, used, sequence, frames = 0;
+	gint64 last = -1;
+	gssize n;
+	gint bad = 0;
+
+	packet_framer_init(&f);
+	pfd.fd = peer;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, TEST_IDLE) == 1) {
+		n = read(peer, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+		for (offset = 0; offset < n; offset += used) {
+			if (packet_framer_feed(&f, &p, buffer + offset, n - offset,
+					&used) != PACKET_SUCCESS)
+				break;
+			if (packet_decode(&p) != PACKET_SUCCESS) {
+				bad++;
+				continue;
+			}
+			frames++;
+			if (p.type != DEVICE_MOTOR_CONTROL)
+				continue;
+			sequence = p.raw.motor_control.value[0] |
+				p.raw.motor_control.value[1] << 16;
+			if ((gint64)sequence <= last)
+				bad++;
+			last = sequence;
+		}
+	}
+	printf("peer read %u frames, %d broken or out of order\n", frames, bad);
+
+	return bad ? -1 : (gint)frames;
+}
+
+/*
+ * 'loop' writes to peer which doesn't read, worker must go on serving
+ * the link: a request times out on time, then peer gets whole frames
+ */
+static gint test_stalled_link(loop_t *loop)
+{
+	static mx_t mx;
+	mx_config_t c;
+	transport_config_t tc;
+	transport_t t;
+	loop_link_t link;
+	packet_t p;
+	gchar uri[64];
+	guint64 start, late;
+	guint port, sequence = 0;
+	gint listen_fd, peer, frames, size = TEST_BUFFER, failed = 0;
+	gboolean served, stalled;
+
+	__atomic_store_n(&timed_out, 0, __ATOMIC_RELAXED);
+	listen_fd = test_listen(&port);
+	if (listen_fd == -1)
+		return -1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	mx_config_default(&c);
+	c.thread = FALSE;
+	if (mx_init(&mx, transport_tx_data, &t, &c) < 0) {
+		close(listen_fd);
+		return -1;
+	}
+	transport_config_default(&tc);
+	tc.thread = FALSE;
+	snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%u", port);
+	if (transport_open(&t, uri, &mx, &tc) < 0) {
+		mx_destroy(&mx);
+		close(listen_fd);
+		return -1;
+	}
+	setsockopt(t.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	peer = accept(listen_fd, NULL, NULL);
+	served = peer != -1 && loop_add(loop, &link, &t) == 0;
+	if (served) {
+		start = test_now();
+		while (test_now() - start < TEST_FLOOD) {
+			test_queue(&mx, sequence++);
+			usleep(10);
+		}
+		memset(&p, 0, sizeof(p));
+		p.type = DEVICE_PARAM_REQUEST;
+		p.raw.device_param.index = 1;
+		start = test_now();
+		if (mx_request(&mx, &p, TEST_TIMEOUT, 0, test_timeout, NULL) < 0)
+			failed = -1;
+		while (__atomic_load_n(&timed_out, __ATOMIC_RELAXED) == 0 &&
+				test_now() - start < TEST_WAIT) {
+			test_queue(&mx, sequence++);
+			usleep(10);
+		}
+		stalled = transport_tx_pending(&t);
+		late = __atomic_load_n(&timed_out, __ATOMIC_RELAXED);
+		late = late ? late - start : TEST_WAIT;
+		printf("stalled link: %u frames queued, request timed out after %u ms, "
+			"tx %s\n", sequence, (guint)late, stalled ? "pending" : "idle");
+		if (!stalled || late > TEST_LATE)
+			failed = -1;
+		frames = test_drain(peer);
+		if (frames <= 0 || transport_tx_pending(&t)) {
+			printf("stalled link: not drained\n");
+			failed = -1;
+		}
+		loop_remove(loop, &link);
+	} else {
+		failed = -1;
+	}
+	transport_close(&t);
+	mx_destroy(&mx);
+	if (peer != -1)
+		close(peer);
+	close(listen_fd);
+
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	static mx_t mx;
+	static loop_t loop;
+	mx_config_t c;
+	gchar uri[64];
+	guint port;
+	gint busy, failed = 0;
+
+	mx_config_default(&c);
+	if (mx_init(&mx, test_tx_data, NULL, &c) < 0)
+		return 1;
+	busy = test_listen(&port);
+	if (busy == -1)
+		return 1;
+	if (test_open_fail(&mx, "nosuch://127.0.0.1:1") < 0 ||
+			test_open_fail(&mx, "tcp://127.0.0.1") < 0 ||
+			test_open_fail(&mx, "unix:///nonexistent/amcc.sock") < 0 ||
+			test_open_fail(&mx, "unix-listen:///nonexistent/amcc.sock") < 0 ||
+			test_open_fail(&mx, "/nonexistent/ttyUSB0") < 0 ||
+			test_open_fail(&mx, "/dev/null") < 0)
+		failed = 1;
+	snprintf(uri, sizeof(uri), "tcp-listen://127.0.0.1:%u", port);
+	if (test_open_fail(&mx, uri) < 0)
+		failed = 1;
+	close(busy);
+	/* nothing listens there now */
+	snprintf(uri, sizeof(uri), "tcp://127.0.0.1:%u", port);
+	if (test_open_fail(&mx, uri) < 0)
+		failed = 1;
+	mx_destroy(&mx);
+
+	if (test_lost_link(NULL) < 0)
+		failed = 1;
+	if (loop_init(&loop, 1) < 0)
+		return 1;
+	if (test_lost_link(&loop) < 0)
+		failed = 1;
+	if (test_stalled_link(&loop) < 0)
+		failed = 1;
+	loop_destroy(&loop);
+
+	return failed;
+}
@@ -0,0 +1,830 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+
+#define _GNU_SOURCE /* accept4(), recvmmsg() */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "transport.h"
+
+/*
+ * server lost its client: close it and wait for next one, -1 for
+ * everybody else
+ */
+static gint transport_hangup(transport_t *t)
+{
+	if (t->listen_fd == -1)
+		return -1;
+	pthread_mutex_lock(&t->mutex);
+	close(t->fd);
+	t->fd = -1;
+	t->tx_pending_length = 0;
+	pthread_mutex_unlock(&t->mutex);
+
+	return 0;
+}
+
+static void transport_nodelay(gint fd)
+{
+	gint one = 1;
+
+	/* frames are small and latency counts, unix sockets just refuse */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * one client at a time, next ones wait in backlog until it leaves
+ */
+static gint transport_accept(transport_t *t)
+{
+	gint fd;
+
+	fd = accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) ? 0 : -1;
+	transport_nodelay(fd);
+	pthread_mutex_lock(&t->mutex);
+	t->fd = fd;
+	pthread_mutex_unlock(&t->mutex);
+
+	return 0;
+}
+
+/*
+ * serial port, tcp, unix: read straight into rx ring of mx while it
+ * has room, servers accept a client first
+ */
+static gint transport_stream_read(transport_t *t)
+{
+	gchar buffer[TRANSPORT_READ_LENGTH];
+	gchar *p;
+	guint room;
+	gssize length;
+
+	if (t->fd == -1)
+		return transport_accept(t);
+	while (1) {
+		room = mx_rx_reserve(t->mx, &p);
+		if (room == 0) {
+			/* ring is full, mx_rx_data() drops and counts them */
+			p = buffer;
+			room = sizeof(buffer);
+		}
+		length = read(t->fd, p, room);
+		if (length < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (length <= 0)
+			return transport_hangup(t);
+		if (p == buffer) {
+			mx_rx_data(t->mx, buffer, length);
+		} else {
+			mx_rx_commit(t->mx, length);
+		}
+		/* short read took all there was, save a read() ending in EAGAIN */
+		if ((guint)length < room)
+			return 0;
+	}
+}
+
+/*
+ * udp: up to TRANSPORT_UDP_BATCH datagrams per recvmmsg(), a datagram
+ * holds whole frames. udp-listen answers whoever sent last.
+ */
+static gint transport_udp_read(transport_t *t)
+{
+	struct mmsghdr msg[TRANSPORT_UDP_BATCH];
+	struct iovec iov[TRANSPORT_UDP_BATCH];
+	struct sockaddr_storage from[TRANSPORT_UDP_BATCH];
+	gint i, n;
+
+	do {
+		memset(msg, 0, sizeof(msg));
+		for (i = 0; i < TRANSPORT_UDP_BATCH; i++) {
+			iov[i].iov_base = t->datagram + i * TRANSPORT_DATAGRAM_LENGTH;
+			iov[i].iov_len = TRANSPORT_DATAGRAM_LENGTH;
+			msg[i].msg_hdr.msg_name = &from[i];
+			msg[i].msg_hdr.msg_namelen = sizeof(from[i]);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(t->fd, msg, TRANSPORT_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			/* ECONNREFUSED: ICMP for an earlier send, peer isn't up (yet) */
+			return (errno == EAGAIN || errno == EINTR ||
+				errno == ECONNREFUSED) ? 0 : -1;
+		}
+		for (i = 0; i < n; i++)
+			mx_rx_data(t->mx, iov[i].iov_base, msg[i].msg_len);
+		if (n > 0 && t->server) {
+			pthread_mutex_lock(&t->mutex);
+			memcpy(&t->peer, &from[n - 1], msg[n - 1].msg_hdr.msg_namelen);
+			t->peer_length = msg[n - 1].msg_hdr.msg_namelen;
+			pthread_mutex_unlock(&t->mutex);
+		}
+	} while (n == TRANSPORT_UDP_BATCH);
+
+	return 0;
+}
+
+/*
+ * with t->mutex: one send of 'iov', as much as link takes without
+ * waiting. serial port by writev(), sockets by sendmsg(), so a tx batch
+ * is one udp datagram
+ */
+static gssize transport_writev(transport_t *t, const struct iovec *iov, guint count)
+{
+	struct msghdr msg;
+
+	if (t->serial.fd != -1)
+		return writev(t->fd, iov, count);
+	memset(&msg, 0, sizeof(msg));
+	if (t->peer_length) {
+		msg.msg_name = &t->peer;
+		msg.msg_namelen = t->peer_length;
+	}
+	msg.msg_iov = (struct iovec*)iov;
+	msg.msg_iovlen = count;
+	/* no client yet (tcp-listen) fails with EBADF */
+	return sendmsg(t->fd, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * rx thread: all of 'iov', partial sends go on where they stopped,
+ * EAGAIN waits until link is writable again. t->mutex is only held
+ * around each send, rx thread may drop or take a client meanwhile, the
+ * rest isn't sent to another one then
+ */
+static gint transport_send_wait(transport_t *t, const struct iovec *iov, guint count)
+{
+	struct iovec v[MX_TX_BATCH];
+	struct pollfd pfd;
+	guint i, n;
+	gssize len;
+	gint fd, ret, error, total = 0;
+
+	pthread_mutex_lock(&t->mutex);
+	fd = t->fd;
+	pthread_mutex_unlock(&t->mutex);
+	while (count > 0 && total >= 0) {
+		n = count < MX_TX_BATCH ? count : MX_TX_BATCH;
+		memcpy(v, iov, n * sizeof(struct iovec));
+		iov += n;
+		count -= n;
+		i = 0;
+		while (i < n) {
+			pthread_mutex_lock(&t->mutex);
+			len = -1;
+			error = EPIPE;
+			if (t->fd == fd) {
+				len = transport_writev(t, v + i, n - i);
+				error = errno;
+			}
+			pthread_mutex_unlock(&t->mutex);
+			if (len < 0) {
+				if (error == EINTR)
+					continue;
+				if (error != EAGAIN) {
+					total = -1;
+					break;
+				}
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				ret = poll(&pfd, 1, TRANSPORT_TX_TIMEOUT);
+				if (ret == 0 || (ret < 0 && errno != EINTR)) {
+					total = -1;
+					break;
+				}
+				continue;
+			}
+			total += len;
+			/* skip sent buffers, a partly sent one is advanced */
+			while (i < n && (gsize)len >= v[i].iov_len) {
+				len -= v[i].iov_len;
+				i++;
+			}
+			if (i < n) {
+				v[i].iov_base = (gchar*)v[i].iov_base + len;
+				v[i].iov_len -= len;
+			}
+		}
+	}
+
+	return total;
+}
+
+/*
+ * with t->mutex: send what waits in tx_pending, -1 when link failed
+ */
+static gint transport_flush_pending(transport_t *t)
+{
+	struct iovec v;
+	gssize len;
+
+	if (t->tx_pending_length == 0)
+		return 0;
+	v.iov_base = t->tx_pending;
+	v.iov_len = t->tx_pending_length;
+	len = transport_writev(t, &v, 1);
+	if (len < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	t->tx_pending_length -= len;
+	memmove(t->tx_pending, t->tx_pending + len, t->tx_pending_length);
+
+	return 0;
+}
+
+/*
+ * loop (config.thread FALSE), never waits: bytes the link doesn't take
+ * now are kept in tx_pending behind what already waits there, the
+ * owner sends them by transport_flush() once transport_fd() is
+ * writable. returns bytes link took now, may be short or 0. a batch
+ * not fitting in tx_pending is refused whole, so stream framing holds,
+ * and a udp datagram is dropped when the socket can't take it
+ */
+static gint transport_send_later(transport_t *t, const struct iovec *iov, guint count)
+{
+	gsize length = 0, skip;
+	gssize len = 0;
+	guint i;
+
+	for (i = 0; i < count; i++)
+		length += iov[i].iov_len;
+	pthread_mutex_lock(&t->mutex);
+	if (transport_flush_pending(t) < 0 ||
+			t->tx_pending_length + length > TRANSPORT_TX_PENDING) {
+		pthread_mutex_unlock(&t->mutex);
+		return -1;
+	}
+	if (t->tx_pending_length == 0) {
+		len = transport_writev(t, iov, count);
+		if (len < 0 && errno != EAGAIN && errno != EINTR) {
+			pthread_mutex_unlock(&t->mutex);
+			return -1;
+		}
+		if (len < 0)
+			len = 0;
+		if ((gsize)len < length && t->datagram) {
+			pthread_mutex_unlock(&t->mutex);
+			return -1;
+		}
+	}
+	if (t->tx_pending == NULL && (gsize)len < length)
+		t->tx_pending = g_malloc(TRANSPORT_TX_PENDING);
+	skip = len;
+	for (i = 0; i < count; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memcpy(t->tx_pending + t->tx_pending_length,
+			(gchar*)iov[i].iov_base + skip, iov[i].iov_len - skip);
+		t->tx_pending_length += iov[i].iov_len - skip;
+		skip = 0;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return len;
+}
+
+static gint transport_send(transport_t *t, const struct iovec *iov, guint count)
+{
+	if (!t->config.thread)
+		return transport_send_later(t, iov, count);
+	return transport_send_wait(t, iov, count);
+}
+
+/*
+ * "host:port" or "[v6 host]:port", host may be left out for listening
+ */
+static struct addrinfo* transport_resolve(const gchar *address, gint type, gboolean server)
+{
+	struct addrinfo hints, *ai;
+	const gchar *port;
+	gchar host[NI_MAXHOST];
+	gsize n;
+
+	port = strrchr(address, ':');
+	if (port == NULL) {
+		fprintf(stderr, "%s: port missing\n", address);
+		return NULL;
+	}
+	n = port - address;
+	if (n >= 2 && address[0] == '[' && address[n - 1] == ']') {
+		address++;
+		n -= 2;
+	}
+	if (n >= sizeof(host))
+		return NULL;
+	memcpy(host, address, n);
+	host[n] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = server ? AI_PASSIVE : 0;
+	if (getaddrinfo(n ? host : NULL, port + 1, &hints, &ai)) {
+		fprintf(stderr, "Unable to resolve %s\n", address);
+		return NULL;
+	}
+
+	return ai;
+}
+
+/*
+ * connect non-blocking 'fd', an unreachable host fails after
+ * TRANSPORT_CONNECT_TIMEOUT instead of kernel's minutes of SYN retries,
+ * so next address gets its turn
+ */
+static gint transport_connect(gint fd, const struct sockaddr *a, socklen_t length)
+{
+	struct pollfd pfd;
+	socklen_t n = sizeof(gint);
+	gint ret, error = 0;
+
+	if (connect(fd, a, length) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	do {
+		ret = poll(&pfd, 1, TRANSPORT_CONNECT_TIMEOUT);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &n) < 0 || error)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * connected (or bound, 'server') non-blocking socket to 'address'
+ */
+static gint transport_socket(const gchar *address, gint type, gboolean server)
+{
+	struct addrinfo *ai, *a;
+	gint fd = -1, one = 1;
+
+	ai = transport_resolve(address, type, server);
+	if (ai == NULL)
+		return -1;
+	for (a = ai; a; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			a->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (server) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 &&
+					(type != SOCK_STREAM || listen(fd, 1) == 0))
+				break;
+		} else if (transport_connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd == -1) {
+		fprintf(stderr, "Unable to %s %s\n", server ? "listen on" : "connect to",
+			address);
+		return -1;
+	}
+	if (type == SOCK_STREAM && !server)
+		transport_nodelay(fd);
+
+	return fd;
+}
+
+static gint transport_unix_socket(const gchar *address, gboolean server)
+{
+	struct sockaddr_un a;
+	gint fd, ret;
+
+	if (strlen(address) >= sizeof(a.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", address);
+		return -1;
+	}
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	strcpy(a.sun_path, address);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (server) {
+		/* left by a run which didn't get to close it */
+		unlink(address);
+		ret = bind(fd, (struct sockaddr*)&a, sizeof(a));
+		if (ret == 0)
+			ret = listen(fd, 1);
+	} else {
+		ret = connect(fd, (struct sockaddr*)&a, sizeof(a));
+	}
+	if (ret == -1) {
+		fprintf(stderr, "Unable to %s %s\n", server ? "listen on" : "connect to",
+			address);
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	return fd;
+}
+
+static gint transport_serial_open(transport_t *t, const gchar *address)
+{
+	serial_set_rx_mode(&t->serial, t->config.rx_mode);
+	if (serial_open(&t->serial, (gchar*)address, t->config.baudrate) == -1)
+		return -1;
+	t->fd = t->serial.fd;
+	/* VMIN holds input back, pick up a frame tail short of it */
+	if (t->config.rx_mode == SERIAL_RX_BATCH)
+		t->linger = SERIAL_RX_LINGER;
+
+	return 0;
+}
+
+static void transport_serial_close(transport_t *t)
+{
+	serial_close(&t->serial);
+}
+
+static gint transport_tcp_open(transport_t *t, const gchar *address)
+{
+	t->fd = transport_socket(address, SOCK_STREAM, FALSE);
+	return (t->fd == -1) ? -1 : 0;
+}
+
+static gint transport_tcp_listen_open(transport_t *t, const gchar *address)
+{
+	t->server = TRUE;
+	t->listen_fd = transport_socket(address, SOCK_STREAM, TRUE);
+	return (t->listen_fd == -1) ? -1 : 0;
+}
+
+static gint transport_udp_open(transport_t *t, const gchar *address)
+{
+	t->fd = transport_socket(address, SOCK_DGRAM, FALSE);
+	if (t->fd == -1)
+		return -1;
+	t->datagram = g_malloc(TRANSPORT_UDP_BATCH * TRANSPORT_DATAGRAM_LENGTH);
+
+	return 0;
+}
+
+static gint transport_udp_listen_open(transport_t *t, const gchar *address)
+{
+	t->server = TRUE;
+	t->fd = transport_socket(address, SOCK_DGRAM, TRUE);
+	if (t->fd == -1)
+		return -1;
+	t->datagram = g_malloc(TRANSPORT_UDP_BATCH * TRANSPORT_DATAGRAM_LENGTH);
+
+	return 0;
+}
+
+static gint transport_unix_open(transport_t *t, const gchar *address)
+{
+	t->fd = transport_unix_socket(address, FALSE);
+	return (t->fd == -1) ? -1 : 0;
+}
+
+static gint transport_unix_listen_open(transport_t *t, const gchar *address)
+{
+	t->server = TRUE;
+	t->listen_fd = transport_unix_socket(address, TRUE);
+	if (t->listen_fd == -1)
+		return -1;
+	strcpy(t->path, address);
+
+	return 0;
+}
+
+static void transport_socket_close(transport_t *t)
+{
+	if (t->fd != -1)
+		close(t->fd);
+	if (t->listen_fd != -1)
+		close(t->listen_fd);
+	if (t->path[0])
+		unlink(t->path);
+	g_free(t->datagram);
+	t->datagram = NULL;
+}
+
+/*
+ * servers wait on listen_fd until a client is there
+ */
+static gint transport_link_fd(transport_t *t)
+{
+	return (t->fd != -1) ? t->fd : t->listen_fd;
+}
+
+/* first one is taken for a uri without scheme */
+static const transport_ops_t transport_ops[] = {
+	{ "serial", transport_serial_open, transport_stream_read,
+		transport_send, transport_serial_close, transport_link_fd },
+	{ "tcp", transport_tcp_open, transport_stream_read,
+		transport_send, transport_socket_close, transport_link_fd },
+	{ "tcp-listen", transport_tcp_listen_open, transport_stream_read,
+		transport_send, transport_socket_close, transport_link_fd },
+	{ "udp", transport_udp_open, transport_udp_read,
+		transport_send, transport_socket_close, transport_link_fd },
+	{ "udp-listen", transport_udp_listen_open, transport_udp_read,
+		transport_send, transport_socket_close, transport_link_fd },
+	{ "unix", transport_unix_open, transport_stream_read,
+		transport_send, transport_socket_close, transport_link_fd },
+	{ "unix-listen", transport_unix_listen_open, transport_stream_read,
+		transport_send, transport_socket_close, transport_link_fd },
+};
+
+#define TRANSPORT_OPS_NUMBER (sizeof(transport_ops) / sizeof(transport_ops[0]))
+
+/*
+ * keep epoll set on fd(), it changes when a server gets or loses its
+ * client. a closed fd has left the set by itself. -1: fd can't be
+ * polled (eg: a regular file given as serial port)
+ */
+static gint transport_rearm(transport_t *t)
+{
+	struct epoll_event event;
+	gint fd = t->ops->fd(t);
+
+	if (fd == t->rx_fd)
+		return 0;
+	if (t->rx_fd != -1)
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, t->rx_fd, NULL);
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	t->rx_fd = fd;
+
+	return epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*
+ * linger: serial SERIAL_RX_BATCH, tty reports input only once VMIN
+ * bytes are in (VTIME 0), a frame tail short of it is read on timeout
+ */
+static void* transport_rx_thread(void *data)
+{
+	transport_t *t = (transport_t*)data;
+	struct epoll_event event[2];
+	gint n;
+
+	while (__atomic_load_n(&t->active, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(t->epoll_fd, event, 2, t->linger);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			g_print("epoll_wait failed\n");
+			break;
+		}
+		if (n == 1 && event[0].data.fd == t->wake_fd)
+			continue; /* transport_close() */
+		if (t->ops->read(t) == -1) {
+			/* eg: USB adapter unplugged, peer closed */
+			g_print("%s link lost\n", t->ops->scheme);
+			mx_link_lost(t->mx);
+			break;
+		}
+		transport_rearm(t);
+	}
+
+	return NULL;
+}
+
+/*
+ * wake_fd is left open only while rx thread runs
+ */
+static gint transport_rx_start(transport_t *t)
+{
+	struct epoll_event event;
+
+	t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (t->epoll_fd != -1 && t->wake_fd != -1) {
+		event.events = EPOLLIN;
+		event.data.fd = t->wake_fd;
+		if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->wake_fd, &event) == 0 &&
+				transport_rearm(t) == 0 &&
+				pthread_create(&t->thread_rx, NULL, transport_rx_thread,
+					(void*)t) == 0)
+			return 0;
+	}
+	if (t->epoll_fd != -1)
+		close(t->epoll_fd);
+	if (t->wake_fd != -1)
+		close(t->wake_fd);
+	t->epoll_fd = -1;
+	t->wake_fd = -1;
+	t->rx_fd = -1;
+
+	return -1;
+}
+
+void transport_config_default(transport_config_t *c)
+{
+	c->baudrate = 57600;
+	c->rx_mode = SERIAL_RX_LOW_LATENCY;
+	c->thread = TRUE;
+}
+
+/*
+ * 'uri' is "scheme://address", a plain path is a serial port:
+ *	/dev/ttyUSB0, serial:///dev/ttyUSB0
+ *	tcp://host:port, tcp-listen://[host]:port
+ *	udp://host:port, udp-listen://[host]:port
+ *	unix:///path, unix-listen:///path
+ * what is read goes to 'mx', give transport_tx_data() and 't' to
+ * mx_init() for writing. 'config' NULL for transport_config_default()
+ */
+gint transport_open(transport_t *t, const gchar *uri, mx_t *mx,
+			const transport_config_t *config)
+{
+	const transport_ops_t *ops = NULL;
+	const gchar *address;
+	guint i;
+
+	if (config) {
+		memcpy(&t->config, config, sizeof(transport_config_t));
+	} else {
+		transport_config_default(&t->config);
+	}
+	t->ops = NULL;
+	t->mx = mx;
+	t->active = FALSE;
+	t->linger = -1;
+	t->epoll_fd = -1;
+	t->wake_fd = -1;
+	t->rx_fd = -1;
+	t->fd = -1;
+	t->listen_fd = -1;
+	t->server = FALSE;
+	t->peer_length = 0;
+	t->datagram = NULL;
+	t->tx_pending = NULL;
+	t->tx_pending_length = 0;
+	t->path[0] = '\0';
+	serial_init(&t->serial);
+	pthread_mutex_init(&t->mutex, NULL);
+
+	address = strstr(uri, "://");
+	if (address == NULL) {
+		ops = &transport_ops[0];
+		address = uri;
+	} else {
+		for (i = 0; i < TRANSPORT_OPS_NUMBER; i++) {
+			if (strlen(transport_ops[i].scheme) == (gsize)(address - uri) &&
+					strncmp(transport_ops[i].scheme, uri, address - uri) == 0)
+				ops = &transport_ops[i];
+		}
+		address += 3;
+	}
+	if (ops == NULL) {
+		fprintf(stderr, "%s: unknown transport\n", uri);
+		return -1;
+	}
+	if (ops->open(t, address) == -1) {
+		/* whatever it got before failing */
+		ops->close(t);
+		return -1;
+	}
+	t->ops = ops;
+	__atomic_store_n(&t->active, TRUE, __ATOMIC_RELEASE);
+	if (t->config.thread && transport_rx_start(t) == -1) {
+		fprintf(stderr, "Unable to start reading %s\n", uri);
+		transport_close(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * config.thread FALSE: owner calls it when transport_fd() is readable,
+ * and takes transport_fd() again after it. -1: link lost
+ */
+gint transport_read(transport_t *t)
+{
+	return t->ops->read(t);
+}
+
+gint transport_fd(transport_t *t)
+{
+	return t->ops->fd(t);
+}
+
+/*
+ * config.thread FALSE: TRUE while tx bytes wait for transport_fd() to
+ * be writable, owner waits for that and calls transport_flush()
+ */
+gboolean transport_tx_pending(transport_t *t)
+{
+	gboolean pending;
+
+	pthread_mutex_lock(&t->mutex);
+	pending = t->tx_pending_length > 0;
+	pthread_mutex_unlock(&t->mutex);
+
+	return pending;
+}
+
+/*
+ * config.thread FALSE: send what waits without waiting for more room,
+ * -1: link lost
+ */
+gint transport_flush(transport_t *t)
+{
+	gint ret;
+
+	pthread_mutex_lock(&t->mutex);
+	ret = transport_flush_pending(t);
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+/*
+ * TX_DATA of mx_init(), 'p' is transport_t. config.thread FALSE: never
+ * waits and may take fewer bytes than given, see transport_send_later()
+ */
+gint transport_tx_data(void *p, const struct iovec *iov, guint count)
+{
+	transport_t *t = (transport_t*)p;
+	const transport_ops_t *ops;
+
+	ops = __atomic_load_n(&t->ops, __ATOMIC_ACQUIRE);
+	if (ops == NULL || !__atomic_load_n(&t->active, __ATOMIC_ACQUIRE))
+		return -1;
+	return ops->write(t, iov, count);
+}
+
+/*
+ * rx thread is stopped before link is closed, mx may be destroyed after
+ */
+void transport_close(transport_t *t)
+{
+	guint64 one = 1;
+	gssize ret;
+
+	if (t->ops == NULL)
+		return;
+	__atomic_store_n(&t->active, FALSE, __ATOMIC_RELEASE);
+	if (t->wake_fd != -1) {
+		ret = write(t->wake_fd, &one, sizeof(one));
+		(void)ret;
+		pthread_join(t->thread_rx, NULL);
+		close(t->wake_fd);
+		close(t->epoll_fd);
+		t->wake_fd = -1;
+		t->epoll_fd = -1;
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->ops->close(t);
+	t->fd = -1;
+	t->listen_fd = -1;
+	g_free(t->tx_pending);
+	t->tx_pending = NULL;
+	t->tx_pending_length = 0;
+	pthread_mutex_unlock(&t->mutex);
+	__atomic_store_n(&t->ops, NULL, __ATOMIC_RELEASE);
+}
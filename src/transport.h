@@ -0,0 +1,122 @@
+/*
+* Copyright 2011 Anders Ma (andersma.net). All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+*
+* 3. The name of the copyright holder may not be used to endorse or promote
+* products derived from this software without specific prior written
+* permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL WILLIAM TISÄTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <glib.h>
+#include "mx.h"
+#include "serial.h"
+
+/*
+ * macro 
+ */
+
+#define TRANSPORT_READ_LENGTH 4096 /* read() size when rx ring is full */
+#define TRANSPORT_UDP_BATCH 16 /* datagrams taken by one recvmmsg() */
+#define TRANSPORT_DATAGRAM_LENGTH 2048
+#define TRANSPORT_TX_TIMEOUT 1000 /* ms, link not writable, rx thread only */
+#define TRANSPORT_TX_PENDING 65536 /* bytes kept for a link not writable, loop */
+#define TRANSPORT_CONNECT_TIMEOUT 3000 /* ms, tcp connect() per address */
+
+/*
+ * data structure 
+ */
+
+struct _transport_struct;
+typedef struct _transport_struct transport_t;
+
+/*
+ * one kind of link, picked by scheme of uri given to transport_open().
+ * read() takes what fd() has to mx, return -1 when link is lost,
+ * fd() may change after read() (eg: server accepted a client).
+ */
+typedef struct _transport_ops_struct {
+	const gchar *scheme;
+	gint (*open)(transport_t *t, const gchar *address);
+	gint (*read)(transport_t *t);
+	gint (*write)(transport_t *t, const struct iovec *iov, guint count);
+	void (*close)(transport_t *t);
+	gint (*fd)(transport_t *t);
+} transport_ops_t;
+
+/*
+ * transport_config_default() gives the defaults.
+ * thread FALSE: owner waits on transport_fd() and calls transport_read(),
+ * and transport_flush() while transport_tx_pending()
+ */
+typedef struct _transport_config_struct {
+	guint baudrate; /* serial */
+	guint rx_mode; /* serial, SERIAL_RX_* */
+	gboolean thread;
+} transport_config_t;
+
+struct _transport_struct {
+	const transport_ops_t *ops;
+	transport_config_t config;
+	mx_t *mx;
+	gboolean active;
+	gint linger; /* ms, read() also after this long without input, -1 never */
+	pthread_t thread_rx;
+	gint epoll_fd;
+	gint wake_fd; /* eventfd, stops rx thread */
+	gint rx_fd; /* fd() in epoll set */
+
+	pthread_mutex_t mutex; /* write() against close, fd / peer / tx_pending change */
+	gint fd; /* serial port, connected / bound socket, -1 no client yet */
+	gint listen_fd; /* tcp-listen, unix-listen */
+	gboolean server; /* *-listen */
+	serial_t serial;
+	struct sockaddr_storage peer; /* udp-listen: last sender, replies go there */
+	socklen_t peer_length; /* 0: nobody sent yet */
+	gchar *datagram; /* udp: TRANSPORT_UDP_BATCH buffers */
+	gchar *tx_pending; /* !config.thread: bytes link didn't take yet */
+	gsize tx_pending_length;
+	gchar path[108]; /* unix-listen: socket file, removed on close */
+};
+
+/*
+ * functions
+ */
+
+extern void transport_config_default(transport_config_t *c);
+extern gint transport_open(transport_t *t, const gchar *uri, mx_t *mx,
+			const transport_config_t *config);
+extern gint transport_read(transport_t *t);
+extern gint transport_fd(transport_t *t);
+extern gboolean transport_tx_pending(transport_t *t);
+extern gint transport_flush(transport_t *t);
+extern gint transport_tx_data(void *p, const struct iovec *iov, guint count);
+extern void transport_close(transport_t *t);
+
+#endif